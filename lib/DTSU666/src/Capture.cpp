@@ -0,0 +1,90 @@
+/**
+ * @file Capture.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Capture of the frames on the RS485 line, timestamped, in a ring buffer
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <Capture.h>
+#include <ModbusCrc.h>
+
+// a record: micros() (4 bytes), direction, length, the frame
+#define RECORD_HEADER   6
+
+void FrameCapture::put(const uint8_t * data, size_t len) {
+  size_t first = min(len, sizeof(_ring) - _head);
+  memcpy(&_ring[_head], data, first);
+  memcpy(_ring, data + first, len - first);
+  _head = (_head + len) % sizeof(_ring);
+  _used += len;
+}
+
+void FrameCapture::get(uint8_t * data, size_t len) {
+  size_t first = min(len, sizeof(_ring) - _tail);
+  memcpy(data, &_ring[_tail], first);
+  memcpy(data + first, _ring, len - first);
+  _tail = (_tail + len) % sizeof(_ring);
+  _used -= len;
+}
+
+void FrameCapture::record(captureDir dir, const uint8_t * frame, size_t len) {
+  if (len == 0 || len > 255 || _used + RECORD_HEADER + len > sizeof(_ring)) {
+    _dropped++;
+    return;
+  }
+  uint32_t us = micros();
+  uint8_t header[RECORD_HEADER] = { (uint8_t) (us >> 24), (uint8_t) (us >> 16), (uint8_t) (us >> 8), (uint8_t) us,
+                                    (uint8_t) dir, (uint8_t) len };
+  put(header, sizeof(header));
+  put(frame, len);
+  _captured++;
+}
+
+void FrameCapture::recordPdu(uint8_t slaveId, const uint8_t * pdu, size_t len) {
+  uint8_t frame[256];
+  if (len + 3 > sizeof(frame)) {
+    _dropped++;
+    return;
+  }
+  frame[0] = slaveId;
+  memcpy(frame + 1, pdu, len);
+  record(CAPTURE_RX, frame, appendCrc(frame, len + 1));
+}
+
+size_t FrameCapture::drain(char * buf, size_t len) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t n = 0;
+  if (len < CAPTURE_DRAIN_MIN) return 0;
+  while (true) {
+    if (_rest > 0) {
+      // the frame of the line in progress, then its newline; always room for the terminating 0
+      for (; _rest > 1 && n + 2 < len; _rest--) {
+        uint8_t b;
+        get(&b, 1);
+        buf[n++] = hex[b >> 4];
+        buf[n++] = hex[b & 0xf];
+      }
+      if (_rest > 1 || n + 1 >= len) break;
+      buf[n++] = '\n';
+      _rest = 0;
+      continue;
+    }
+    if (_used == 0) break;
+    uint8_t header[RECORD_HEADER];
+    for (size_t i = 0; i < RECORD_HEADER; i++) header[i] = _ring[(_tail + i) % sizeof(_ring)];
+    size_t frameLen = header[5];
+    // "<micros> R " + hex + newline, and the terminating 0. A line that does not fit starts a
+    // buffer of its own
+    if (n > 0 && n + 10 + 3 + 2 * frameLen + 1 + 1 > len) break;
+
+    get(header, RECORD_HEADER);
+    uint32_t us = ((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) | (header[2] << 8) | header[3];
+    n += snprintf(buf + n, len - n, "%lu %c ", (unsigned long) us, (char) header[4]);
+    _rest = frameLen + 1;
+  }
+  if (n < len) buf[n] = 0;
+  return n;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file Capture.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Capture of the frames on the RS485 line, timestamped, in a ring buffer
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+#define CAPTURE_BUFFER    2048    // bytes, a frame that does not fit is dropped
+#define CAPTURE_DRAIN_MIN 16      // "<micros> R ", a byte in hex and the terminating 0
+
+enum captureDir { CAPTURE_RX = 'R', CAPTURE_TX = 'T' };
+
+/**
+ * @brief What the Modbus layer passes on: the frames it received with a good crc, for any slave
+ *  id, and the responses we sent. Frames with a bad crc are dropped by the library before we see
+ *  them, those only show up as a missing response. record() is a copy into the ring, cheap
+ *  enough for the request path; drain() formats lines of text, one per frame:
+ *
+ *    <micros> R|T <frame in hex, crc included>
+ *
+ *  the format the replay of the load test reads.
+ */
+class FrameCapture {
+public:
+  void      record(captureDir dir, const uint8_t * frame, size_t len);
+  // a received PDU, the way the Modbus layer passes it: the address and crc go back on
+  void      recordPdu(uint8_t slaveId, const uint8_t * pdu, size_t len);
+  // lines of text, as many as fit in len. A line longer than len goes out in parts, the next
+  // drain() goes on with it; the others stay whole. len is at least CAPTURE_DRAIN_MIN.
+  // Returns the # of characters, 0 if empty
+  size_t    drain(char * buf, size_t len);
+  size_t    used() const      { return _used; }
+  uint32_t  captured() const  { return _captured; }
+  uint32_t  dropped() const   { return _dropped; }
+  // empty, and the counters back to 0
+  void      clear()           { _head = _tail = _used = _rest = 0; _captured = _dropped = 0; }
+
+protected:
+  void      put(const uint8_t * data, size_t len);
+  void      get(uint8_t * data, size_t len);
+
+  uint8_t   _ring[CAPTURE_BUFFER];
+  size_t    _head = 0;    // next write
+  size_t    _tail = 0;    // next read
+  size_t    _used = 0;
+  size_t    _rest = 0;    // of the line in progress: the frame bytes still in the ring, and the newline
+  uint32_t  _captured = 0;
+  uint32_t  _dropped = 0;
+};
@@ -0,0 +1,54 @@
+/**
+ * @file DDSU666.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Profile of the Chint DDSU666, single phase. The configuration page is that of the
+ *         DTSU666, the values are floats in V, A, kW, Hz and kWh
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <Meter.h>
+
+inline constexpr registerDef DDSU666Regs[] PROGMEM = {
+{ 0x0,REG_WORD,"REV.","Software version",100} ,
+{ 0x1,REG_WORD,"UCode", "Programming code",701} ,
+{ 0x2,REG_WORD,"ClrE", "Power reset",0} ,
+{ 0x6,REG_WORD,"IrAt", "Current transformer rate",1} ,
+{ 0xa,REG_WORD,"Disp", "Rotating Display Time",0 } ,
+{ 0x2c,REG_WORD,"Prot", "Protocol stopbits",3 } ,
+{ 0x2d,REG_WORD,"bAud", "Communication baudrate",3 } ,
+{ 0x2e,REG_WORD,"Addr", "Communication address",1 } ,
+// 
+{ 0x2000,REG_FLOAT,"U",   "Voltage",0 } ,
+{ 0x2002,REG_FLOAT,"I",   "Current",0 } ,
+{ 0x2004,REG_FLOAT,"P",   "Active power",0, 0.001 } ,
+{ 0x2006,REG_FLOAT,"Q",   "Reactive power",0, 0.001 } ,
+{ 0x2008,REG_FLOAT,"S",   "Apparent power",0, 0.001 } ,
+{ 0x200A,REG_FLOAT,"PF",  "Power factor",0 } ,
+{ 0x200E,REG_FLOAT,"Freq","Frequency",50 } ,
+// Electricity
+{ 0x4000,REG_FLOAT,"ImpEp", "Positive total active energy",0 } ,
+{ 0x400A,REG_FLOAT,"ExpEp", "Negative total active energy",0 }
+};
+static_assert(regsOrdered(DDSU666Regs), "DDSU666Regs must be sorted, without duplicate or overlapping addresses");
+
+inline constexpr auto DDSU666Map = REGISTER_MAP(DDSU666Regs);
+inline constexpr uint32_t DDSU666Bauds[] = { 1200, 2400, 4800, 9600 };
+
+// holding registers, floats high word first
+struct DDSU666Profile {
+  static constexpr auto &     map = DDSU666Map;
+  typedef floatHighFirst      encoding;
+  static constexpr uint8_t    readFc = Modbus::FC_READ_REGS;
+  static constexpr word       configEnd = 0x1000;
+  static constexpr word       regProt = 0x2c, regBaud = 0x2d, regAddr = 0x2e;
+  static constexpr const uint32_t * bauds = DDSU666Bauds;
+  static constexpr size_t     numBauds = ARRAY_SIZE(DDSU666Bauds);
+  static constexpr const derivedDef * derived = nullptr;
+  static constexpr size_t     numDerived = 0;
+};
+
+typedef Meter<DDSU666Profile> DDSU666;
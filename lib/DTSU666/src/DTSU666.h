@@ -8,56 +8,136 @@
  * @copyright Copyright (c) 2024, MIT license
  *  DTSU666 manual: https://www.solaxpower.com/uploads/file/dtsu666-user-manual-en.pdf
  */
+#pragma once
 #include <Arduino.h>
-#include <ModbusRTU.h>
-#include <SoftwareSerial.h>
-
-// Register definitions
-//
-enum regType {  REG_WORD = 1,  REG_FLOAT = 2 } ;
-typedef struct registerDef {
-  word    address;
-  regType type;
-  const char *  code;
-  const char *  name;
-  const float   defval;
-} registerDef;
-
-#define ARRAY_SIZE(a) sizeof(a)/sizeof(a[0])
-#define NUM_DTSU666_REGS 36 // ideally compiler calculates the # entries, but we need in the class definition
+#include <math.h>
+#include <Meter.h>
+
+// the DTSU register definition, with some default and the scale: the meter reports
+// 0.1 V, 0.001 A, 0.1 W and 0.01 Hz units, as floats.
+// Sorted on address, the map and its lookup tables are built by the compiler.
+// The table stays in flash, see registerDef
+inline constexpr registerDef DTSU666Regs[] PROGMEM = {
+{ 0x0,REG_WORD,"REV.","Software version",204} ,
+{ 0x1,REG_WORD,"UCode", "Programming code",701} ,
+{ 0x2,REG_WORD,"ClrE", "Power reset",0} ,
+{ 0x3,REG_WORD,"nET", "Network selection",0} ,
+{ 0x6,REG_WORD,"Ct", "Current transformer rate",1} ,
+{ 0x7,REG_WORD,"Pt", "Voltage transformer rate",10 } ,
+{ 0xa,REG_WORD,"Disp", "Rotating Display Time",0 } ,
+{ 0xc,REG_WORD,"Endian", "Reserved",0} ,
+{ 0x2c,REG_WORD,"Prot", "Protocol stopbits",3 } ,
+{ 0x2d,REG_WORD,"bAud", "Communication baudrate",3 } ,
+{ 0x2e,REG_WORD,"Addr", "Communication address",1 } ,
+// Electricity
+{ 0x101E,REG_FLOAT,"ImpEp", "(Current) positive total active energy",0 } ,
+{ 0x1028,REG_FLOAT,"ExpEp", "(Current) negative total active energy",0 } ,
+// 
+{ 0x2000,REG_FLOAT,"Uab", "Three phase line voltage",0, 10 } ,
+{ 0x2002,REG_FLOAT,"Ubc", "Three phase line voltage",0, 10 } ,
+{ 0x2004,REG_FLOAT,"Uca", "Three phase line voltage",0, 10 } ,
+{ 0x2006,REG_FLOAT,"Ua",  "Three phase phase voltage",0, 10 } ,
+{ 0x2008,REG_FLOAT,"Ub",  "Three phase phase voltage",0, 10 } ,
+{ 0x200a,REG_FLOAT,"Uc",  "Three phase phase voltage",0, 10 } ,
+{ 0x200c,REG_FLOAT,"Ia",  "Three phase current",0, 1000 } ,
+{ 0x200e,REG_FLOAT,"Ib",  "Three phase current",0, 1000 } ,
+{ 0x2010,REG_FLOAT,"Ic",  "Three phase current",0, 1000 } ,
+{ 0x2012,REG_FLOAT,"Pt",  "Combined active power",0, 10 } ,
+{ 0x2014,REG_FLOAT,"Pa",  "A phase active power",0, 10 } ,
+{ 0x2016,REG_FLOAT,"Pb",  "B phase active power",0, 10 } ,
+{ 0x2018,REG_FLOAT,"Pc",  "C phase active power",0, 10 } ,
+{ 0x201A,REG_FLOAT,"Qt",  "Combined reactive power",0, 10 } ,
+{ 0x201C,REG_FLOAT,"Qa",  "A Phase reactive power",0, 10 } ,
+{ 0x201E,REG_FLOAT,"Qb",  "B Phase reactive power",0, 10 } ,
+{ 0x2020,REG_FLOAT,"Qc",  "C Phase reactive power",0, 10 } ,
+{ 0x202A,REG_FLOAT,"PFt", "Combined power factor",0, 1000 } ,
+{ 0x202C,REG_FLOAT,"PFa", "A Phase power factor",0, 1000 } ,
+{ 0x202E,REG_FLOAT,"PFb", "B Phase power factor",0, 1000 } ,
+{ 0x2030,REG_FLOAT,"PFc", "C Phase power factor",0, 1000 } ,
+{ 0x2044,REG_FLOAT,"Freq","Frequency unit",4999, 100 }
+};
+static_assert(regsOrdered(DTSU666Regs), "DTSU666Regs must be sorted, without duplicate or overlapping addresses");
+
+inline constexpr auto DTSU666Map = REGISTER_MAP(DTSU666Regs);
+inline constexpr size_t NUM_DTSU666_REGS = DTSU666Map.size();
+
+// The line settings, writable by the master with FC06 or FC16. They take effect after the response
+#define REG_PROT  0x2c    // rtuFormat
+#define REG_BAUD  0x2d    // index in DTSU666Bauds
+#define REG_ADDR  0x2e    // slave id
+inline constexpr uint32_t DTSU666Bauds[] = { 1200, 2400, 4800, 9600 };
+
+// The power and the energy totals, kept by the EnergyIntegrator when the source has no totals
+#define REG_PT    0x2012  // W * 10
+#define REG_IMPEP 0x101E  // kWh
+#define REG_EXPEP 0x1028  // kWh
+
+// The registers our sources don't have, computed from those they have when they are read.
+// There is no phase angle in the data: the phases are taken to be 120 degrees apart, and the
+// reactive power to be inductive. All in physical units
+inline float sumOf3(const float * in) { return in[0] + in[1] + in[2]; }
+
+// U, U of the next phase
+inline float lineVoltage(const float * in) { return sqrtf(in[0] * in[0] + in[1] * in[1] + in[0] * in[1]); }
+
+// P, U, I
+inline float powerFactor(const float * in) {
+  float s = in[1] * in[2];
+  return s > 0 ? constrain(in[0] / s, -1.0f, 1.0f) : 1.0f;
+}
+
+inline float reactivePower(const float * in) {
+  float s = in[1] * in[2];
+  return fabsf(s) > fabsf(in[0]) ? sqrtf(s * s - in[0] * in[0]) : 0.0f;
+}
+
+// Pt, then U and I of each phase
+inline float totalPowerFactor(const float * in) {
+  float s = in[1] * in[2] + in[3] * in[4] + in[5] * in[6];
+  return s > 0 ? constrain(in[0] / s, -1.0f, 1.0f) : 1.0f;
+}
+
+inline constexpr derivedDef DTSU666Derived[] = {
+  { 0x2012, sumOf3,       3, { 0x2014, 0x2016, 0x2018 } } ,           // Pt
+  { 0x2000, lineVoltage,  2, { 0x2006, 0x2008 } } ,                   // Uab
+  { 0x2002, lineVoltage,  2, { 0x2008, 0x200a } } ,                   // Ubc
+  { 0x2004, lineVoltage,  2, { 0x200a, 0x2006 } } ,                   // Uca
+  { 0x201C, reactivePower, 3, { 0x2014, 0x2006, 0x200c } } ,          // Qa
+  { 0x201E, reactivePower, 3, { 0x2016, 0x2008, 0x200e } } ,          // Qb
+  { 0x2020, reactivePower, 3, { 0x2018, 0x200a, 0x2010 } } ,          // Qc
+  { 0x201A, sumOf3,       3, { 0x201C, 0x201E, 0x2020 } } ,           // Qt
+  { 0x202C, powerFactor,  3, { 0x2014, 0x2006, 0x200c } } ,           // PFa
+  { 0x202E, powerFactor,  3, { 0x2016, 0x2008, 0x200e } } ,           // PFb
+  { 0x2030, powerFactor,  3, { 0x2018, 0x200a, 0x2010 } } ,           // PFc
+  { 0x202A, totalPowerFactor, 7, { 0x2012, 0x2006, 0x200c, 0x2008, 0x200e, 0x200a, 0x2010 } }  // PFt
+};
+
+// What the history records: W, 0.1 V and 0.01 Hz fit an int16
+inline constexpr historyChannel DTSU666History[] = {
+  { 0x2012, 1 },    // Pt
+  { 0x2014, 1 },    // Pa
+  { 0x2016, 1 },    // Pb
+  { 0x2018, 1 },    // Pc
+  { 0x2006, 10 },   // Ua
+  { 0x2008, 10 },   // Ub
+  { 0x200a, 10 },   // Uc
+  { 0x2044, 100 }   // Freq
+};
+
+// the Chint DTSU666, three phase: holding registers, floats high word first
+struct DTSU666Profile {
+  static constexpr auto &     map = DTSU666Map;
+  typedef floatHighFirst      encoding;
+  static constexpr uint8_t    readFc = Modbus::FC_READ_REGS;
+  static constexpr word       configEnd = 0x1000;
+  static constexpr word       regProt = REG_PROT, regBaud = REG_BAUD, regAddr = REG_ADDR;
+  static constexpr const uint32_t * bauds = DTSU666Bauds;
+  static constexpr size_t     numBauds = ARRAY_SIZE(DTSU666Bauds);
+  static constexpr const derivedDef * derived = DTSU666Derived;
+  static constexpr size_t     numDerived = ARRAY_SIZE(DTSU666Derived);
+};
 
 // class def for virtual DTSU666 power meter
 // A meter serves as a slave. And has routines to set the register data: either from a JSON source 
-// or from another source 
-class DTSU666 {
-public: 
-  DTSU666() {};  // master, or set slave later
-  DTSU666(uint slave_id) : _slaveid(slave_id) {};
-  void    begin(SoftwareSerial * S, int16_t en_pin, uint slaveid = 0);
-  void    setReg(word address, float value);
-  size_t  readMeterData(uint slaveId,bool config = false);
-  void    printRegs(word start, size_t numregs);
-  void    task() { mb.task(); } 
-  bool    isBusy() { return mb.slave(); }
-  void    copyTo(DTSU666 & Meter);  /// operator = later
-  //void    requestCb(Modbus::ResultCode cbPreRequest(Modbus::FunctionCode fc, const Modbus::RequestData data));
-
-protected:
-  ModbusRTU      mb;
-
-private:
-  //word *  rawIndex(word address);
-  float   regs2Float(word reg1, word reg2);
-  void    float2Regs (float val, word &reg1, word  &reg2 );
-  word    reg2Word(word reg) { return reg; }
-  word    word2Reg (word val) { return val; }
-  size_t  readBlock(uint slaveId, word startAddress, size_t numRegs);
-  size_t  readSection(uint slaveId, word startAddress, word endAddress);
-  
-  uint    _slaveid = 0;
-
-  union {
-    word regs[2];
-    float fval; 
-  } bfloat;
-};
\ No newline at end of file
+// or from another source. Several meters can share a line, each with its own id and image
+typedef Meter<DTSU666Profile> DTSU666;
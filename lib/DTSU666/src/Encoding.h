@@ -0,0 +1,62 @@
+/**
+ * @file Encoding.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Encoding policies: how a meter puts a 2 register value on the wire. Chosen by the
+ *         meter profile at compile time
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <string.h>
+#include <math.h>
+
+// IEEE 754 single
+struct ieeeFloat {
+  static uint32_t encode(float value) {
+    uint32_t raw;
+    memcpy(&raw, &value, sizeof(raw));
+    return raw;
+  }
+  static float decode(uint32_t raw) {
+    float value;
+    memcpy(&value, &raw, sizeof(value));
+    return value;
+  }
+};
+
+// a signed 32 bit integer, rounded. The scale of the register makes it a fixed point value
+struct scaledLong {
+  static uint32_t encode(float value) {
+    if (value >= 2147483647.0f) return 0x7fffffff;
+    if (value <= -2147483648.0f) return 0x80000000;
+    return (uint32_t) (int32_t) lroundf(value);
+  }
+  static float decode(uint32_t raw) { return (float) (int32_t) raw; }
+};
+
+/**
+ * @brief A 2 register value: the format of the 32 bits, and which word goes first.
+ *  Registers hold their value in Modbus byte order, so only the word order varies
+ *
+ * @tparam Value      ieeeFloat or scaledLong
+ * @tparam HighFirst  true: the high word is at the lower address
+ */
+template <class Value, bool HighFirst>
+struct wireEncoding {
+  static void put(float value, word & first, word & second) {
+    uint32_t raw = Value::encode(value);
+    first  = HighFirst ? raw >> 16 : raw & 0xffff;
+    second = HighFirst ? raw & 0xffff : raw >> 16;
+  }
+  static float get(word first, word second) {
+    return Value::decode(HighFirst ? ((uint32_t) first << 16) | second : ((uint32_t) second << 16) | first);
+  }
+};
+
+typedef wireEncoding<ieeeFloat, true>   floatHighFirst;
+typedef wireEncoding<ieeeFloat, false>  floatLowFirst;
+typedef wireEncoding<scaledLong, true>  longHighFirst;
+typedef wireEncoding<scaledLong, false> longLowFirst;
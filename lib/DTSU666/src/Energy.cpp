@@ -0,0 +1,202 @@
+/**
+ * @file Energy.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Energy totals from power samples, and a wear levelled flash log to keep them
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <Energy.h>
+#include <Log.h>
+
+void EnergyIntegrator::begin(const energyTotals & totals, ulong maxGap) {
+  _totals = totals;
+  _maxGap = maxGap;
+  _started = false;
+  _importFrac = _exportFrac = 0;
+}
+
+// whole mJ go to the total, the rest is carried
+void EnergyIntegrator::add(uint64_t & total, float & frac, float mj) {
+  float sum = frac + mj;
+  uint64_t whole = (uint64_t) sum;
+  frac = sum - whole;
+  total += whole;
+}
+
+void EnergyIntegrator::sample(float watts, ulong ms) {
+  if (isnan(watts)) return;
+  if (!_started) {
+    _started = true;
+    _lastMs = ms;
+    _lastWatts = watts;
+    return;
+  }
+  long dt = (long) (ms - _lastMs);
+  if (dt <= 0) {
+    _stats.stale++;
+    return;
+  }
+
+  if ((ulong) dt > _maxGap) {
+    _stats.gaps++;
+    _stats.gapMs += dt;
+  } else {
+    float p0 = _lastWatts, p1 = watts;
+    if ((p0 >= 0) == (p1 >= 0)) {
+      float mj = (p0 + p1) / 2 * dt;
+      if (mj >= 0) add(_totals.imported, _importFrac, mj);
+      else add(_totals.exported, _exportFrac, -mj);
+    } else {
+      // two triangles, one on each side of the zero crossing
+      float t0 = dt * p0 / (p0 - p1);
+      float before = p0 * t0 / 2, after = p1 * (dt - t0) / 2;
+      if (p0 > 0) {
+        add(_totals.imported, _importFrac, before);
+        add(_totals.exported, _exportFrac, -after);
+      } else {
+        add(_totals.exported, _exportFrac, -before);
+        add(_totals.imported, _importFrac, after);
+      }
+    }
+    _stats.samples++;
+  }
+  _lastMs = ms;
+  _lastWatts = watts;
+}
+
+#ifdef ESP8266
+extern "C" uint32_t _EEPROM_start;
+extern "C" uint32_t _FS_end;
+
+uint32_t SpiFlashSectors::eepromSector() {
+  return ((uintptr_t) &_EEPROM_start - 0x40200000) / FLASH_SECTOR_BYTES;
+}
+
+uint32_t SpiFlashSectors::firstFreeSector() {
+  uint32_t fsEnd = ((uintptr_t) &_FS_end - 0x40200000 + FLASH_SECTOR_BYTES - 1) / FLASH_SECTOR_BYTES;
+  return fsEnd < eepromSector() ? fsEnd : eepromSector();
+}
+
+size_t SpiFlashSectors::freeSectors() {
+  return eepromSector() - firstFreeSector() + 1;
+}
+
+bool SpiFlashSectors::erase(size_t sector) {
+  return sector < _num && ESP.flashEraseSector(_first + sector);
+}
+
+// the SDK wants 4 byte aligned offsets, lengths and buffers: records are
+bool SpiFlashSectors::read(uint32_t offset, void * data, size_t len) {
+  return offset + len <= _num * FLASH_SECTOR_BYTES &&
+         ESP.flashRead(_first * FLASH_SECTOR_BYTES + offset, (uint32_t *) data, len);
+}
+
+bool SpiFlashSectors::write(uint32_t offset, const void * data, size_t len) {
+  return offset + len <= _num * FLASH_SECTOR_BYTES &&
+         ESP.flashWrite(_first * FLASH_SECTOR_BYTES + offset, (uint32_t *) data, len);
+}
+#endif
+
+static word recordCrc(const energyRecord & rec) {
+  return crc16((const uint8_t *) &rec, offsetof(energyRecord, crc));
+}
+
+static uint32_t slotOffset(size_t slot) {
+  return (slot / ENERGY_RECORDS_PER_SECTOR) * FLASH_SECTOR_BYTES + (slot % ENERGY_RECORDS_PER_SECTOR) * sizeof(energyRecord);
+}
+
+bool EnergyLog::readRecord(size_t slot, energyRecord & rec) {
+  return _flash.read(slotOffset(slot), &rec, sizeof(rec));
+}
+
+bool EnergyLog::isErased(const energyRecord & rec) {
+  const uint8_t * b = (const uint8_t *) &rec;
+  for (size_t i = 0; i < sizeof(rec); i++) {
+    if (b[i] != 0xff) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief find the newest valid record, and where the next one goes: the first erased slot after
+ *  it in the same sector, or else the start of the next sector, which is then erased first.
+ *  A sector with anything else in it (no log yet, or old data) is erased before it is used.
+ */
+bool EnergyLog::restore(energyTotals & totals) {
+  size_t numSlots = _flash.numSectors() * ENERGY_RECORDS_PER_SECTOR;
+  energyRecord rec;
+  bool found = false;
+  size_t newest = 0;
+
+  for (size_t slot = 0; slot < numSlots; slot++) {
+    if (!readRecord(slot, rec) || rec.seq == 0xffffffff || rec.crc != recordCrc(rec)) continue;
+    if (!found || rec.seq > _seq) {
+      found = true;
+      newest = slot;
+      _seq = rec.seq;
+      _last = rec.totals;
+    }
+  }
+
+  _next = 0;
+  _clean = false;
+  if (!found) {
+    _seq = 0;
+    _last = {};
+    return false;
+  }
+  totals = _last;
+  size_t sectorEnd = (newest / ENERGY_RECORDS_PER_SECTOR + 1) * ENERGY_RECORDS_PER_SECTOR;
+  for (size_t slot = newest + 1; slot < sectorEnd; slot++) {
+    if (readRecord(slot, rec) && isErased(rec)) {
+      _next = slot;
+      _clean = true;
+      break;
+    }
+  }
+  if (!_clean) _next = sectorEnd % numSlots;
+  LOG_I("Energy log: record %u in slot %u\n", (unsigned) _seq, (unsigned) newest);
+  return true;
+}
+
+bool EnergyLog::due(const energyTotals & totals, ulong ms) const {
+  uint64_t moved = (totals.imported - _last.imported) + (totals.exported - _last.exported);
+  if (moved == 0) return false;
+  return moved >= _delta || ms - _lastMs >= _interval;
+}
+
+bool EnergyLog::persist(const energyTotals & totals, ulong ms) {
+  size_t sector = _next / ENERGY_RECORDS_PER_SECTOR;
+  if (!_clean) {
+    if (_onErase) _onErase(totals);
+    _stats.erases++;
+    if (!_flash.erase(sector)) {
+      _stats.failed++;
+      return false;
+    }
+    _clean = true;
+  }
+
+  energyRecord rec = {};
+  rec.totals = totals;
+  rec.seq = _seq + 1;
+  rec.reserved = 0xffff;
+  rec.crc = recordCrc(rec);
+  _lastMs = ms;   // a failed write is not retried right away
+  if (!_flash.write(slotOffset(_next), &rec, sizeof(rec))) {
+    _stats.failed++;
+    // the slot may be half written, don't use it again
+  } else {
+    _stats.writes++;
+    _seq = rec.seq;
+    _last = totals;
+  }
+  if (++_next % ENERGY_RECORDS_PER_SECTOR == 0) {
+    _next %= _flash.numSectors() * ENERGY_RECORDS_PER_SECTOR;
+    _clean = false;
+  }
+  return _seq == rec.seq;
+}
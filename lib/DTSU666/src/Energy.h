@@ -0,0 +1,152 @@
+/**
+ * @file Energy.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Energy totals from power samples, and a wear levelled flash log to keep them
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <ModbusCrc.h>
+
+#define ENERGY_MAX_GAP    60000UL   // ms, a longer interval between two samples is not integrated
+
+#define MJ_PER_KWH        3600000000.0  // energy is counted in mJ, W x ms
+
+// imported and exported energy, in mJ. Integers, so a restore is exact
+typedef struct energyTotals {
+  uint64_t  imported;
+  uint64_t  exported;
+} energyTotals;
+
+typedef struct energyStats {
+  uint32_t  samples;    // integrated
+  uint32_t  stale;      // not newer than the previous sample, ignored
+  uint32_t  gaps;       // intervals longer than the max gap, not integrated
+  uint32_t  gapMs;      // their total length
+} energyStats;
+
+/**
+ * @brief Integrates power samples into imported (positive power) and exported (negative power)
+ *  energy. Trapezoidal: the power is taken to change linearly between two samples, an interval
+ *  where the sign changes is split at the zero crossing. The timestamps are those of the
+ *  samples, not of the calls. An interval longer than maxGap counts as missing data: it is
+ *  not integrated, the totals then lag behind rather than guess.
+ */
+class EnergyIntegrator {
+public:
+  void    begin(const energyTotals & totals, ulong maxGap = ENERGY_MAX_GAP);
+  // power in W, ms: millis() when it was measured
+  void    sample(float watts, ulong ms);
+  const energyTotals & totals() const { return _totals; }
+  double  importedKWh() const { return _totals.imported / MJ_PER_KWH; }
+  double  exportedKWh() const { return _totals.exported / MJ_PER_KWH; }
+  const energyStats & stats() const { return _stats; }
+
+protected:
+  void    add(uint64_t & total, float & frac, float mj);
+
+  energyTotals  _totals = {};
+  energyStats   _stats = {};
+  ulong   _maxGap = ENERGY_MAX_GAP;
+  ulong   _lastMs = 0;
+  float   _lastWatts = 0;
+  bool    _started = false;
+  float   _importFrac = 0;   // below 1 mJ, carried to the next interval
+  float   _exportFrac = 0;
+};
+
+#define FLASH_SECTOR_BYTES   4096
+
+/**
+ * @brief Raw flash, in erase sectors. Writes can only clear bits, so a sector is erased before
+ *  it is written again. Offsets count from the start of the first sector
+ */
+class FlashSectors {
+public:
+  virtual ~FlashSectors() {}
+  virtual size_t  numSectors() const = 0;
+  virtual bool    erase(size_t sector) = 0;
+  virtual bool    read(uint32_t offset, void * data, size_t len) = 0;
+  virtual bool    write(uint32_t offset, const void * data, size_t len) = 0;
+};
+
+#ifdef ESP8266
+// a range of sectors of the SPI flash, by sector number
+class SpiFlashSectors : public FlashSectors {
+public:
+  SpiFlashSectors(uint32_t firstSector, size_t numSectors) : _first(firstSector), _num(numSectors) {}
+  // the sector the core reserves for EEPROM, we use it as a flash log instead
+  static uint32_t eepromSector();
+  // the sectors between the end of the filesystem and the EEPROM sector, that one included. The
+  // 4 MB layouts leave one unused there, which makes two
+  static uint32_t firstFreeSector();
+  static size_t   freeSectors();
+  size_t  numSectors() const override { return _num; }
+  bool    erase(size_t sector) override;
+  bool    read(uint32_t offset, void * data, size_t len) override;
+  bool    write(uint32_t offset, const void * data, size_t len) override;
+private:
+  uint32_t  _first;
+  size_t    _num;
+};
+#endif
+
+// one entry of the log. The crc covers the rest, a torn write does not count
+typedef struct energyRecord {
+  energyTotals  totals;
+  uint32_t      seq;      // 0xffffffff: erased
+  word          crc;
+  word          reserved;
+} energyRecord;
+
+#define ENERGY_RECORDS_PER_SECTOR   (FLASH_SECTOR_BYTES / sizeof(energyRecord))
+#define ENERGY_LOG_INTERVAL         900000UL  // ms, at most one write per interval ..
+#define ENERGY_LOG_DELTA            3600000000ULL // mJ (1 kWh), .. unless the totals moved more
+
+typedef struct energyLogStats {
+  uint32_t  writes;
+  uint32_t  erases;
+  uint32_t  failed;
+} energyLogStats;
+
+/**
+ * @brief The energy totals in flash, written as an append only log over a ring of sectors.
+ *  Each write takes the next free record, a sector is erased only when the log moves into it,
+ *  so the erases go round the ring: with 170 records per sector and one write per 15 minutes,
+ *  the log moves on a sector every 6 weeks.
+ *  restore() takes the valid record with the highest sequence number; a write that was torn
+ *  by a reset fails its crc and the one before it is used.
+ *  Erasing a sector takes tens of ms, so call persist() when the bus is idle.
+ */
+class EnergyLog {
+public:
+  EnergyLog(FlashSectors & flash) : _flash(flash) {}
+  // scan the log, false if it holds no valid record
+  bool    restore(energyTotals & totals);
+  // time for a write? Not more than once per interval, unless the totals moved more than delta
+  bool    due(const energyTotals & totals, ulong ms) const;
+  bool    persist(const energyTotals & totals, ulong ms);
+  // called before a sector is erased, with the totals about to be written. With a ring of one
+  // sector, a reset during the erase would lose them
+  void    onErase(std::function<void(const energyTotals &)> cb) { _onErase = cb; }
+  void    setPolicy(ulong interval, uint64_t delta) { _interval = interval; _delta = delta; }
+  const energyLogStats & stats() const { return _stats; }
+
+protected:
+  bool    readRecord(size_t slot, energyRecord & rec);
+  bool    isErased(const energyRecord & rec);
+
+  FlashSectors & _flash;
+  size_t    _next = 0;          // slot of the next write
+  bool      _clean = false;     // the sector of _next has been erased since it was last written
+  uint32_t  _seq = 0;           // of the last record
+  energyTotals _last = {};      // as last written
+  ulong     _lastMs = 0;
+  ulong     _interval = ENERGY_LOG_INTERVAL;
+  uint64_t  _delta = ENERGY_LOG_DELTA;
+  energyLogStats _stats = {};
+  std::function<void(const energyTotals &)> _onErase;
+};
@@ -0,0 +1,55 @@
+/**
+ * @file Estimator.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  The value of a register between two samples of a slow source
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <Estimator.h>
+
+void Estimator::begin(const estimatorConfig & config) {
+  _config = config;
+  _samples = 0;
+  _x = _v = _last = 0;
+}
+
+void Estimator::sample(float value, ulong ms) {
+  if (isnan(value)) return;
+  _last = value;
+  long dt = ms - _at;
+  if (_samples == 0) {
+    _x = value;
+    _v = 0;
+    _at = ms;
+    _samples = 1;
+    return;
+  }
+  // no time to take a rate from
+  if (dt <= 0) {
+    _x = value;
+    return;
+  }
+  float seconds = dt / 1000.0f;
+  if (_config.mode == EST_ALPHA_BETA && _samples > 1) {
+    float predicted = _x + _v * seconds;
+    float error = value - predicted;
+    _x = predicted + _config.alpha * error;
+    _v += _config.beta * error / seconds;
+  } else {
+    // the line through the last two, also the start of the filter
+    _v = (value - _x) / seconds;
+    _x = value;
+  }
+  _at = ms;
+  _samples = 2;
+}
+
+float Estimator::estimate(ulong now) const {
+  if (_config.mode == EST_HOLD || _samples < 2) return _last;
+  long dt = now - _at;
+  float seconds = constrain(dt, 0L, (long) _config.horizonMs) / 1000.0f;
+  return constrain(_x + _v * seconds, _config.lo, _config.hi);
+}
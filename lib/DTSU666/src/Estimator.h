@@ -0,0 +1,57 @@
+/**
+ * @file Estimator.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  The value of a register between two samples of a slow source: held, extrapolated
+ *         along the last two samples, or from an alpha-beta filter
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+#define ESTIMATOR_MAX       4       // registers with an estimator, per meter
+#define ESTIMATOR_HORIZON   5000UL  // ms, default: no further ahead than this from the last sample
+
+enum estimatorMode : uint8_t {
+  EST_HOLD,           // the last sample, as without an estimator
+  EST_LINEAR,         // along the line through the last two samples
+  EST_ALPHA_BETA      // value and rate tracked by an alpha-beta filter
+};
+
+typedef struct estimatorConfig {
+  estimatorMode mode;
+  ulong   horizonMs;      // extrapolate no further than this past the last sample
+  float   lo, hi;         // the estimate stays in here, physical units
+  float   alpha, beta;    // EST_ALPHA_BETA gains, 0..1: how much of an error goes into the value, the rate
+} estimatorConfig;
+
+inline constexpr estimatorConfig estimatorOf(estimatorMode mode, float lo = -INFINITY, float hi = INFINITY,
+                                             ulong horizonMs = ESTIMATOR_HORIZON) {
+  return { mode, horizonMs, lo, hi, 0.9f, 0.1f };
+}
+
+/**
+ * @brief An estimate of a value that is sampled every few seconds and read every second. A sample
+ *  is O(1), the estimate is evaluated when it is read: value + rate * time since the sample, with
+ *  the time capped at the horizon and the result clamped. The times are those of the samples, a
+ *  sample that is not newer than the previous one only replaces the value
+ */
+class Estimator {
+public:
+  void    begin(const estimatorConfig & config);
+  const estimatorConfig & config() const { return _config; }
+  void    sample(float value, ulong ms);
+  // the value at now, the last sample if there is nothing to go on
+  float   estimate(ulong now) const;
+  bool    hasSample() const { return _samples > 0; }
+
+protected:
+  estimatorConfig _config = estimatorOf(EST_HOLD);
+  float   _last = 0;      // the last sample
+  float   _x = 0;         // the value at _at
+  float   _v = 0;         // its rate, per s
+  ulong   _at = 0;
+  uint8_t _samples = 0;   // up to 2
+};
@@ -0,0 +1,199 @@
+/**
+ * @file History.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  What the meter reported recently, raw and as rollups, in a fixed amount of memory
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <History.h>
+
+static_assert(HISTORY_RAW_BASE + HISTORY_RAW * HISTORY_RAW_REGS <= HISTORY_LEVEL_BASE(0), "raw samples overlap the rollups");
+static_assert(HISTORY_LEVEL_BASE(HISTORY_LEVELS) <= HISTORY_END, "too many levels for the window");
+
+static constexpr bool levelsFit() {
+  for (const auto & l : historyLevels) {
+    if (l.size == 0 || l.size * HISTORY_BUCKET_REGS > 0x400) return false;
+  }
+  return true;
+}
+static_assert(levelsFit(), "a level does not fit its 0x400 registers");
+
+// first bucket of a level in _buckets
+static size_t levelOffset(size_t level) {
+  size_t offset = 0;
+  for (size_t l = 0; l < level; l++) offset += historyLevels[l].size;
+  return offset;
+}
+
+static int16_t toHistory(float value, float scale) {
+  float v = roundf(value * scale);
+  if (isnan(v)) return 0;
+  return constrain(v, -32767.0f, 32767.0f);
+}
+
+// seconds, saturated
+static word ageOf(ulong now, uint32_t ms) {
+  return min((now - ms) / 1000, 0xffffUL);
+}
+
+void History::sample(const float * values, ulong ms) {
+  int16_t v[HISTORY_CHANNELS];
+  for (size_t c = 0; c < _numChannels; c++) v[c] = toHistory(values[c], _channels[c].scale);
+
+  _rawMs[_rawHead] = ms;
+  memcpy(_raw[_rawHead], v, _numChannels * sizeof(int16_t));
+  _rawHead = (_rawHead + 1) % HISTORY_RAW;
+  if (_rawCount < HISTORY_RAW) _rawCount++;
+  _samples++;
+
+  for (size_t l = 0; l < HISTORY_LEVELS; l++) {
+    openBucket & o = _open[l];
+    uint32_t index = ms / historyLevels[l].periodMs;
+    if (o.count > 0 && index != o.index) {
+      close(l);
+      // the periods without samples in between, at most a ring full. A wrap of millis() counts as none
+      uint32_t empty = index > o.index ? min(index - o.index - 1, (uint32_t) historyLevels[l].size) : 0;
+      bucket none;
+      none.count = 0;
+      for (size_t c = 0; c < HISTORY_CHANNELS; c++) none.min[c] = none.max[c] = none.avg[c] = HISTORY_NO_DATA;
+      for (uint32_t e = 0; e < empty; e++) push(l, none);
+      _closedMs[l] = index * historyLevels[l].periodMs;
+      o.count = 0;
+    }
+    if (o.count == 0) {
+      o.index = index;
+      for (size_t c = 0; c < _numChannels; c++) {
+        o.min[c] = o.max[c] = v[c];
+        o.sum[c] = 0;
+      }
+    }
+    for (size_t c = 0; c < _numChannels; c++) {
+      if (v[c] < o.min[c]) o.min[c] = v[c];
+      if (v[c] > o.max[c]) o.max[c] = v[c];
+      o.sum[c] += v[c];
+    }
+    if (o.count < 0xffff) o.count++;
+  }
+}
+
+// the open bucket of a level into its ring
+void History::close(size_t level) {
+  const openBucket & o = _open[level];
+  bucket b;
+  b.count = o.count;
+  for (size_t c = 0; c < HISTORY_CHANNELS; c++) {
+    if (c >= _numChannels) {
+      b.min[c] = b.max[c] = b.avg[c] = HISTORY_NO_DATA;
+      continue;
+    }
+    b.min[c] = o.min[c];
+    b.max[c] = o.max[c];
+    b.avg[c] = (o.sum[c] + (o.sum[c] >= 0 ? o.count / 2 : -(o.count / 2))) / (int32_t) o.count;
+  }
+  push(level, b);
+  _closedMs[level] = (o.index + 1) * historyLevels[level].periodMs;
+}
+
+void History::push(size_t level, const bucket & b) {
+  _buckets[levelOffset(level) + _head[level]] = b;
+  _head[level] = (_head[level] + 1) % historyLevels[level].size;
+  if (_count[level] < historyLevels[level].size) _count[level]++;
+}
+
+const History::bucket & History::bucketAt(size_t level, size_t k) const {
+  size_t size = historyLevels[level].size;
+  return _buckets[levelOffset(level) + (_head[level] + size - 1 - k) % size];
+}
+
+// one register of the window, 0 outside the records
+word History::regAt(word address, ulong now) const {
+  if (address < HISTORY_BASE + HISTORY_HEADER) {
+    word r = address - HISTORY_BASE;
+    if (r == 0) return _numChannels;
+    if (r == 1) return HISTORY_RAW;
+    if (r == 2) return _rawCount;
+    if (r == 3) return HISTORY_LEVELS;
+    if (r >= 4 && r < 4 + 4 * HISTORY_LEVELS) {
+      size_t l = (r - 4) / 4;
+      switch ((r - 4) % 4) {
+        case 0:  return historyLevels[l].periodMs / 1000;
+        case 1:  return historyLevels[l].size;
+        case 2:  return _count[l];
+        default: return _count[l] > 0 ? ageOf(now, _closedMs[l]) : 0;
+      }
+    }
+    if (r == 0x10) return _samples >> 16;
+    if (r == 0x11) return _samples & 0xffff;
+    if (r >= 0x18 && r < 0x18 + _numChannels) return _channels[r - 0x18].address;
+    if (r >= 0x20 && r < 0x20 + _numChannels) return _channels[r - 0x20].scale;
+    return 0;
+  }
+
+  if (address < HISTORY_LEVEL_BASE(0)) {
+    if (address < HISTORY_RAW_BASE) return 0;
+    word r = address - HISTORY_RAW_BASE;
+    size_t k = r / HISTORY_RAW_REGS, f = r % HISTORY_RAW_REGS;
+    if (k >= HISTORY_RAW) return 0;
+    if (k >= _rawCount || (f > 0 && f > _numChannels)) return (word) HISTORY_NO_DATA;
+    size_t slot = (_rawHead + HISTORY_RAW - 1 - k) % HISTORY_RAW;
+    return f == 0 ? ageOf(now, _rawMs[slot]) : (word) _raw[slot][f - 1];
+  }
+
+  size_t l = (address - HISTORY_BASE) / 0x400 - 1;
+  if (l >= HISTORY_LEVELS) return 0;
+  word r = address - HISTORY_LEVEL_BASE(l);
+  size_t k = r / HISTORY_BUCKET_REGS, f = r % HISTORY_BUCKET_REGS;
+  if (k >= historyLevels[l].size) return 0;
+  if (k >= _count[l]) return f == 0 ? 0 : (word) HISTORY_NO_DATA;
+  const bucket & b = bucketAt(l, k);
+  if (f == 0) return b.count;
+  size_t c = (f - 1) / 3;
+  switch ((f - 1) % 3) {
+    case 0:  return (word) b.min[c];
+    case 1:  return (word) b.max[c];
+    default: return (word) b.avg[c];
+  }
+}
+
+Modbus::ResultCode History::read(word startAddress, word numRegs, uint8_t * dest, ulong now) {
+  if (numRegs == 0 || numRegs > 125) return Modbus::EX_ILLEGAL_VALUE;
+  if (startAddress < HISTORY_BASE || (uint32_t) startAddress + numRegs > HISTORY_END) return Modbus::EX_ILLEGAL_ADDRESS;
+  for (word r = 0; r < numRegs; r++) {
+    word value = regAt(startAddress + r, now);
+    *dest++ = value >> 8;
+    *dest++ = value & 0xff;
+  }
+  return Modbus::EX_SUCCESS;
+}
+
+// part, 0, start address (big endian), then the registers from there
+size_t History::dump(uint8_t part, uint8_t * buf, size_t len, ulong now) {
+  word start, numRegs;
+  if (part == 0) {
+    start = HISTORY_BASE;
+    numRegs = HISTORY_HEADER;
+  } else if (part == 1) {
+    start = HISTORY_RAW_BASE;
+    numRegs = _rawCount * HISTORY_RAW_REGS;
+  } else if (part < numParts()) {
+    start = HISTORY_LEVEL_BASE(part - 2);
+    numRegs = _count[part - 2] * HISTORY_BUCKET_REGS;
+  } else {
+    return 0;
+  }
+  size_t n = 4 + numRegs * 2;
+  if (n > len) return 0;
+  buf[0] = part;
+  buf[1] = 0;
+  buf[2] = start >> 8;
+  buf[3] = start & 0xff;
+  for (word r = 0; r < numRegs; r++) {
+    word value = regAt(start + r, now);
+    buf[4 + r * 2] = value >> 8;
+    buf[5 + r * 2] = value & 0xff;
+  }
+  return n;
+}
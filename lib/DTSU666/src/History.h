@@ -0,0 +1,129 @@
+/**
+ * @file History.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  What the meter reported recently: the last samples of a few registers, and rollups
+ *         of min, max and average per 10 s, 1 min and 15 min. Fixed size, readable as vendor registers
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <ModbusRTU.h>
+
+#define HISTORY_CHANNELS  8       // registers recorded
+#define HISTORY_RAW       32      // samples
+#define HISTORY_LEVELS    3       // rollups, see historyLevels
+#define HISTORY_NO_DATA   ((int16_t) 0x8000)   // an empty bucket or sample slot
+
+// rollup periods and the number of buckets of each
+typedef struct historyLevel {
+  ulong   periodMs;
+  uint8_t size;
+} historyLevel;
+
+inline constexpr historyLevel historyLevels[HISTORY_LEVELS] = {
+  { 10000UL,  24 },     // 4 minutes
+  { 60000UL,  20 },     // 20 minutes
+  { 900000UL, 16 }      // 4 hours
+};
+
+inline constexpr size_t historyBuckets() {
+  size_t n = 0;
+  for (const auto & l : historyLevels) n += l.size;
+  return n;
+}
+
+// a register to record. Values are kept as int16: value * scale, saturated
+typedef struct historyChannel {
+  word    address;
+  float   scale;      // history units per physical unit
+} historyChannel;
+
+/**
+ * @brief The vendor registers of the history, below the metrics. All values int16, a reader
+ *  pages through them with FC03 reads of up to 125 registers:
+ *
+ *    HISTORY_BASE + 0x00   # channels, raw size, raw count, # levels
+ *                 + 0x04   per level: period (s), size, count, age of the newest bucket (s)
+ *                 + 0x10   samples recorded, 2 registers high word first. A paged read is
+ *                          consistent if this did not change between its first and last page
+ *                 + 0x18   per channel: its register,  + 0x20: its scale
+ *    HISTORY_RAW_BASE      per sample, newest first: age (s), the value of each channel
+ *    HISTORY_LEVEL_BASE(l) per bucket, newest first: # samples, then min, max, avg of each channel
+ */
+#define HISTORY_BASE          0xE000
+#define HISTORY_HEADER        0x28
+#define HISTORY_RAW_BASE      (HISTORY_BASE + 0x100)
+#define HISTORY_LEVEL_BASE(l) (HISTORY_BASE + 0x400 * ((l) + 1))
+#define HISTORY_END           (HISTORY_BASE + 0x1000)
+#define HISTORY_RAW_REGS      (1 + HISTORY_CHANNELS)
+#define HISTORY_BUCKET_REGS   (1 + 3 * HISTORY_CHANNELS)
+
+/**
+ * @brief The history of a meter. sample() is O(1): a value goes into the raw ring and into the
+ *  open bucket of every level, as a running min, max and sum. A bucket is closed when a sample
+ *  falls in the next period, periods without samples are closed as empty buckets.
+ *  All memory is in the object, its size is fixed at compile time.
+ */
+class History {
+public:
+  History(const historyChannel * channels, size_t numChannels)
+    : _channels(channels), _numChannels(min(numChannels, (size_t) HISTORY_CHANNELS)) {}
+  size_t  numChannels() const { return _numChannels; }
+  const historyChannel & channel(size_t c) const { return _channels[c]; }
+  // the values of the channels, in physical units. ms: millis() when they were published
+  void    sample(const float * values, ulong ms);
+  uint32_t samples() const { return _samples; }
+  // the registers from HISTORY_BASE, ages relative to now
+  Modbus::ResultCode read(word startAddress, word numRegs, uint8_t * dest, ulong now);
+  // part 0: the header, 1: the raw samples, 2..: the levels, as the registers they are read as
+  // (big endian), only the records that hold data. Returns the # of bytes, 0 if it does not fit
+  size_t  dump(uint8_t part, uint8_t * buf, size_t len, ulong now);
+  static constexpr uint8_t numParts() { return 2 + HISTORY_LEVELS; }
+  // the bytes of the largest part
+  static constexpr size_t maxDump() {
+    size_t n = 4 + max(HISTORY_HEADER, HISTORY_RAW * HISTORY_RAW_REGS) * 2;
+    for (const auto & l : historyLevels) n = max(n, (size_t) (4 + l.size * HISTORY_BUCKET_REGS * 2));
+    return n;
+  }
+
+protected:
+  typedef struct bucket {
+    uint16_t  count;
+    int16_t   min[HISTORY_CHANNELS];
+    int16_t   max[HISTORY_CHANNELS];
+    int16_t   avg[HISTORY_CHANNELS];
+  } bucket;
+
+  typedef struct openBucket {
+    uint32_t  index;      // ms / period
+    uint16_t  count;
+    int16_t   min[HISTORY_CHANNELS];
+    int16_t   max[HISTORY_CHANNELS];
+    int32_t   sum[HISTORY_CHANNELS];
+  } openBucket;
+
+  void    close(size_t level);
+  void    push(size_t level, const bucket & b);
+  const bucket & bucketAt(size_t level, size_t k) const;   // k = 0: newest
+  word    regAt(word address, ulong now) const;
+
+  const historyChannel * _channels;
+  size_t    _numChannels;
+  uint32_t  _samples = 0;
+
+  // raw ring
+  uint32_t  _rawMs[HISTORY_RAW] = {};
+  int16_t   _raw[HISTORY_RAW][HISTORY_CHANNELS] = {};
+  uint8_t   _rawHead = 0;     // next write
+  uint8_t   _rawCount = 0;
+
+  // rollups, the rings of all levels in one array
+  bucket      _buckets[historyBuckets()] = {};
+  uint8_t     _head[HISTORY_LEVELS] = {};
+  uint8_t     _count[HISTORY_LEVELS] = {};
+  uint32_t    _closedMs[HISTORY_LEVELS] = {};   // end of the newest bucket
+  openBucket  _open[HISTORY_LEVELS] = {};
+};
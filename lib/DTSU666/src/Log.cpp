@@ -0,0 +1,66 @@
+/**
+ * @file Log.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Logging with compile time levels and a ring buffer, drained when the bus is idle
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <stdarg.h>
+#include "Log.h"
+
+static char     ring[LOG_BUFFER];
+static size_t   head = 0;     // next write
+static size_t   tail = 0;     // next read
+static size_t   used = 0;
+static uint32_t dropped = 0;
+static uint8_t  level = LOG_LEVEL;
+
+void logPrintf(uint8_t lvl, const char * format, ...) {
+  if (lvl > level) return;
+
+  char line[LOG_LINE];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (len < 0) return;
+  len = min((size_t) len, sizeof(line) - 1);
+
+  if (used + len > sizeof(ring)) {
+    dropped++;
+    return;
+  }
+  size_t first = min((size_t) len, sizeof(ring) - head);
+  memcpy(&ring[head], line, first);
+  memcpy(ring, line + first, len - first);
+  head = (head + len) % sizeof(ring);
+  used += len;
+}
+
+size_t logDrain(HardwareSerial & port) {
+  size_t n = min(used, (size_t) max(port.availableForWrite(), 0));
+  size_t written = n;
+  while (n > 0) {
+    size_t chunk = min(n, sizeof(ring) - tail);
+    port.write((const uint8_t *) &ring[tail], chunk);
+    tail = (tail + chunk) % sizeof(ring);
+    used -= chunk;
+    n -= chunk;
+  }
+  return written;
+}
+
+void logSetLevel(uint8_t lvl) {
+  level = min(lvl, (uint8_t) LOG_LEVEL_DEBUG);
+}
+
+uint8_t logGetLevel() {
+  return level;
+}
+
+uint32_t logDropped() {
+  return dropped;
+}
@@ -0,0 +1,62 @@
+/**
+ * @file Log.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Logging with compile time levels and a ring buffer, drained when the bus is idle
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+#define LOG_LEVEL_NONE    0
+#define LOG_LEVEL_ERROR   1
+#define LOG_LEVEL_WARN    2
+#define LOG_LEVEL_INFO    3
+#define LOG_LEVEL_DEBUG   4
+
+// Calls above the compile time level compile to nothing, arguments included.
+// The Modbus request path only logs at debug level, so production has no cost there
+#ifndef LOG_LEVEL
+#ifdef PRODUCTION
+#define LOG_LEVEL   LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL   LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#define LOG_BUFFER  1024    // bytes, a line that does not fit is dropped
+#define LOG_LINE    128     // longest line
+
+// format a line into the ring buffer, if level is at or below the runtime level
+void      logPrintf(uint8_t level, const char * format, ...) __attribute__ ((format (printf, 2, 3)));
+void      logSetLevel(uint8_t level);
+uint8_t   logGetLevel();
+// write what the port takes without blocking, returns # bytes written
+size_t    logDrain(HardwareSerial & port);
+uint32_t  logDropped();    // lines
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...)  logPrintf(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_E(...)  do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(...)  logPrintf(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_W(...)  do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...)  logPrintf(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_I(...)  do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...)  logPrintf(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_D(...)  do {} while (0)
+#endif
@@ -0,0 +1,969 @@
+/**
+ * @file Meter.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  An emulated meter of one model: the register image, the request path and the
+ *         master scan, specialized at compile time for the registers and encoding of a profile
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <limits.h>
+#include <MeterBase.h>
+
+/**
+ * @brief A meter model. A profile is a struct with only compile time constants:
+ *
+ *    map         the registerMap, REGISTER_MAP(table)
+ *    encoding    how a REG_FLOAT goes on the wire, a wireEncoding from Encoding.h
+ *    readFc      the function code that reads the registers: 3 holding, 4 input
+ *    configEnd   the word registers below this address are writable, and only read by a
+ *                master scan with config
+ *    regProt, regBaud, regAddr
+ *                the line settings, NO_REG if the master can't change them
+ *    bauds, numBauds
+ *                the speeds, the value of regBaud is an index in bauds
+ *    derived, numDerived
+ *                the registers computed from others, a table of derivedDef. An input may be
+ *                derived itself. A derived register that is set with setReg() is no longer derived
+ *
+ *  See DTSU666.h, DDSU666.h and SDM630.h
+ */
+/**
+ * @brief For each register, the derived registers that depend on it, directly or through
+ *  another derived register. Built by the compiler from the derived table of a profile
+ */
+template <class Profile>
+struct derivedDeps {
+  static constexpr auto & map = Profile::map;
+  uint32_t  dependents[map.size()];   // register -> derived registers to recompute when it changes
+  int8_t    derivedAt[map.size()];    // register -> its index in the derived table, or -1
+
+  static_assert(Profile::numDerived <= DERIVED_MAX, "too many derived registers");
+
+  constexpr derivedDeps() : dependents{}, derivedAt{} {
+    for (size_t i = 0; i < map.size(); i++) derivedAt[i] = -1;
+    for (size_t d = 0; d < Profile::numDerived; d++) {
+      const derivedDef & def = Profile::derived[d];
+      derivedAt[map.index(def.address)] = d;
+      for (uint8_t k = 0; k < def.numInputs; k++) dependents[map.index(def.inputs[k])] |= 1UL << d;
+    }
+    // closure: what depends on a derived register, depends on its inputs
+    for (size_t pass = 0; pass < Profile::numDerived; pass++) {
+      for (size_t i = 0; i < map.size(); i++) {
+        for (size_t d = 0; d < Profile::numDerived; d++) {
+          if (dependents[i] & (1UL << d)) dependents[i] |= dependents[map.index(Profile::derived[d].address)];
+        }
+      }
+    }
+  }
+};
+
+template <class Profile>
+class Meter : public MeterBase {
+public:
+  static constexpr auto & map = Profile::map;
+  static constexpr size_t NREGS = map.size();
+  static constexpr size_t SPAN  = map.span();
+  typedef typename Profile::encoding encoding;
+  static constexpr derivedDeps<Profile> deps = {};
+  static_assert(map.page(HISTORY_BASE) == nullptr && map.page(METRICS_BASE) == nullptr, "the vendor pages are taken");
+
+  Meter() {};  // master, or set slave later
+  Meter(uint slave_id) : MeterBase(slave_id) {};
+  using MeterBase::begin;
+  void    begin(MeterBus & bus, uint slaveid = 0) override;
+  void    applyLineConfig() override;
+  void    setReg(word address, float value) override;
+  void    setValue(word address, float value) override;
+  float   getReg(word address) override;
+  float   getValue(word address) override;
+  word    Hreg(word address) override;
+  bool    isRegister(word address) const override { return map.index(address) >= 0; }
+  Modbus::ResultCode readView(uint8_t fc, word startAddress, word numRegs, const uint8_t * & data, uint8_t * scratch) override;
+  void    beginUpdate() override;
+  void    commit() override;
+  bool    sourceAge(word address, ulong & age) override;
+  bool    estimate(word address, const estimatorConfig & config) override;
+  using MeterBase::readMeterData;
+  bool    readMeterData(uint slaveId, bool config, scanDoneCb cb) override;
+  void    printRegs(Print & out, word start, size_t numregs) override;
+  size_t  copyTo(Meter & dest);
+  uint32_t derivedComputed() const { return _derivedComputed; }   // formulas evaluated
+
+protected:
+  // the register image: one flat bank for all sections, holes included.
+  // Words are kept in Modbus (big endian) byte order so a read is served with a memcpy
+  // Double buffered: updates go to the shadow, commit() swaps the pointers
+  word           _image[2][SPAN];
+  word * volatile _live   = _image[0];
+  word *         _shadow  = _image[1];
+  uint8_t        _dirty[(SPAN + 7) / 8] = {};   // words changed in the shadow
+  uint8_t        _changed[(SPAN + 7) / 8] = {}; // words published since the last copyTo()
+  const Meter *  _copiedTo = nullptr;           // and where that went, at its generation
+  uint32_t       _copiedGeneration = 0;
+
+  // derived registers, a bit each: an input changed, or set by setReg() and no longer derived
+  uint32_t       _derivedDirty = 0;
+  uint32_t       _derivedOverridden = 0;
+  uint32_t       _derivedComputed = 0;
+
+  // per register: millis() when the source last set it, if the bit in _fed is set
+  ulong          _sourceAt[NREGS] = {};
+  uint8_t        _fed[(NREGS + 7) / 8] = {};
+  Estimator      _estimators[ESTIMATOR_MAX];
+  word           _estimated[ESTIMATOR_MAX] = {};   // their registers
+  uint8_t        _numEstimators = 0;
+
+private:
+  bool    Hreg(word address, word value);
+  float   regValue(size_t i);
+  void    refreshDerived(word startAddress, word numRegs);
+  void    computeDerived(size_t d);
+  bool    storeLive(word address, word value);
+  void    fromSource(size_t i, float value);
+  bool    ageOf(size_t i, ulong now, ulong & age);
+  bool    isStale(word startAddress, word numRegs, ulong now);
+  void    applyEstimates(word startAddress, word numRegs, ulong now);
+  bool    historyChanged();
+  void    recordHistory();
+  Modbus::ResultCode  onFrame(uint8_t * frame, uint8_t len) override;
+  void    prefetch(uint8_t fc, word startAddress, word numRegs, ulong inMs) override;
+  void    lineChanged(uint32_t baud, rtuFormat format) override;
+  void    scanTask() override;
+  Modbus::ResultCode  readRegs(word startAddress, word numRegs, uint8_t * dest);
+  Modbus::ResultCode  onWrite(uint8_t * frame, uint8_t len);
+  Modbus::ResultCode  writeRegs(word startAddress, word numRegs, const uint8_t * values);
+  bool    validConfig(word address, word value);
+  cachedFrame * buildFrame(word startAddress, word numRegs);
+  word    gapAfter(size_t i);
+  size_t  planRange(word startAddress, word endAddress);
+  size_t  legacyRange(word startAddress, word endAddress);
+  void    rejectHoles(word startAddress, word count);
+  bool    isRejected(size_t i) { return _rejected[i / 8] & (1 << (i % 8)); }
+
+  // the staging area of a master scan has the layout of the bank, in host byte order
+  word          _staging[SPAN];
+  uint8_t       _rejected[(NREGS + 7) / 8] = {};   // holes after register i the remote meter rejects
+};
+
+// the image is in Modbus byte order
+static inline word getWire(const word * w) {
+  const uint8_t * b = (const uint8_t *) w;
+  return (b[0] << 8) | b[1];
+}
+
+static inline void putWire(word * w, word value) {
+  uint8_t * b = (uint8_t *) w;
+  b[0] = value >> 8;
+  b[1] = value & 0xff;
+}
+
+// raw register access in the published image
+template <class Profile>
+word Meter<Profile>::Hreg(word address) {
+  int offset = map.offset(address);
+  if (offset < 0) return 0;
+  return getWire(&_live[offset]);
+}
+
+// stage a raw register value in the shadow image, only valid in an update. True if it changed
+template <class Profile>
+bool Meter<Profile>::Hreg(word address, word value) {
+  int offset = map.offset(address);
+  if (offset < 0 || getWire(&_shadow[offset]) == value) return false;
+  putWire(&_shadow[offset], value);
+  _dirty[offset / 8] |= 1 << (offset % 8);
+  return true;
+}
+
+/**
+ * @brief Batch updates. All changes between beginUpdate() and commit() go to the shadow image,
+ *        and are published at once by swapping the image pointers. A reader (the Modbus slave)
+ *        sees either all old or all new values, never a mix of two samples or half a float.
+ *        The shadow is kept equal to the live image, so an update needs no copy of the image.
+ */
+template <class Profile>
+void Meter<Profile>::beginUpdate() {
+  _updating = true;
+  _updateAt = millis();
+}
+
+template <class Profile>
+void Meter<Profile>::commit() {
+  if (!_updating) return;
+
+  // publish: one pointer store
+  word * published = _shadow;
+  _shadow = _live;
+  _live = published;
+  _generation++;
+  _updating = false;
+  _committedAt = millis();
+  bool record = _history != nullptr && historyChanged();
+
+  // bring the new shadow in step with the changed words, and patch the cached frames
+  for (size_t s = 0; s < map.numSections(); s++) {
+    const regSection & sec = map.sections[s];
+    for (word w = 0; w < sec.span; w++) {
+      size_t offset = sec.offset + w;
+      if (!(_dirty[offset / 8] & (1 << (offset % 8)))) continue;
+      _changed[offset / 8] |= 1 << (offset % 8);
+      word oldValue = getWire(&_shadow[offset]);
+      _shadow[offset] = _live[offset];
+      patchFrames(sec.start + w, oldValue, getWire(&_live[offset]));
+    }
+  }
+  memset(_dirty, 0, sizeof(_dirty));
+  if (record) recordHistory();
+}
+
+// a channel of the history changed in this update: one of its words, or the inputs of a derived one
+template <class Profile>
+bool Meter<Profile>::historyChanged() {
+  for (size_t c = 0; c < _history->numChannels(); c++) {
+    word address = _history->channel(c).address;
+    int i = map.index(address);
+    if (i < 0) continue;
+    int offset = map.offset(address);
+    for (int w = 0; w < (int) map.regs[i].type; w++) {
+      if (_dirty[(offset + w) / 8] & (1 << ((offset + w) % 8))) return true;
+    }
+    if (deps.derivedAt[i] >= 0 && (_derivedDirty & (1UL << deps.derivedAt[i]))) return true;
+  }
+  return false;
+}
+
+template <class Profile>
+void Meter<Profile>::recordHistory() {
+  float values[HISTORY_CHANNELS];
+  for (size_t c = 0; c < _history->numChannels(); c++) values[c] = getValue(_history->channel(c).address);
+  _history->sample(values, _committedAt);
+}
+
+// saves a value. Outside an update, it is published right away
+template <class Profile>
+void Meter<Profile>::setReg(word address, float val) {
+  int i = map.index(address);
+  if (i < 0) return;   // not a register
+  bool single = !_updating;
+  if (single) beginUpdate();
+  bool changed;
+  if (map.regs[i].type == REG_WORD) {
+    changed = Hreg(address, (word) val);
+  } else {
+    word first, second;
+    encoding::put(val, first, second);
+    changed = Hreg(address, first);
+    changed = Hreg(address + 1, second) || changed;
+  }
+  // a derived register with a value of its own stays that way
+  if (deps.derivedAt[i] >= 0) {
+    _derivedOverridden |= 1UL << deps.derivedAt[i];
+    _derivedDirty &= ~(1UL << deps.derivedAt[i]);
+  }
+  if (changed) _derivedDirty |= deps.dependents[i] & ~_derivedOverridden;
+  fromSource(i, val);
+  if (single) commit();
+}
+
+/**
+ * @brief Freshness. Every value the source sets is stamped with the source time of its update,
+ *  also when it did not change, and goes into the estimator of the register if it has one
+ */
+template <class Profile>
+void Meter<Profile>::fromSource(size_t i, float value) {
+  _sourceAt[i] = _updateAt;
+  _fed[i / 8] |= 1 << (i % 8);
+  for (size_t k = 0; k < _numEstimators; k++) {
+    if (_estimated[k] == map.regs[i].address) _estimators[k].sample(value / map.regs[i].scale, _updateAt);
+  }
+}
+
+template <class Profile>
+bool Meter<Profile>::ageOf(size_t i, ulong now, ulong & age) {
+  int d = deps.derivedAt[i];
+  if (d >= 0 && !(_derivedOverridden & (1UL << d))) {
+    const derivedDef & def = Profile::derived[d];
+    bool fed = false;
+    age = 0;
+    for (uint8_t k = 0; k < def.numInputs; k++) {
+      ulong a;
+      if (ageOf(map.index(def.inputs[k]), now, a)) {
+        fed = true;
+        age = max(age, a);
+      }
+    }
+    return fed;
+  }
+  if (!(_fed[i / 8] & (1 << (i % 8)))) return false;
+  age = now - _sourceAt[i];
+  return true;
+}
+
+template <class Profile>
+bool Meter<Profile>::sourceAge(word address, ulong & age) {
+  int i = map.index(address);
+  return i >= 0 && ageOf(i, millis(), age);
+}
+
+// a measurement in the range the source set, but too long ago. The configuration never gets stale
+template <class Profile>
+bool Meter<Profile>::isStale(word startAddress, word numRegs, ulong now) {
+  uint32_t endAddress = (uint32_t) startAddress + numRegs;
+  for (size_t i = map.lowerBound(max(startAddress, Profile::configEnd)); i < NREGS && map.regs[i].address < endAddress; i++) {
+    ulong age;
+    if (ageOf(i, now, age) && age > _staleAfter) return true;
+  }
+  return false;
+}
+
+template <class Profile>
+bool Meter<Profile>::estimate(word address, const estimatorConfig & config) {
+  int i = map.index(address);
+  if (i < 0 || address < Profile::configEnd) return false;
+  size_t k = 0;
+  while (k < _numEstimators && _estimated[k] != address) k++;
+  if (k == _numEstimators) {
+    if (k == ESTIMATOR_MAX) return false;
+    _estimated[_numEstimators++] = address;
+  }
+  _estimators[k].begin(config);
+  if (_fed[i / 8] & (1 << (i % 8))) _estimators[k].sample(regValue(i) / map.regs[i].scale, _sourceAt[i]);
+  return true;
+}
+
+/**
+ * @brief The estimates at now of the registers a read covers, and of the inputs of the derived
+ *  registers it covers, go into the published image like a computed register. The derived ones
+ *  follow. The next update of the source overwrites them with its samples
+ */
+template <class Profile>
+void Meter<Profile>::applyEstimates(word startAddress, word numRegs, ulong now) {
+  if (_updating) return;
+  uint32_t endAddress = (uint32_t) startAddress + numRegs;
+  uint32_t derived = 0;
+  for (size_t d = 0; d < Profile::numDerived; d++) {
+    word address = Profile::derived[d].address;
+    if (address + 2 > startAddress && address < endAddress) derived |= 1UL << d;
+  }
+  for (size_t k = 0; k < _numEstimators; k++) {
+    word address = _estimated[k];
+    int i = map.index(address);
+    bool covered = address + map.regs[i].type > startAddress && address < endAddress;
+    if (!_estimators[k].hasSample() || !(covered || (deps.dependents[i] & derived))) continue;
+    float value = _estimators[k].estimate(now) * map.regs[i].scale;
+    bool changed;
+    if (map.regs[i].type == REG_WORD) {
+      changed = storeLive(address, (word) roundf(value));
+    } else {
+      word first, second;
+      encoding::put(value, first, second);
+      changed = storeLive(address, first);
+      changed = storeLive(address + 1, second) || changed;
+    }
+    if (changed) _derivedDirty |= deps.dependents[i] & ~_derivedOverridden;
+  }
+}
+
+template <class Profile>
+void Meter<Profile>::setValue(word address, float val) {
+  int i = map.index(address);
+  if (i >= 0) setReg(address, val * map.regs[i].scale);
+}
+
+template <class Profile>
+float Meter<Profile>::getReg(word address) {
+  int i = map.index(address);
+  if (i < 0) return 0;
+  if (_derivedDirty) refreshDerived(address, 1);
+  return regValue(i);
+}
+
+// the published value of register i, in the units of the register
+template <class Profile>
+float Meter<Profile>::regValue(size_t i) {
+  word address = map.regs[i].address;
+  if (map.regs[i].type == REG_WORD) return Hreg(address);
+  return encoding::get(Hreg(address), Hreg(address + 1));
+}
+
+/**
+ * @brief Derived registers are computed when they are read, not when their inputs change: the
+ *        dirty ones a read covers are brought up to date before it is served, the others wait.
+ *        The new value goes into both images, and the cached frames that hold it
+ */
+template <class Profile>
+void Meter<Profile>::refreshDerived(word startAddress, word numRegs) {
+  uint32_t endAddress = (uint32_t) startAddress + numRegs;
+  for (size_t d = 0; d < Profile::numDerived; d++) {
+    if (!(_derivedDirty & (1UL << d))) continue;
+    word address = Profile::derived[d].address;
+    if (address + 2 > startAddress && address < endAddress) computeDerived(d);
+  }
+}
+
+template <class Profile>
+void Meter<Profile>::computeDerived(size_t d) {
+  const derivedDef & def = Profile::derived[d];
+  float in[DERIVED_MAX_INPUTS];
+  _derivedDirty &= ~(1UL << d);
+  for (uint8_t k = 0; k < def.numInputs; k++) {
+    int i = map.index(def.inputs[k]);
+    int e = deps.derivedAt[i];
+    if (e >= 0 && (_derivedDirty & (1UL << e))) computeDerived(e);
+    in[k] = regValue(i) / map.regs[i].scale;
+  }
+  int i = map.index(def.address);
+  word first, second;
+  encoding::put(def.formula(in) * map.regs[i].scale, first, second);
+  storeLive(def.address, first);
+  storeLive(def.address + 1, second);
+  _derivedComputed++;
+}
+
+template <class Profile>
+bool Meter<Profile>::storeLive(word address, word value) {
+  int offset = map.offset(address);
+  word oldValue = getWire(&_live[offset]);
+  if (oldValue == value) return false;
+  putWire(&_live[offset], value);
+  putWire(&_shadow[offset], value);
+  _changed[offset / 8] |= 1 << (offset % 8);
+  patchFrames(address, oldValue, value);
+  return true;
+}
+
+template <class Profile>
+float Meter<Profile>::getValue(word address) {
+  int i = map.index(address);
+  if (i < 0) return 0;
+  return getReg(address) / map.regs[i].scale;
+}
+
+// Print data.
+template <class Profile>
+void Meter<Profile>::printRegs (Print & out, word startAddress, size_t numregs) {
+  size_t i = map.lowerBound(startAddress);
+  for (; i < NREGS && numregs-- > 0; i++) {
+    const registerDef & reg = map.regs[i];
+    // the strings are in flash
+    char code[REG_CODE_LEN], name[REG_NAME_LEN];
+    memcpy_P(code, reg.code, sizeof(code));
+    memcpy_P(name, reg.name, sizeof(name));
+    if (reg.type == REG_FLOAT) {
+      out.printf("0x%04x (%6s\t%40s) = %.1f\n", (unsigned) reg.address, code, name, getReg(reg.address));
+      numregs--;
+    } else {
+      out.printf("0x%04x (%6s\t%40s) = %d\n", (unsigned) reg.address, code, name, Hreg(reg.address));
+    }
+  }
+}
+
+// the gap after register i, in words
+template <class Profile>
+word Meter<Profile>::gapAfter(size_t i) {
+  if (i + 1 >= NREGS) return 0;
+  return map.regs[i+1].address - map.regs[i].address - map.regs[i].type;
+}
+
+/**
+ * @brief plan the reads of all registers in an address range with the fewest, cheapest requests.
+ *        A request may read across holes when that costs less line time than an extra request,
+ *        but not across holes the remote meter rejected before, and not more than maxRegs.
+ *        Dynamic programming over the registers: best[j] is the cheapest plan for the first j.
+ *
+ * @return number of queued registers, holes included
+ */
+template <class Profile>
+size_t Meter<Profile>::planRange(word startAddress, word endAddress) {
+
+  const registerDef * regs = map.regs;
+  size_t first = map.lowerBound(startAddress);
+  size_t last = first;  // exclusive
+  while (last < NREGS && regs[last].address <= endAddress) last++;
+  if (first >= last) return 0;
+
+  size_t m = last - first;
+  ulong  best[NREGS + 1];
+  uint8_t from[NREGS + 1];
+  best[0] = 0;
+  for (size_t j = 0; j < m; j++) {
+    word end = regs[first + j].address + regs[first + j].type;
+    best[j+1] = ULONG_MAX;
+    for (size_t i = j + 1; i-- > 0; ) {
+      if (i < j && gapAfter(first + i) > 0 && isRejected(first + i)) break;
+      word span = end - regs[first + i].address;
+      if (span > _plan.maxRegs || (regs[first + i].address >> 12) != (word) (end - 1) >> 12) break;
+      ulong cost = best[i] + requestCost(span);
+      if (cost < best[j+1]) {
+        best[j+1] = cost;
+        from[j+1] = i;
+      }
+    }
+  }
+
+  // walk back to find the blocks, then queue them in address order
+  size_t numBlocks = 0;
+  for (size_t j = m; j > 0; j = from[j]) numBlocks++;
+  if (_scan.numBlocks + numBlocks > SCAN_MAX_BLOCKS) numBlocks = SCAN_MAX_BLOCKS - _scan.numBlocks;
+  size_t numPlanned = 0;
+  size_t b = _scan.numBlocks + numBlocks;
+  for (size_t j = m; j > 0 && b > _scan.numBlocks; j = from[j]) {
+    word start = regs[first + from[j]].address;
+    word count = regs[first + j - 1].address + regs[first + j - 1].type - start;
+    _scan.blocks[--b] = { start, count };
+    numPlanned += count;
+  }
+  _scan.numBlocks += numBlocks;
+  return numPlanned;
+}
+
+// # requests the old scheme needs: runs of up to 16 registers, a new request at every gap
+template <class Profile>
+size_t Meter<Profile>::legacyRange(word startAddress, word endAddress) {
+  const registerDef * regs = map.regs;
+  size_t numRequests = 0;
+  size_t i = map.lowerBound(startAddress);
+  while (i < NREGS && regs[i].address <= endAddress) {
+    word blockStart = regs[i].address;
+    int numRegs = 0;
+    while (i<NREGS && (word) (blockStart + numRegs) == regs[i].address &&
+                      regs[i].address < endAddress &&  numRegs < 16) {
+      numRegs+= regs[i].type;
+      i++;
+    }
+    if (numRegs == 0) i++;
+    numRequests++;
+  }
+  return numRequests;
+}
+
+// a request across holes was rejected: don't read across these holes again
+template <class Profile>
+void Meter<Profile>::rejectHoles(word startAddress, word count) {
+  size_t i = map.lowerBound(startAddress);
+  for (; i < NREGS && map.regs[i].address + map.regs[i].type < startAddress + count; i++) {
+    if (gapAfter(i) > 0) {
+      LOG_I("Hole after 0x%04x rejected by remote meter\n", map.regs[i].address);
+      _rejected[i / 8] |= 1 << (i % 8);
+    }
+  }
+}
+
+/**
+ * @brief start reading data from a remote meter, non blocking. The blocks of all sections are
+ *        requested back to back from task(), each as soon as the previous reply is in.
+ *        Results are collected in a staging area and applied in one go when the scan is complete,
+ *        so the image never holds a mix of two scans.
+ *
+ * @param config  also read the configuration registers, below configEnd
+ * @param cb called when done: ok is false if any block failed, nothing is applied then
+ * @return false if a scan is already running
+ */
+template <class Profile>
+bool Meter<Profile>::readMeterData(uint slaveId, bool config, scanDoneCb cb) {
+  if (_scan.active) return false;
+
+  _scan.slaveId = slaveId;
+  _scan.numBlocks = 0;
+  _scan.next = 0;
+  _scan.regsRead = 0;
+  _scan.failed = false;
+  _scan.done = cb;
+
+  _scan.numLegacy = 0;
+  for (size_t s = 0; s < map.numSections(); s++) {
+    const regSection & sec = map.sections[s];
+    if (sec.start < Profile::configEnd && !config) continue;
+    planRange(sec.start, sec.start + sec.span);
+    _scan.numLegacy += legacyRange(sec.start, sec.start + sec.span);
+  }
+  LOG_D("Scan plan: %d requests (old scheme: %d)\n", (int) _scan.numBlocks, (int) _scan.numLegacy);
+
+  _scan.active = true;
+  scanTask();
+  return true;
+}
+
+// drive the scan: issue the next block when the line is free, apply when complete
+template <class Profile>
+void Meter<Profile>::scanTask() {
+
+  if (!_scan.active || _bus == nullptr) return;
+  if (_bus->isBusy()) return;   // a transaction is in progress
+
+  if (!_scan.failed && _scan.next < _scan.numBlocks) {
+    const scanBlock & block = _scan.blocks[_scan.next++];
+    word * dest = &_staging[map.offset(block.start)];
+    LOG_D("Pulling %d registers from %d at %04x\n",block.count,_scan.slaveId,block.start);
+    // use a lambda as callback
+    auto done = [this, block](Modbus::ResultCode event, uint16_t, void*) {
+      if (event == Modbus::EX_SUCCESS) {
+        _scan.regsRead += block.count;
+      } else {
+        LOG_W("Block at %04x failed, status=0x%02X\n",block.start,event);  // Display Modbus error code
+        // learn: the next plan will not read across the holes in this block
+        if (event == Modbus::EX_ILLEGAL_ADDRESS) rejectHoles(block.start, block.count);
+        _scan.failed = true;
+      }
+      return true;
+    };
+    if (!_bus->read(Profile::readFc, _scan.slaveId, block.start, dest, block.count, done)) _scan.failed = true;
+    return;
+  }
+
+  // complete: apply all blocks at once, or nothing
+  if (!_scan.failed) {
+    beginUpdate();
+    for (size_t b = 0; b < _scan.numBlocks; b++) {
+      int offset = map.offset(_scan.blocks[b].start);
+      for (word r = 0; r < _scan.blocks[b].count; r++) {
+        Hreg(_scan.blocks[b].start + r, _staging[offset + r]);
+      }
+    }
+    commit();
+    for (size_t b = 0; b < _scan.numBlocks; b++) {
+      uint32_t end = (uint32_t) _scan.blocks[b].start + _scan.blocks[b].count;
+      for (size_t i = map.lowerBound(_scan.blocks[b].start); i < NREGS && map.regs[i].address < end; i++) fromSource(i, regValue(i));
+    }
+  }
+  _scan.active = false;
+  if (_scan.done) _scan.done(!_scan.failed, _scan.failed ? 0 : _scan.regsRead);
+}
+
+/**
+ * @brief serve a read from the bank. A read may cover holes and the unused part of the
+ *        page of a section, these read as 0. It may not cross a page.
+ *
+ * @param dest the response data, numRegs words in Modbus byte order
+ * @return Modbus::ResultCode
+ */
+template <class Profile>
+Modbus::ResultCode Meter<Profile>::readRegs(word startAddress, word numRegs, uint8_t * dest) {
+
+  if (numRegs == 0 || numRegs > MODBUS_MAX_REGS) return Modbus::EX_ILLEGAL_VALUE;
+  if (startAddress >= METRICS_BASE) return readMetrics(startAddress, numRegs, dest);
+  if (startAddress >= HISTORY_BASE) {
+    if (_history == nullptr) return Modbus::EX_ILLEGAL_ADDRESS;
+    return _history->read(startAddress, numRegs, dest, millis());
+  }
+  const regSection * sec = map.page(startAddress);
+  uint32_t endAddress = (uint32_t) startAddress + numRegs;   // exclusive
+  if (sec == nullptr || ((endAddress - 1) >> 12) != (startAddress >> 12u)) return Modbus::EX_ILLEGAL_ADDRESS;
+
+  // intersect with the section, the rest is 0
+  word from = max(startAddress, sec->start);
+  word to   = min(endAddress, (uint32_t) sec->start + sec->span);
+  if (from >= to) {
+    memset(dest, 0, numRegs * 2);
+    return Modbus::EX_SUCCESS;
+  }
+  memset(dest, 0, (from - startAddress) * 2);
+  memcpy(dest + (from - startAddress) * 2, &_live[sec->offset + from - sec->start], (to - from) * 2);
+  memset(dest + (to - startAddress) * 2, 0, (endAddress - to) * 2);
+  return Modbus::EX_SUCCESS;
+}
+
+// no copy when the range is inside a section: the image is in Modbus byte order
+template <class Profile>
+Modbus::ResultCode Meter<Profile>::readView(uint8_t fc, word startAddress, word numRegs, const uint8_t * & data, uint8_t * scratch) {
+  if (fc != Profile::readFc) return Modbus::EX_ILLEGAL_FUNCTION;
+  if (startAddress < HISTORY_BASE) {
+    ulong now = millis();
+    if (_staleAfter > 0 && isStale(startAddress, numRegs, now)) {
+      _stats.stale++;
+      return Modbus::EX_SLAVE_FAILURE;
+    }
+    if (_numEstimators > 0) applyEstimates(startAddress, numRegs, now);
+  }
+  if (_derivedDirty) refreshDerived(startAddress, numRegs);
+  const regSection * sec = map.section(startAddress);
+  if (numRegs > 0 && numRegs <= MODBUS_MAX_REGS && sec != nullptr && startAddress + numRegs <= sec->start + sec->span) {
+    data = (const uint8_t *) &_live[sec->offset + startAddress - sec->start];
+    return Modbus::EX_SUCCESS;
+  }
+  data = scratch;
+  return readRegs(startAddress, numRegs, scratch);
+}
+
+// build the response for a window in the least recently used slot, nullptr if it does not fit
+template <class Profile>
+cachedFrame * Meter<Profile>::buildFrame(word startAddress, word numRegs) {
+  if (numRegs > FRAME_CACHE_REGS) return nullptr;
+
+  cachedFrame * f = lruFrame();
+  f->count = 0;
+  if (readRegs(startAddress, numRegs, f->frame + 3) != Modbus::EX_SUCCESS) return nullptr;
+  f->frame[0] = _slaveid;
+  f->frame[1] = Profile::readFc;
+  f->frame[2] = numRegs * 2;
+  appendCrc(f->frame, 3 + numRegs * 2);
+  f->start = startAddress;
+  f->count = numRegs;
+  return f;
+}
+
+/**
+ * @brief a request for our slave id, dispatched by the bus. The frame is the PDU: slaveid and crc
+ *        are already stripped and checked. We answer reads straight from the bank, and writes of
+ *        the configuration registers.
+ */
+template <class Profile>
+Modbus::ResultCode Meter<Profile>::onFrame(uint8_t * frame, uint8_t len) {
+
+  _requestAt = micros();
+
+  uint8_t fc = frame[0];
+  _stats.requests[fc < METRIC_FCS ? fc : 0]++;
+  if (fc == Modbus::FC_WRITE_REG || fc == Modbus::FC_WRITE_REGS) return onWrite(frame, len);
+  if (fc != Profile::readFc) {
+    LOG_D("Function 0x%02x not supported \n",fc);
+    sendException(fc, Modbus::EX_ILLEGAL_FUNCTION);
+    return Modbus::EX_ILLEGAL_FUNCTION;
+  }
+  // a read we support, but not a read request
+  if (len != 5) {
+    _stats.badFrames++;
+    sendException(fc, Modbus::EX_ILLEGAL_VALUE);
+    return Modbus::EX_ILLEGAL_VALUE;
+  }
+
+  word startAddress = (frame[1] << 8) | frame[2];
+  word numRegs      = (frame[3] << 8) | frame[4];
+  LOG_D("Reading %d registers at 0x%0x (slaveId %d)\n",numRegs,startAddress,_slaveid);
+
+  // a source that went silent, the estimates at this moment
+  ulong now = millis();
+  if (startAddress < HISTORY_BASE) {
+    if (_staleAfter > 0 && isStale(startAddress, numRegs, now)) {
+      _stats.stale++;
+      sendException(fc, Modbus::EX_SLAVE_FAILURE);
+      return Modbus::EX_SLAVE_FAILURE;
+    }
+    if (_numEstimators > 0) applyEstimates(startAddress, numRegs, now);
+  }
+
+  // the history and the metrics change all the time, they are never cached
+  cachedFrame * f = nullptr;
+  if (_derivedDirty) refreshDerived(startAddress, numRegs);
+  if (startAddress < HISTORY_BASE) {
+    _stats.dataAge.record(now - _committedAt);
+    f = findFrame(startAddress, numRegs);
+    if (f != nullptr) {
+      _stats.hits++;
+    } else {
+      _stats.misses++;
+      f = buildFrame(startAddress, numRegs);
+    }
+  }
+  if (f != nullptr) {
+    f->lastUsed = millis();
+    sendRaw(f->frame, 3 + numRegs * 2 + 2);
+    return Modbus::EX_SUCCESS;
+  }
+
+  // not cacheable, or an exception
+  uint8_t response[MODBUS_MAX_FRAME];
+  Modbus::ResultCode result = readRegs(startAddress, numRegs, response + 3);
+  if (result != Modbus::EX_SUCCESS) {
+    sendException(fc, result);
+    return result;
+  }
+  response[0] = _slaveid;
+  response[1] = fc;
+  response[2] = numRegs * 2;
+  sendFrame(response, 3 + numRegs * 2);
+  return Modbus::EX_SUCCESS;
+}
+
+// the work of a read, done before it comes in: estimates, derived registers and the frame. The
+// frame counts as used when the poll is due, so the frames polled before it are replaced first
+template <class Profile>
+void Meter<Profile>::prefetch(uint8_t fc, word startAddress, word numRegs, ulong inMs) {
+  if (fc != Profile::readFc || numRegs == 0 || numRegs > FRAME_CACHE_REGS || startAddress >= HISTORY_BASE) return;
+  if (_numEstimators > 0) applyEstimates(startAddress, numRegs, millis());
+  if (_derivedDirty) refreshDerived(startAddress, numRegs);
+  cachedFrame * f = findFrame(startAddress, numRegs);
+  if (f == nullptr) f = buildFrame(startAddress, numRegs);
+  if (f != nullptr) f->lastUsed = millis() + inMs;
+}
+
+// the line settings must be valid, and the slave id free on the line
+template <class Profile>
+bool Meter<Profile>::validConfig(word address, word value) {
+  if (address == Profile::regProt) return value < NUM_RTU_FORMATS;
+  if (address == Profile::regBaud) return value < Profile::numBauds;
+  if (address == Profile::regAddr) {
+    return value >= 1 && value <= MODBUS_MAX_ID && (_bus == nullptr || _bus->meter(value) == nullptr || _bus->meter(value) == this);
+  }
+  return true;
+}
+
+// a write is only allowed for the word registers of the configuration page
+template <class Profile>
+Modbus::ResultCode Meter<Profile>::writeRegs(word startAddress, word numRegs, const uint8_t * values) {
+  if (numRegs == 0 || numRegs > MODBUS_MAX_WRITE) return Modbus::EX_ILLEGAL_VALUE;
+  for (word r = 0; r < numRegs; r++) {
+    word address = startAddress + r;
+    int i = map.index(address);
+    if (address >= Profile::configEnd || i < 0 || map.regs[i].type != REG_WORD) return Modbus::EX_ILLEGAL_ADDRESS;
+    if (!validConfig(address, (values[r*2] << 8) | values[r*2+1])) return Modbus::EX_ILLEGAL_VALUE;
+  }
+  beginUpdate();
+  for (word r = 0; r < numRegs; r++) Hreg(startAddress + r, (values[r*2] << 8) | values[r*2+1]);
+  commit();
+  return Modbus::EX_SUCCESS;
+}
+
+/**
+ * @brief FC06 and FC16. The response goes out with the old line settings and slave id,
+ *        a new speed, format or id takes effect right after it, like on the real meter.
+ */
+template <class Profile>
+Modbus::ResultCode Meter<Profile>::onWrite(uint8_t * frame, uint8_t len) {
+  uint8_t fc = frame[0];
+  word startAddress = (frame[1] << 8) | frame[2];
+  word numRegs = 1;
+  const uint8_t * values = frame + 3;
+  if (fc == Modbus::FC_WRITE_REGS && len >= 6) {
+    numRegs = (frame[3] << 8) | frame[4];
+    values = frame + 6;
+  }
+  if ((fc == Modbus::FC_WRITE_REG && len != 5) ||
+      (fc == Modbus::FC_WRITE_REGS && (len < 6 || frame[5] != numRegs * 2 || len != 6 + frame[5]))) {
+    _stats.badFrames++;
+    sendException(fc, Modbus::EX_ILLEGAL_VALUE);
+    return Modbus::EX_ILLEGAL_VALUE;
+  }
+  LOG_D("Writing %d registers at 0x%0x (slaveId %d)\n",numRegs,startAddress,_slaveid);
+
+  word prot = Hreg(Profile::regProt), baud = Hreg(Profile::regBaud), addr = Hreg(Profile::regAddr);
+  Modbus::ResultCode result = writeRegs(startAddress, numRegs, values);
+  if (result != Modbus::EX_SUCCESS) {
+    sendException(fc, result);
+    return result;
+  }
+  // FC06 echoes the request, FC16 answers with address and count
+  uint8_t response[8] = { (uint8_t) _slaveid, fc, frame[1], frame[2], frame[3], frame[4] };
+  sendFrame(response, 6);
+
+  if (Profile::regAddr != NO_REG && Hreg(Profile::regAddr) != addr) {
+    _bus->readdress(*this, Hreg(Profile::regAddr));
+    _slaveid = Hreg(Profile::regAddr);
+    clearFrames();    // they carry the old id
+  }
+  if (Hreg(Profile::regProt) != prot || Hreg(Profile::regBaud) != baud) applyLineConfig();
+  if (_configWrite) {
+    for (word r = 0; r < numRegs; r++) _configWrite(startAddress + r, Hreg(startAddress + r));
+  }
+  return Modbus::EX_SUCCESS;
+}
+
+// Setup our meter image, on a line that may have other meters. They share speed and format
+//
+template <class Profile>
+void Meter<Profile>::begin(MeterBus & bus, uint slaveid) {
+
+  if (_slaveid == 0) _slaveid = slaveid;  // set if not already initialized, optional slaveid defaults to 0
+  _bus = &bus;
+
+  // setup registers and set some initial data
+  memset(_image, 0, sizeof(_image));
+  memset(_dirty, 0, sizeof(_dirty));
+  _copiedTo = nullptr;
+  clearFrames();
+  for (size_t i=0; i<NREGS; i++) {
+    setReg(map.regs[i].address, map.regs[i].defval);
+  }
+  _derivedDirty = _derivedOverridden = 0;
+  if (_slaveid != 0 && Profile::regAddr != NO_REG) setReg(Profile::regAddr, _slaveid);
+  // the defaults are not from the source
+  memset(_fed, 0, sizeof(_fed));
+  for (size_t k = 0; k < _numEstimators; k++) _estimators[k].begin(_estimators[k].config());
+
+  // are we a master or slave?
+  if (!bus.attach(*this)) {
+    LOG_E("Slave id %d is taken, or the line is full\n", (int) _slaveid);
+  } else if (_slaveid == 0) {
+    LOG_I("Meter is a master\n");
+  } else {
+    LOG_I("Meter is a slave with Id %d\n", (int) _slaveid);
+  }
+  // the first meter opens the line, the others take its settings
+  if (bus.baud() == 0) applyLineConfig(); else lineChanged(bus.baud(), bus.format());
+}
+
+// the line as the registers say. Without them, as it is
+template <class Profile>
+void Meter<Profile>::applyLineConfig() {
+  if (_bus == nullptr) return;
+  uint32_t baud = _bus->baud() ? _bus->baud() : 9600;
+  rtuFormat format = _bus->baud() ? _bus->format() : RTU_8N1;
+  if constexpr (Profile::regBaud != NO_REG) {
+    word b = Hreg(Profile::regBaud);
+    baud = Profile::bauds[b < Profile::numBauds ? b : Profile::numBauds - 1];
+  }
+  if constexpr (Profile::regProt != NO_REG) {
+    word p = Hreg(Profile::regProt);
+    format = p < NUM_RTU_FORMATS ? (rtuFormat) p : RTU_8N1;
+  }
+  _bus->setLine(baud, format);
+}
+
+// the line changed, by us or another meter on it: the registers follow
+template <class Profile>
+void Meter<Profile>::lineChanged(uint32_t baud, rtuFormat format) {
+  if constexpr (Profile::regBaud != NO_REG) {
+    for (word b = 0; b < Profile::numBauds; b++) {
+      if (Profile::bauds[b] == baud && Hreg(Profile::regBaud) != b) setReg(Profile::regBaud, b);
+    }
+  }
+  if constexpr (Profile::regProt != NO_REG) {
+    if (Hreg(Profile::regProt) != format) setReg(Profile::regProt, format);
+  }
+  _plan.baud = baud;
+}
+
+/**
+ * @brief Mirror the data to another meter, published as one update. Only the words published
+ *  since the last copy go over, a block copy per run of them, and only those are patched into
+ *  the frames of dest. The first copy to dest copies the whole image, as does a copy after dest
+ *  changed by itself, e.g. a write of its master. The line settings of dest stay its own.
+ *  The source times go over as they are, a value that came in again is fresh data
+ *
+ * @return the # of words copied
+ */
+template <class Profile>
+size_t Meter<Profile>::copyTo(Meter & dest) {
+  static constexpr word line[] = { Profile::regProt, Profile::regBaud, Profile::regAddr };
+  if (_derivedDirty) refreshDerived(0, 0xffff);
+  if (_copiedTo != &dest || dest._generation != _copiedGeneration) memset(_changed, 0xff, sizeof(_changed));
+
+  size_t copied = 0;
+  dest.beginUpdate();
+  for (size_t w = 0; w < SPAN; ) {
+    if (w % 8 == 0 && _changed[w / 8] == 0) {
+      w += 8;
+      continue;
+    }
+    size_t end = w;
+    for (; end < SPAN && (_changed[end / 8] & (1 << (end % 8))); end++) dest._dirty[end / 8] |= 1 << (end % 8);
+    memcpy(&dest._shadow[w], &_live[w], (end - w) * sizeof(word));
+    copied += end - w;
+    w = end + 1;
+  }
+  for (word address : line) {
+    if (address != NO_REG) dest._shadow[map.offset(address)] = dest._live[map.offset(address)];
+  }
+  memcpy(dest._sourceAt, _sourceAt, sizeof(_sourceAt));
+  memcpy(dest._fed, _fed, sizeof(_fed));
+  dest.commit();
+
+  memset(_changed, 0, sizeof(_changed));
+  _copiedTo = &dest;
+  _copiedGeneration = dest._generation;
+  return copied;
+}
@@ -0,0 +1,127 @@
+/**
+ * @file MeterBase.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  What all emulated meters have in common, whatever their registers
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <MeterBase.h>
+
+// time on the line for one request of numRegs: request, response, 2 silent intervals, turnaround
+ulong MeterBase::requestCost(word numRegs) {
+  ulong charUs = 10 * 1000000UL / _plan.baud;
+  return (8 + 5 + 2 * numRegs + 7) * charUs + _plan.turnaroundUs;
+}
+
+// Planner settings: max registers per request (1..125), line speed and slave turnaround
+void MeterBase::setPlanner(word maxRegs, uint32_t baud, ulong turnaroundUs) {
+  _plan.maxRegs = constrain(maxRegs, (word) 1, (word) MODBUS_MAX_REGS);
+  _plan.baud = baud;
+  _plan.turnaroundUs = turnaroundUs;
+}
+
+// blocking read of a remote meter, as before: returns the number of registers read
+size_t MeterBase::readMeterData(uint slaveId, bool config) {
+  size_t regsread = 0;
+  if (!readMeterData(slaveId, config, [&](bool ok, size_t numRegs) { regsread = ok ? numRegs : 0; })) return 0;
+  while (_scan.active) {
+    task();
+    yield();
+  }
+  return regsread;
+}
+
+// the requests of the last scan and their responses, crc included
+size_t MeterBase::scanBytes() {
+  size_t n = 0;
+  for (size_t b = 0; b < _scan.numBlocks; b++) n += 8 + 5 + 2 * _scan.blocks[b].count;
+  return n;
+}
+
+// the vendor registers: the metrics, each value high word first
+Modbus::ResultCode MeterBase::readMetrics(word startAddress, word numRegs, uint8_t * dest) {
+  word first = startAddress - METRICS_BASE;
+  if (first + numRegs > METRIC_REGS) return Modbus::EX_ILLEGAL_ADDRESS;
+  const uint32_t * values = (const uint32_t *) &_stats;
+  for (word r = first; r < first + numRegs; r++) {
+    word value = (r & 1) ? values[r / 2] & 0xffff : values[r / 2] >> 16;
+    *dest++ = value >> 8;
+    *dest++ = value & 0xff;
+  }
+  return Modbus::EX_SUCCESS;
+}
+
+// send a complete frame, crc included
+void MeterBase::sendRaw(const uint8_t * frame, size_t len) {
+  _stats.latency.record(micros() - _requestAt);
+  _stats.responses++;
+  _bus->send(frame, len);
+}
+
+// send a frame, adds the crc. Frame must have room for it
+void MeterBase::sendFrame(uint8_t * frame, size_t len) {
+  len = appendCrc(frame, len);
+  sendRaw(frame, len);
+}
+
+void MeterBase::sendException(uint8_t fc, Modbus::ResultCode code) {
+  if (code == Modbus::EX_ILLEGAL_FUNCTION) _stats.illegalFunction++;
+  else if (code == Modbus::EX_ILLEGAL_ADDRESS) _stats.illegalAddress++;
+  else if (code == Modbus::EX_ILLEGAL_VALUE) _stats.illegalValue++;
+  uint8_t frame[5] = { (uint8_t) _slaveid, (uint8_t) (fc | 0x80), (uint8_t) code };
+  sendFrame(frame, 3);
+}
+
+/**
+ * @brief Response frame cache. The master polls the same few windows over and over,
+ *        so we keep their responses ready to send. A change of a register patches the
+ *        frames that contain it, crc included, so a hit never needs a rebuild.
+ */
+cachedFrame * MeterBase::findFrame(word startAddress, word numRegs) {
+  for (auto & f : _frames) {
+    if (f.count == numRegs && f.start == startAddress) return &f;
+  }
+  return nullptr;
+}
+
+// a free slot, or the least recently used one
+cachedFrame * MeterBase::lruFrame() {
+  cachedFrame * f = &_frames[0];
+  for (auto & c : _frames) {
+    if (c.count == 0) return &c;
+    if (c.lastUsed < f->lastUsed) f = &c;
+  }
+  return f;
+}
+
+// a register changed: patch the data and crc of every cached frame that contains it
+void MeterBase::patchFrames(word address, word oldValue, word newValue) {
+  for (auto & f : _frames) {
+    if (f.count == 0 || address < f.start || address >= f.start + f.count) continue;
+    size_t pos = 3 + (address - f.start) * 2;
+    size_t end = 3 + f.count * 2;
+    uint8_t delta[2] = { (uint8_t) ((oldValue ^ newValue) >> 8), (uint8_t) ((oldValue ^ newValue) & 0xff) };
+    f.frame[pos]   = newValue >> 8;
+    f.frame[pos+1] = newValue & 0xff;
+    word crc = crc16Patch(f.frame[end] | (f.frame[end+1] << 8), delta, 2, end - pos - 2);
+    f.frame[end]   = crc & 0xff;
+    f.frame[end+1] = crc >> 8;
+  }
+}
+
+// serve the line, and drive a master scan
+void MeterBase::task() {
+  if (_bus != nullptr) _bus->task();
+}
+
+// Setup our meter image, on a line of its own
+//
+void MeterBase::begin(RtuTransport * rtu, int16_t re_depin, uint slaveid) {
+  if (_ownBus == nullptr) _ownBus = new MeterBus();
+  _ownBus->begin(rtu, re_depin);
+  delay(500);
+  begin(*_ownBus, slaveid);
+}
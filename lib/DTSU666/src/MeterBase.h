@@ -0,0 +1,179 @@
+/**
+ * @file MeterBase.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  What all emulated meters have in common, whatever their registers: the line, the
+ *         frame cache, the metrics and the state of a master scan. See Meter.h for the image
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <ModbusRTU.h>
+#include <SoftwareSerial.h>
+#include <RtuTransport.h>
+#include <MeterBus.h>
+#include <RegisterMap.h>
+#include <ModbusCrc.h>
+#include <Encoding.h>
+#include <Metrics.h>
+#include <History.h>
+#include <Estimator.h>
+#include <Log.h>
+
+typedef std::function<void(word address, word value)> configWriteCb;
+
+#define MODBUS_MAX_REGS   125   // max # registers in one read request
+#define MODBUS_MAX_WRITE  123   // max # registers in one write request
+#define MODBUS_MAX_FRAME  256   // max RTU frame size
+
+// Response frames of recently polled windows are kept ready to send, crc included
+#define FRAME_CACHE_SIZE  4     // # windows
+#define FRAME_CACHE_REGS  72    // largest window that is cached, 0x2000 - 0x2047 fits
+
+typedef struct cachedFrame {
+  word    start;
+  word    count;      // 0 = free
+  ulong   lastUsed;   // millis(), for LRU replacement
+  uint8_t frame[3 + FRAME_CACHE_REGS * 2 + 2];
+} cachedFrame;
+
+// Master mode: a scan of a remote meter is a queue of block reads
+#define SCAN_MAX_BLOCKS   16
+
+typedef struct scanBlock {
+  word    start;
+  word    count;
+} scanBlock;
+
+typedef std::function<void(bool ok, size_t numRegs)> scanDoneCb;
+
+// read planner settings, the cost of a request is estimated from these
+typedef struct planConfig {
+  word      maxRegs;        // per request, up to MODBUS_MAX_REGS
+  uint32_t  baud;
+  ulong     turnaroundUs;   // response time of the remote meter
+} planConfig;
+
+/**
+ * @brief An emulated meter, any model. The model specific part, registers and their encoding,
+ *  is Meter<Profile>, this is what the line, the ingest and the application see of it.
+ *  A meter serves as a slave, or reads a remote meter of the same model as a master.
+ */
+class MeterBase {
+  friend class MeterBus;
+public:
+  virtual ~MeterBase() {}
+  // a line of its own
+  void    begin(RtuTransport * rtu, int16_t en_pin, uint slaveid = 0);
+  // a line shared with other meters, see MeterBus
+  virtual void begin(MeterBus & bus, uint slaveid = 0) = 0;
+  uint    slaveId() const { return _slaveid; }
+  MeterBus * bus() { return _bus; }
+  // (re)open the line with the speed and format in the configuration registers
+  virtual void applyLineConfig() = 0;
+  // the master wrote a configuration register, e.g. to keep it in flash
+  void    onConfigWrite(configWriteCb cb) { _configWrite = cb; }
+
+  // a value in the units of the register. Outside an update, it is published right away
+  virtual void  setReg(word address, float value) = 0;
+  // a value in physical units (W, V, A, Hz, kWh), scaled to the register
+  virtual void  setValue(word address, float value) = 0;
+  // the published value, in the units of the register
+  virtual float getReg(word address) = 0;
+  // the published value, in physical units
+  virtual float getValue(word address) = 0;
+  virtual word  Hreg(word address) = 0;
+  virtual bool  isRegister(word address) const = 0;
+  // a read that comes in over another transport (Modbus TCP). data points into the published
+  // image when the range is in one section, else the registers are copied to scratch (numRegs * 2).
+  // Valid until the next commit()
+  virtual Modbus::ResultCode readView(uint8_t fc, word startAddress, word numRegs, const uint8_t * & data, uint8_t * scratch) = 0;
+  // batch update: setReg() calls in between are published together by commit()
+  virtual void  beginUpdate() = 0;
+  virtual void  commit() = 0;
+  // when the values of this update were measured, millis(). By default when beginUpdate() was called
+  void    sourceTime(ulong ms) { if (_updating) _updateAt = ms; }
+  // ms since the source set the register, for a derived one the oldest of its inputs. False if it never did
+  virtual bool  sourceAge(word address, ulong & age) = 0;
+  // estimate a register between the updates of the source, evaluated when a read covers it or a
+  // register derived from it. False if it is not a measurement, or all ESTIMATOR_MAX are taken
+  virtual bool  estimate(word address, const estimatorConfig & config) = 0;
+  // a read of a measurement the source did not set for longer than ms is refused with
+  // EX_SLAVE_FAILURE: the master sees a failing meter, not old data. 0: always serve
+  void    staleAfter(ulong ms) { _staleAfter = ms; }
+  uint32_t generation() { return _generation; }   // of the published image
+
+  size_t  readMeterData(uint slaveId,bool config = false);
+  virtual bool readMeterData(uint slaveId, bool config, scanDoneCb cb) = 0;
+  bool    isScanning() { return _scan.active; }
+  void    setPlanner(word maxRegs, uint32_t baud = 9600, ulong turnaroundUs = 5000);
+  size_t  plannedRequests() { return _scan.numBlocks; }   // of the last scan
+  size_t  legacyRequests()  { return _scan.numLegacy; }   // the same with the old scheme
+  size_t  scanBytes();                                    // on the line for the last scan, both ways
+  // to a port of its own, not the log: a long list does not fit the ring buffer
+  virtual void printRegs(Print & out, word start, size_t numregs) = 0;
+
+  // on a shared line, call task() of the bus instead
+  void    task();
+  bool    isBusy() { return _bus != nullptr && _bus->isBusy(); }
+  // no transaction in progress, no request coming in, the line silent: the time to do slow things
+  bool    isIdle() { return _bus == nullptr || _bus->isIdle(); }
+  const meterMetrics & stats() { return _stats; }
+  // record the channels of the history on each commit that changes one, nullptr to stop.
+  // It is readable from HISTORY_BASE
+  void    history(History * history) { _history = history; }
+  void    setMetric(size_t i, uint32_t value) { if (i < METRIC_APP) _stats.app[i] = value; }
+
+protected:
+  MeterBase() {}
+  MeterBase(uint slave_id) : _slaveid(slave_id) {}
+
+  // a request for our slave id, dispatched by the bus
+  virtual Modbus::ResultCode  onFrame(uint8_t * frame, uint8_t len) = 0;
+  // the master reads this window in about inMs: bring it up to date, and its response into the cache
+  virtual void  prefetch(uint8_t fc, word startAddress, word numRegs, ulong inMs) = 0;
+  // the line changed, by us or another meter on it
+  virtual void  lineChanged(uint32_t baud, rtuFormat format) = 0;
+  virtual void  scanTask() = 0;
+
+  Modbus::ResultCode  readMetrics(word startAddress, word numRegs, uint8_t * dest);
+  void    sendException(uint8_t fc, Modbus::ResultCode code);
+  void    sendFrame(uint8_t * frame, size_t len);
+  void    sendRaw(const uint8_t * frame, size_t len);
+  cachedFrame * findFrame(word startAddress, word numRegs);
+  cachedFrame * lruFrame();
+  void    patchFrames(word address, word oldValue, word newValue);
+  void    clearFrames() { for (auto & f : _frames) f.count = 0; }
+  ulong   requestCost(word numRegs);
+
+  uint      _slaveid = 0;
+  MeterBus * _bus = nullptr;
+  MeterBus * _ownBus = nullptr;   // begin() with a line of its own
+  configWriteCb _configWrite;
+  ulong     _requestAt = 0;   // micros() when the request came in
+  ulong     _committedAt = 0; // millis() of the last commit
+  ulong     _updateAt = 0;    // millis(), source time of the update in progress
+  ulong     _staleAfter = 0;
+  uint32_t  _generation = 0;
+  bool      _updating = false;
+
+  cachedFrame _frames[FRAME_CACHE_SIZE] = {};
+
+  // master scan state
+  struct {
+    bool        active = false;
+    bool        failed = false;
+    uint        slaveId = 0;
+    size_t      numBlocks = 0;
+    size_t      numLegacy = 0;
+    size_t      next = 0;
+    size_t      regsRead = 0;
+    scanBlock   blocks[SCAN_MAX_BLOCKS];
+    scanDoneCb  done;
+  } _scan;
+  planConfig    _plan = { MODBUS_MAX_REGS, 9600, 5000 };
+  History *     _history = nullptr;
+  meterMetrics  _stats = {};
+};
@@ -0,0 +1,152 @@
+/**
+ * @file MeterBus.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  One RS485 line and one Modbus layer, shared by the emulated meters on it
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <MeterBase.h>
+
+void MeterBus::begin(RtuTransport * rtu, int16_t en_pin) {
+  _rtu   = rtu;
+  _port  = rtu->stream();
+  _rePin = en_pin;
+  _baud  = 0;
+  _master = false;
+  _numMeters = 0;
+  memset(_byId, NO_METER, sizeof(_byId));
+
+  mb.begin(_port, en_pin);
+  // the raw callback sees the frames of every slave id, we dispatch them ourselves
+  mb.onRaw(
+    [this] (uint8_t * frame, uint8_t len, void * arg) {
+      return this->onFrame(frame, len, arg);
+    }) ;
+}
+
+bool MeterBus::attach(MeterBase & meter) {
+  uint id = meter.slaveId();
+  for (size_t i = 0; i < _numMeters; i++) {
+    if (_meters[i] == &meter) return id == 0 || _byId[id] == i;   // again
+  }
+  if (_numMeters == BUS_MAX_METERS || id > MODBUS_MAX_ID) return false;
+  if (id == 0) {
+    if (_numMeters > 0) return false;
+    _master = true;
+    mb.master();
+  } else {
+    if (_master || _byId[id] != NO_METER) return false;
+    _byId[id] = _numMeters;
+    // the Modbus layer needs an id to be a slave, the first one will do
+    if (_numMeters == 0) mb.slave(id);
+  }
+  _meters[_numMeters++] = &meter;
+  return true;
+}
+
+bool MeterBus::readdress(MeterBase & meter, uint slaveId) {
+  if (_master || slaveId == 0 || slaveId > MODBUS_MAX_ID) return false;
+  if (_byId[slaveId] != NO_METER) return _meters[_byId[slaveId]] == &meter;
+  for (size_t i = 0; i < _numMeters; i++) {
+    if (_meters[i] != &meter) continue;
+    _byId[meter.slaveId()] = NO_METER;
+    _byId[slaveId] = i;
+    if (i == 0) mb.slave(slaveId);
+    return true;
+  }
+  return false;
+}
+
+// the frame timing of the Modbus layer follows the speed
+void MeterBus::setLine(uint32_t baud, rtuFormat format) {
+  if (_rtu == nullptr) return;
+  _rtu->begin(baud, format);
+  mb.setBaudrate(baud);
+  _baud = baud;
+  _format = format;
+  LOG_I("Line %lu baud, format %d\n", (unsigned long) baud, (int) format);
+  for (size_t i = 0; i < _numMeters; i++) _meters[i]->lineChanged(baud, format);
+}
+
+// a complete frame, crc included. It starts after the silence that ends the frame before it:
+// the request has had it when the Modbus layer saw it end, two frames of ours wait for it here
+void MeterBus::send(const uint8_t * frame, size_t len) {
+  if (_rtu != nullptr && !_heard) {
+    ulong gap = _rtu->frameGapUs();
+    while (micros() - _sentAt < gap) yield();
+  }
+  if (_capture != nullptr) _capture->record(CAPTURE_TX, frame, len);
+  if (_profile != nullptr) _profile->onSent(frame, len, micros());
+  if (_rePin >= 0) digitalWrite(_rePin, HIGH);
+  _port->write(frame, len);
+  _port->flush();
+  if (_rePin >= 0) digitalWrite(_rePin, LOW);
+  _sentAt = micros();
+  _heard = false;
+}
+
+uint16_t MeterBus::read(uint8_t fc, uint8_t slaveId, word start, word * dest, word count, cbTransaction cb) {
+  if (!_master || _txPending) return 0;
+  auto done = [this, cb](Modbus::ResultCode event, uint16_t id, void * data) {
+    _txPending = false;
+    return cb ? cb(event, id, data) : true;
+  };
+  _txPending = true;
+  uint16_t id = fc == Modbus::FC_READ_INPUT_REGS ? mb.readIreg(slaveId, start, dest, count, done)
+                                                 : mb.readHreg(slaveId, start, dest, count, done);
+  if (id == 0) _txPending = false;
+  return id;
+}
+
+bool MeterBus::isIdle() {
+  if (_txPending || (_port != nullptr && _port->available() > 0)) return false;
+  return _rtu == nullptr || micros() - _rxAt >= _rtu->frameGapUs();
+}
+
+// serve the line, and drive a master scan. The gap between two calls is what the master
+// sees as the worst response time of every meter on the line
+void MeterBus::task() {
+  ulong now = micros();
+  if (_lastTask != 0) {
+    for (size_t i = 0; i < _numMeters; i++) _meters[i]->_stats.taskGap.record(now - _lastTask);
+  }
+  _lastTask = now;
+  // a frame coming in: the Modbus layer takes it once the line has been silent for a frame gap
+  int avail = _port != nullptr ? _port->available() : 0;
+  if (avail > _rxAvail) _rxAt = now;
+  mb.task();
+  _rxAvail = _port != nullptr ? _port->available() : 0;
+  if (_master) _meters[0]->scanTask();
+  else if (_profile != nullptr && !_listen && isIdle()) prefetchTask();
+}
+
+// the windows of our meters the master is about to poll: their responses are made ready now
+void MeterBus::prefetchTask() {
+  ulong now = micros();
+  for (size_t i = 0; i < _profile->numWindows(); i++) {
+    if (!_profile->due(i, now)) continue;
+    const profileWindow & w = _profile->window(i);
+    MeterBase * m = meter(w.slaveId);
+    if (m == nullptr) continue;
+    long inUs = (long) (w.lastAt + w.intervalUs - now);
+    m->prefetch(w.fc, w.start, w.count, inUs > 0 ? inUs / 1000 : 0);
+    _profile->prepared(i);
+  }
+}
+
+// slave id -> meter, frames for other ids are left to the library, which drops them.
+// Listening, all frames are taken and none is answered
+Modbus::ResultCode MeterBus::onFrame(uint8_t * frame, uint8_t len, void * arg) {
+  Modbus::frame_arg_t * header = (Modbus::frame_arg_t *) arg;
+  uint8_t id = header->slaveId;
+  _heard = true;
+  if (_capture != nullptr) _capture->recordPdu(id, frame, len);
+  if (_master) return Modbus::EX_PASSTHROUGH;
+  if (_profile != nullptr) _profile->onFrame(id, frame, len, micros());
+  if (_listen) return Modbus::EX_SUCCESS;
+  if (id == 0 || id > MODBUS_MAX_ID || _byId[id] == NO_METER) return Modbus::EX_PASSTHROUGH;
+  return _meters[_byId[id]]->onFrame(frame, len);
+}
@@ -0,0 +1,96 @@
+/**
+ * @file MeterBus.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  One RS485 line and one Modbus layer, shared by the emulated meters on it.
+ *         Requests are dispatched on slave id through a table, each meter serves its own image
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <ModbusRTU.h>
+#include <RtuTransport.h>
+#include <Capture.h>
+#include <PollProfile.h>
+
+#define BUS_MAX_METERS  4       // meters on one line
+#define MODBUS_MAX_ID   247     // highest slave id
+#define NO_METER        0xff
+
+class MeterBase;
+
+/**
+ * @brief The line and the Modbus layer, and the slave id -> meter table. A request costs
+ *  one table lookup, whatever the number of meters. All meters on a line share its speed
+ *  and format: a master that changes bAud or Prot of one, changes it for all.
+ *  A line is either served by slaves, or used by a single master.
+ */
+class MeterBus {
+public:
+  void      begin(RtuTransport * rtu, int16_t en_pin);
+  // false if the table is full, the id is taken, or slaves and master are mixed
+  bool      attach(MeterBase & meter);
+  // a meter got another id. False if that one is taken
+  bool      readdress(MeterBase & meter, uint slaveId);
+  // the meter with a slave id, or nullptr. Id 0 is the first meter attached
+  MeterBase * meter(uint slaveId) const {
+    if (slaveId == 0) return _numMeters > 0 ? _meters[0] : nullptr;
+    return slaveId <= MODBUS_MAX_ID && _byId[slaveId] != NO_METER ? _meters[_byId[slaveId]] : nullptr;
+  }
+  size_t    numMeters() const { return _numMeters; }
+  MeterBase * meterAt(size_t i) const { return i < _numMeters ? _meters[i] : nullptr; }
+
+  // (re)open the line, between two frames. The registers of all meters follow
+  void      setLine(uint32_t baud, rtuFormat format);
+  uint32_t  baud() const      { return _baud; }
+  rtuFormat format() const    { return _format; }
+
+  void      send(const uint8_t * frame, size_t len);
+  // master: a read request, busy until its callback has run
+  uint16_t  read(uint8_t fc, uint8_t slaveId, word start, word * dest, word count, cbTransaction cb);
+  void      task();
+  // a request of our master is waiting for its response
+  bool      isBusy() const    { return _txPending; }
+  // no transaction in progress, no request coming in, and the line silent for a frame gap since
+  // the last byte came in: the time to do slow things. Not the Modbus layer's slave(), which is
+  // the id of our meters on a slave line
+  bool      isIdle();
+  ModbusRTU & modbus()        { return mb; }
+  // record the frames on the line, nullptr to stop
+  void      capture(FrameCapture * capture) { _capture = capture; }
+  // learn what the master polls, and prepare the responses of our meters just before it asks.
+  // nullptr to stop
+  void      profile(PollProfile * profile) { _profile = profile; }
+  PollProfile * profile()     { return _profile; }
+  // listen only: the meters do not answer, the frames of all slaves still go to the profile
+  // and the capture. For learning next to a real meter
+  void      listen(bool on)   { _listen = on; }
+  bool      listening() const { return _listen; }
+
+private:
+  Modbus::ResultCode  onFrame(uint8_t * frame, uint8_t len, void * arg);
+  void      prefetchTask();
+
+  ModbusRTU       mb;
+  RtuTransport *  _rtu = nullptr;
+  Stream *        _port = nullptr;
+  int16_t         _rePin = -1;
+  uint32_t        _baud = 0;      // 0: not opened yet
+  rtuFormat       _format = RTU_8N1;
+  bool            _master = false;
+  ulong           _lastTask = 0;  // micros() of the last task()
+  ulong           _sentAt = 0;    // micros() when our last frame was out
+  ulong           _rxAt = 0;      // micros() when task() last saw more bytes come in
+  int             _rxAvail = 0;   // bytes waiting then
+  bool            _txPending = false;
+  bool            _heard = false; // a frame came in since then, the line has been silent
+  FrameCapture *  _capture = nullptr;
+  PollProfile *   _profile = nullptr;
+  bool            _listen = false;
+
+  MeterBase *     _meters[BUS_MAX_METERS] = {};
+  size_t          _numMeters = 0;
+  uint8_t         _byId[MODBUS_MAX_ID + 1];   // slave id -> index in _meters, or NO_METER
+};
@@ -0,0 +1,68 @@
+/**
+ * @file Metrics.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Fixed size counters and log2 histograms, cheap enough for the request path
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+#define HIST_BUCKETS  16    // bucket b > 0 holds [2^(b-1), 2^b), the last one everything above
+#define METRIC_FCS    24    // requests are counted per function code below this, [0] counts the rest
+#define METRIC_APP    8     // values the application fills in: heap, fragmentation ..
+
+// the metrics are readable as holding registers from here, each value as 2 registers, high word first
+#define METRICS_BASE  0xF000
+
+/**
+ * @brief A log2 histogram: recording is a count-leading-zeros and two increments
+ */
+typedef struct histogram {
+  uint32_t  count;
+  uint32_t  max;
+  uint32_t  bucket[HIST_BUCKETS];
+
+  void record(uint32_t value) {
+    size_t b = value == 0 ? 0 : 32 - __builtin_clz(value);
+    bucket[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+    count++;
+    if (value > max) max = value;
+  }
+
+  // upper bound of the bucket that holds the p-th percentile, not above the max
+  uint32_t percentile(uint8_t p) const {
+    uint32_t seen = 0, want = ((uint64_t) count * p + 99) / 100;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+      seen += bucket[b];
+      if (seen >= want && seen > 0) return b == HIST_BUCKETS - 1 ? max : min((uint32_t) ((1UL << b) - 1), max);
+    }
+    return 0;
+  }
+} histogram;
+
+/**
+ * @brief The metrics of a meter. All uint32_t, in this order they are the vendor registers:
+ *  METRICS_BASE + 2 * (index of the value)
+ */
+typedef struct meterMetrics {
+  uint32_t  requests[METRIC_FCS];   // by function code
+  uint32_t  illegalFunction;        // exceptions sent
+  uint32_t  illegalAddress;
+  uint32_t  illegalValue;
+  uint32_t  badFrames;              // a request of the wrong length
+  uint32_t  hits;                   // frame cache
+  uint32_t  misses;
+  uint32_t  responses;
+  histogram latency;                // request to first response byte, us
+  histogram dataAge;                // age of the data at poll time: since the last commit, ms
+  histogram taskGap;                // between two task() calls, us
+  uint32_t  app[METRIC_APP];
+  uint32_t  stale;                  // reads refused, the source went silent
+} meterMetrics;
+
+#define METRIC_WORDS  (sizeof(meterMetrics) / sizeof(uint32_t))
+#define METRIC_REGS   (2 * METRIC_WORDS)
+static_assert(sizeof(meterMetrics) % sizeof(uint32_t) == 0, "metrics must be all uint32_t");
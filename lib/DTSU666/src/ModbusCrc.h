@@ -0,0 +1,56 @@
+/**
+ * @file ModbusCrc.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Modbus RTU CRC16, table driven. The table is generated by the compiler
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+#define MODBUS_CRC_INIT 0xFFFF
+
+struct crcTable {
+  word t[256];
+  constexpr crcTable() : t{} {
+    for (word i = 0; i < 256; i++) {
+      word crc = i;
+      for (int b = 0; b < 8; b++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+      t[i] = crc;
+    }
+  }
+};
+inline constexpr crcTable MODBUS_CRC_TABLE;
+
+// continue a crc over len bytes
+inline word crc16(const uint8_t * data, size_t len, word crc = MODBUS_CRC_INIT) {
+  while (len--) crc = (crc >> 8) ^ MODBUS_CRC_TABLE.t[(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+// append the crc to a frame of len bytes, low byte first. Returns the new length
+inline size_t appendCrc(uint8_t * frame, size_t len) {
+  word crc = crc16(frame, len);
+  frame[len++] = crc & 0xff;
+  frame[len++] = crc >> 8;
+  return len;
+}
+
+/**
+ * @brief update the crc of a frame after some bytes were changed, without running over the
+ *        whole frame again. The crc is linear: crc(a) ^ crc(b) == crc0(a ^ b), crc0 being
+ *        a crc with init 0, for which leading zero bytes can be skipped.
+ *
+ * @param crc       the crc of the frame before the change
+ * @param delta     old bytes XOR new bytes
+ * @param len       # changed bytes
+ * @param trailing  # bytes in the frame after the changed bytes, crc excluded
+ * @return word     the crc of the changed frame
+ */
+inline word crc16Patch(word crc, const uint8_t * delta, size_t len, size_t trailing) {
+  word d = crc16(delta, len, 0);
+  while (trailing--) d = (d >> 8) ^ MODBUS_CRC_TABLE.t[d & 0xff];
+  return crc ^ d;
+}
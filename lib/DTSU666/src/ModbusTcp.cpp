@@ -0,0 +1,153 @@
+/**
+ * @file ModbusTcp.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Modbus TCP access to the meters of a bus: the same registers the RS485 master reads
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <ModbusTcp.h>
+
+#define EX_GATEWAY_TARGET   0x0B    // no meter with the unit id
+
+void ModbusTcpServer::begin(MeterBus & bus) {
+  _bus = &bus;
+  _server.begin();
+  _server.setNoDelay(true);
+}
+
+size_t ModbusTcpServer::numClients() {
+  size_t n = 0;
+  for (auto & c : _conns) n += (bool) c.client;
+  return n;
+}
+
+void ModbusTcpServer::close(tcpConn & c) {
+  c.client.stop();
+  c.client = WiFiClient();
+  c.len = 0;
+}
+
+// a new client in a free slot, or it is refused
+void ModbusTcpServer::accept() {
+  WiFiClient client = _server.accept();
+  for (auto & c : _conns) {
+    if (c.client) continue;
+    c.client = client;
+    c.client.setNoDelay(true);
+    c.len = 0;
+    c.lastActive = millis();
+    _stats.accepted++;
+    LOG_D("Modbus TCP client accepted\n");
+    return;
+  }
+  _stats.refused++;
+  client.stop();
+}
+
+void ModbusTcpServer::sendException(tcpConn & c, uint8_t fc, uint8_t code) {
+  uint8_t response[MBAP_SIZE + 2];
+  memcpy(response, c.adu, 4);
+  response[4] = 0;
+  response[5] = 3;
+  response[6] = c.adu[6];
+  response[7] = fc | 0x80;
+  response[8] = code;
+  c.client.write(response, sizeof(response));
+  _stats.exceptions++;
+}
+
+/**
+ * @brief read what a client sent, and serve one complete request. The header, then the data
+ *        from the image of the meter, no copy. A response that does not fit in the send buffer
+ *        waits in the receive buffer until it does
+ * @return true if a request was served
+ */
+bool ModbusTcpServer::poll(tcpConn & c) {
+  int n = c.client.available();
+  if (n > 0 && c.len < sizeof(c.adu)) {
+    n = c.client.read(c.adu + c.len, min((size_t) n, sizeof(c.adu) - c.len));
+    if (n > 0) {
+      c.len += n;
+      c.lastActive = millis();
+    }
+  }
+  if (c.len < MBAP_SIZE) return false;
+
+  word protocol = (c.adu[2] << 8) | c.adu[3];
+  word length   = (c.adu[4] << 8) | c.adu[5];
+  if (protocol != 0 || length < 2 || (size_t) (MBAP_SIZE - 1 + length) > sizeof(c.adu)) {
+    LOG_W("Modbus TCP: bad header, client closed\n");
+    _stats.closed++;
+    close(c);
+    return false;
+  }
+  size_t size = MBAP_SIZE - 1 + length;
+  if (c.len < size) return false;
+
+  // the fields of a read are only decoded once it is one, anything else gets an exception
+  const uint8_t * pdu = c.adu + MBAP_SIZE;
+  uint8_t fc = pdu[0];
+  uint8_t unit = c.adu[6];
+  MeterBase * meter = _bus->meter(unit == 0xff ? 0 : unit);
+  bool isRead = (fc == Modbus::FC_READ_REGS || fc == Modbus::FC_READ_INPUT_REGS) && length == 6;
+  word startAddress = 0, numRegs = 0;
+  if (meter != nullptr && isRead) {
+    startAddress = (pdu[1] << 8) | pdu[2];
+    numRegs      = (pdu[3] << 8) | pdu[4];
+  }
+  if (c.client.availableForWrite() < (int) (MBAP_SIZE + 2 + min(numRegs, (word) MODBUS_MAX_REGS) * 2)) return false;
+
+  _stats.requests++;
+  if (meter == nullptr) {
+    sendException(c, fc, EX_GATEWAY_TARGET);
+  } else if (!isRead) {
+    sendException(c, fc, Modbus::EX_ILLEGAL_FUNCTION);
+  } else {
+    uint8_t scratch[MODBUS_MAX_REGS * 2];
+    const uint8_t * data;
+    Modbus::ResultCode result = meter->readView(fc, startAddress, numRegs, data, scratch);
+    if (result != Modbus::EX_SUCCESS) {
+      sendException(c, fc, result);
+    } else {
+      uint8_t header[MBAP_SIZE + 2];
+      memcpy(header, c.adu, 4);
+      header[4] = 0;
+      header[5] = 3 + numRegs * 2;
+      header[6] = unit;
+      header[7] = fc;
+      header[8] = numRegs * 2;
+      c.client.write(header, sizeof(header));
+      c.client.write(data, numRegs * 2);
+    }
+  }
+  // the next request may already be in
+  memmove(c.adu, c.adu + size, c.len - size);
+  c.len -= size;
+  return true;
+}
+
+// one step: a new client, or one request
+void ModbusTcpServer::task() {
+  if (_bus == nullptr) return;
+  if (_server.hasClient()) {
+    accept();
+    return;
+  }
+  ulong now = millis();
+  for (size_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    tcpConn & c = _conns[(_next + i) % TCP_MAX_CLIENTS];
+    if (!c.client) continue;
+    if (!c.client.connected() || now - c.lastActive > TCP_IDLE_TIMEOUT) {
+      if (c.client.connected()) _stats.closed++;
+      close(c);
+      continue;
+    }
+    if (poll(c)) {
+      _next = (_next + i + 1) % TCP_MAX_CLIENTS;
+      return;
+    }
+  }
+}
@@ -0,0 +1,63 @@
+/**
+ * @file ModbusTcp.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Modbus TCP access to the meters of a bus: the same registers the RS485 master reads
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <WiFiServer.h>
+#include <WiFiClient.h>
+#include <MeterBase.h>
+
+#define MODBUS_TCP_PORT     502
+#define TCP_MAX_CLIENTS     2
+#define TCP_IDLE_TIMEOUT    60000   // ms, a client that sends nothing for this long is closed
+#define MBAP_SIZE           7       // transaction, protocol, length, unit
+#define TCP_MAX_ADU         (MBAP_SIZE + 253)
+
+typedef struct tcpStats {
+  uint32_t  accepted;
+  uint32_t  refused;    // no free slot
+  uint32_t  closed;     // by us: idle, or a bad header
+  uint32_t  requests;
+  uint32_t  exceptions;
+} tcpStats;
+
+/**
+ * @brief A Modbus TCP server for monitoring: reads only, of the meter with the unit id, 0xff or 0
+ *  for the first meter on the bus. Sockets are non blocking and task() does one bounded step:
+ *  accept a client, or serve one request. Call it when the bus is idle, so it never delays the
+ *  RTU master. The data of a response is written straight from the register image.
+ */
+class ModbusTcpServer {
+public:
+  ModbusTcpServer(uint16_t port = MODBUS_TCP_PORT) : _server(port) {}
+  void    begin(MeterBus & bus);
+  void    task();
+  size_t  numClients();
+  const tcpStats & stats() { return _stats; }
+  WiFiServer & server() { return _server; }
+
+protected:
+  typedef struct tcpConn {
+    WiFiClient  client;
+    uint8_t     adu[TCP_MAX_ADU];
+    size_t      len;
+    ulong       lastActive;
+  } tcpConn;
+
+  void    accept();
+  bool    poll(tcpConn & c);
+  void    close(tcpConn & c);
+  void    sendException(tcpConn & c, uint8_t fc, uint8_t code);
+
+  WiFiServer  _server;
+  MeterBus *  _bus = nullptr;
+  tcpConn     _conns[TCP_MAX_CLIENTS] = {};
+  size_t      _next = 0;      // round robin
+  tcpStats    _stats = {};
+};
@@ -0,0 +1,123 @@
+/**
+ * @file PollProfile.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  What the master on the line polls, learned from the frames on the line
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <ModbusRTU.h>
+#include <PollProfile.h>
+
+// running means, over about 8 values
+static uint32_t runningMean(uint32_t mean, uint32_t value) {
+  return mean + ((int32_t) (value - mean)) / 8;
+}
+
+static bool isRead(uint8_t fc) {
+  return fc == Modbus::FC_READ_REGS || fc == Modbus::FC_READ_INPUT_REGS;
+}
+
+void PollProfile::clear() {
+  memset(_windows, 0, sizeof(_windows));
+  _numWindows = 0;
+  _pending = -1;
+  _frames = _unmatched = _other = 0;
+}
+
+// the window, or a new one in place of the least recently polled
+profileWindow * PollProfile::find(uint8_t slaveId, uint8_t fc, word start, word count) {
+  profileWindow * oldest = &_windows[0];
+  for (size_t i = 0; i < _numWindows; i++) {
+    profileWindow & w = _windows[i];
+    if (w.slaveId == slaveId && w.fc == fc && w.start == start && w.count == count) return &w;
+    if ((long) (w.lastAt - oldest->lastAt) < 0) oldest = &w;
+  }
+  profileWindow * w = _numWindows < PROFILE_WINDOWS ? &_windows[_numWindows++] : oldest;
+  if (w - _windows == _pending) _pending = -1;
+  *w = {};
+  w->slaveId = slaveId;
+  w->fc = fc;
+  w->start = start;
+  w->count = count;
+  return w;
+}
+
+void PollProfile::request(uint8_t slaveId, const uint8_t * pdu, ulong us) {
+  if (_pending >= 0) _windows[_pending].unanswered++;
+  profileWindow * w = find(slaveId, pdu[0], (pdu[1] << 8) | pdu[2], (pdu[3] << 8) | pdu[4]);
+  if (w->polls > 0) {
+    uint32_t interval = us - w->lastAt;
+    if (w->polls == 1) {
+      w->intervalUs = interval;
+    } else {
+      uint32_t deviation = interval > w->intervalUs ? interval - w->intervalUs : w->intervalUs - interval;
+      w->jitterUs = runningMean(w->jitterUs, deviation);
+      w->intervalUs = runningMean(w->intervalUs, interval);
+    }
+  }
+  if (w->prepared) w->ready++;
+  w->prepared = false;
+  w->lastAt = us;
+  w->polls++;
+  _pending = w - _windows;
+}
+
+void PollProfile::reply(uint8_t slaveId, const uint8_t * pdu, uint8_t len, ulong us) {
+  profileWindow * w = _pending >= 0 ? &_windows[_pending] : nullptr;
+  bool exception = (pdu[0] & 0x80) && len == 2;
+  if (w == nullptr || w->slaveId != slaveId || w->fc != (pdu[0] & 0x7f) || (!exception && pdu[1] != w->count * 2)) {
+    _unmatched++;
+    return;
+  }
+  _pending = -1;
+  w->replyUs = w->replies == 0 ? us - w->lastAt : runningMean(w->replyUs, us - w->lastAt);
+  w->replies++;
+  if (exception) w->exceptions++;
+}
+
+void PollProfile::onFrame(uint8_t slaveId, const uint8_t * pdu, uint8_t len, ulong us) {
+  _frames++;
+  if (len < 2 || slaveId == 0 || !isRead(pdu[0] & 0x7f)) {
+    _other++;
+    return;
+  }
+  if (len == 5 && !(pdu[0] & 0x80)) request(slaveId, pdu, us);
+  else if ((pdu[0] & 0x80) ? len == 2 : len == 2 + pdu[1]) reply(slaveId, pdu, len, us);
+  else _unmatched++;
+}
+
+void PollProfile::onSent(const uint8_t * frame, size_t len, ulong us) {
+  if (len >= 4) onFrame(frame[0], frame + 1, len - 3, us);
+}
+
+bool PollProfile::due(size_t i, ulong us) const {
+  const profileWindow & w = _windows[i];
+  if (w.prepared || w.polls < PROFILE_MIN_POLLS) return false;
+  ulong lead = PROFILE_LEAD_US + 2 * w.jitterUs;
+  return us - w.lastAt + lead >= w.intervalUs;
+}
+
+size_t PollProfile::json(char * buf, size_t len, size_t first, size_t count) const {
+  if (len < 3) {
+    if (len > 0) buf[0] = 0;
+    return 0;
+  }
+  size_t n = snprintf(buf, len, "[");
+  // a window goes in whole or not at all, room is kept for the "]"
+  for (size_t i = first; i < _numWindows && i < first + count; i++) {
+    const profileWindow & w = _windows[i];
+    int m = snprintf(buf + n, len - n - 1, "%s{\"id\":%u,\"fc\":%u,\"start\":%u,\"count\":%u,\"polls\":%u,\"intervalUs\":%u,"
+      "\"jitterUs\":%u,\"replyUs\":%u,\"replies\":%u,\"exceptions\":%u,\"unanswered\":%u,\"prefetches\":%u,\"ready\":%u}",
+      n > 1 ? "," : "", w.slaveId, w.fc, w.start, w.count, (unsigned) w.polls, (unsigned) w.intervalUs,
+      (unsigned) w.jitterUs, (unsigned) w.replyUs, (unsigned) w.replies, (unsigned) w.exceptions,
+      (unsigned) w.unanswered, (unsigned) w.prefetches, (unsigned) w.ready);
+    if (m < 0 || (size_t) m >= len - n - 1) break;
+    n += m;
+  }
+  buf[n++] = ']';
+  buf[n] = 0;
+  return n;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file PollProfile.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  What the master on the line polls: per slave id and window, how often, how regular,
+ *         and how fast the answers come. Learned from the frames on the line
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+#define PROFILE_WINDOWS   16        // windows learned, the least recently polled one makes room
+#define PROFILE_MIN_POLLS 3         // before the interval is trusted
+#define PROFILE_LEAD_US   20000UL   // a response is prepared this long before the expected poll, plus 2x the jitter
+
+typedef struct profileWindow {
+  uint8_t   slaveId;      // 0: free
+  uint8_t   fc;
+  bool      prepared;     // since the last poll
+  word      start;
+  word      count;
+  uint32_t  polls;
+  uint32_t  replies;      // seen on the line, ours included
+  uint32_t  exceptions;
+  uint32_t  unanswered;   // the next request came first
+  ulong     lastAt;       // micros() of the last poll
+  uint32_t  intervalUs;   // between two polls, a running mean
+  uint32_t  jitterUs;     // mean deviation from the interval
+  uint32_t  replyUs;      // request to reply, a running mean
+  uint32_t  prefetches;   // responses prepared
+  uint32_t  ready;        // polls that found theirs prepared
+} profileWindow;
+
+/**
+ * @brief The poll profile of a line. Every frame with a good crc goes through onFrame(), the
+ *  replies of the other slaves too: a read request has 5 bytes of PDU, a reply to it an even
+ *  number, an exception 2. A reply belongs to the request before it when the slave id and
+ *  function match. O(windows) per frame, no allocation
+ */
+class PollProfile {
+public:
+  // a frame on the line: its PDU, the slave id and crc stripped. us: micros() when it was complete
+  void      onFrame(uint8_t slaveId, const uint8_t * pdu, uint8_t len, ulong us);
+  // a frame we sent, crc included
+  void      onSent(const uint8_t * frame, size_t len, ulong us);
+  size_t    numWindows() const  { return _numWindows; }
+  const profileWindow & window(size_t i) const { return _windows[i]; }
+  // the response for window i should be prepared by now, and was not since its last poll
+  bool      due(size_t i, ulong us) const;
+  void      prepared(size_t i)  { _windows[i].prepared = true; _windows[i].prefetches++; }
+  uint32_t  frames() const      { return _frames; }
+  uint32_t  unmatched() const   { return _unmatched; }   // replies without their request
+  uint32_t  other() const       { return _other; }       // frames of other functions
+  // windows first .. first + count - 1 as a JSON array, about 230 characters each. The windows
+  // that do not fit whole are left out. Returns the # of characters, up to len - 1
+  size_t    json(char * buf, size_t len, size_t first = 0, size_t count = PROFILE_WINDOWS) const;
+  void      clear();
+
+protected:
+  profileWindow * find(uint8_t slaveId, uint8_t fc, word start, word count);
+  void      request(uint8_t slaveId, const uint8_t * pdu, ulong us);
+  void      reply(uint8_t slaveId, const uint8_t * pdu, uint8_t len, ulong us);
+
+  profileWindow _windows[PROFILE_WINDOWS] = {};
+  size_t    _numWindows = 0;
+  int       _pending = -1;      // the window of the request waiting for its reply
+  uint32_t  _frames = 0;
+  uint32_t  _unmatched = 0;
+  uint32_t  _other = 0;
+};
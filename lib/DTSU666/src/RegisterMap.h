@@ -0,0 +1,193 @@
+/**
+ * @file RegisterMap.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Compile time register map: register definitions, sections and O(1) address lookup
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+// Register definitions
+//
+// value is also the size in registers. A REG_FLOAT is put on the wire as the profile of the meter says
+enum regType : uint32_t {  REG_WORD = 1,  REG_FLOAT = 2 } ;
+
+#define REG_CODE_LEN  8     // code and name, terminating 0 included
+#define REG_NAME_LEN  40
+
+/**
+ * @brief A register table is PROGMEM: on the ESP8266 it is read in place from flash, which only
+ *  takes aligned 32 bit loads. So every field is 4 bytes wide (a word or a pointer to a string
+ *  in RAM was what crashed before), the lookups read address, type and scale directly, and the
+ *  code and name are stored in the entry and only read with memcpy_P(), by printRegs().
+ */
+typedef struct registerDef {
+  uint32_t  address;
+  regType   type;
+  float     defval;
+  float     scale;      // register units per physical unit (W, V, A, Hz, kWh), see setValue()
+  char      code[REG_CODE_LEN];
+  char      name[REG_NAME_LEN];
+
+  template <size_t C, size_t N>
+  constexpr registerDef(uint32_t address, regType type, const char (&code)[C], const char (&name)[N],
+                        float defval, float scale = 1)
+    : address(address), type(type), defval(defval), scale(scale), code{}, name{} {
+    static_assert(C <= REG_CODE_LEN && N <= REG_NAME_LEN, "register code or name too long");
+    for (size_t i = 0; i < C; i++) this->code[i] = code[i];
+    for (size_t i = 0; i < N; i++) this->name[i] = name[i];
+  }
+} registerDef;
+static_assert(sizeof(registerDef) % 4 == 0 && alignof(registerDef) == 4, "flash is read 32 bits at a time");
+
+#define NO_REG  0xffff  // a profile without this register
+
+// A register computed from others, only when a read covers it. The formula gets the values of
+// the inputs in physical units, in order, and returns the value in physical units
+#define DERIVED_MAX_INPUTS  7
+#define DERIVED_MAX         32    // per profile, a bit each
+typedef float (*deriveFn)(const float * in);
+typedef struct derivedDef {
+  word      address;
+  deriveFn  formula;
+  uint8_t   numInputs;
+  word      inputs[DERIVED_MAX_INPUTS];
+} derivedDef;
+
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
+
+// A section is a run of registers within one 4K address page (0x0000, 0x1000, 0x2000 ..)
+// span is the number of words from the first to the last register, holes included
+typedef struct regSection {
+  word    start;
+  word    span;
+  word    offset;   // offset of the section in the flat word space of the map
+} regSection;
+
+#define NUM_PAGES   16      // address >> 12
+#define NO_SECTION  (-1)
+
+// table must be sorted on address, no duplicates or overlapping registers
+template <size_t N>
+constexpr bool regsOrdered(const registerDef (&regs)[N]) {
+  for (size_t i = 1; i < N; i++) {
+    if (regs[i].address < regs[i-1].address + regs[i-1].type) return false;
+  }
+  return true;
+}
+
+template <size_t N>
+constexpr size_t regsSections(const registerDef (&regs)[N]) {
+  size_t n = N > 0 ? 1 : 0;
+  for (size_t i = 1; i < N; i++) {
+    if ((regs[i].address >> 12) != (regs[i-1].address >> 12)) n++;
+  }
+  return n;
+}
+
+// total number of words covered by all sections
+template <size_t N>
+constexpr size_t regsSpan(const registerDef (&regs)[N]) {
+  size_t span = 0;
+  word   start = N > 0 ? regs[0].address : 0;
+  for (size_t i = 0; i < N; i++) {
+    if (i + 1 == N || (regs[i+1].address >> 12) != (regs[i].address >> 12)) {
+      span += regs[i].address + regs[i].type - start;
+      if (i + 1 < N) start = regs[i+1].address;
+    }
+  }
+  return span;
+}
+
+/**
+ * @brief The register map, built entirely at compile time from a sorted register table.
+ *  address -> section is a page lookup, section -> register a slot table lookup, so
+ *  every lookup is O(1) whatever the size of the table.
+ *
+ * @tparam NREGS      number of registers in the table
+ * @tparam NSECTIONS  number of sections, use regsSections()
+ * @tparam SPAN       number of words covered, use regsSpan()
+ */
+template <size_t NREGS, size_t NSECTIONS, size_t SPAN>
+struct registerMap {
+  const registerDef * regs;
+  regSection  sections[NSECTIONS];
+  int8_t      sectionOf[NUM_PAGES];   // page -> section, or NO_SECTION
+  uint8_t     slot[SPAN];             // word -> covering register, or for holes the next register
+
+  static_assert(NREGS < 0xff, "register map supports up to 254 registers");
+  static_assert(NSECTIONS <= NUM_PAGES, "at most one section per 4K page");
+
+  constexpr registerMap(const registerDef (&table)[NREGS]) : regs(table), sections{}, sectionOf{}, slot{} {
+    for (size_t p = 0; p < NUM_PAGES; p++) sectionOf[p] = NO_SECTION;
+
+    size_t s = 0, offset = 0;
+    for (size_t i = 0; i < NREGS; i++) {
+      if (i == 0 || (table[i].address >> 12) != (table[i-1].address >> 12)) {
+        if (i > 0) s++;
+        sections[s].start = table[i].address;
+        sections[s].offset = offset;
+        sectionOf[table[i].address >> 12] = s;
+      }
+      // fill the hole before this register, and the register itself
+      word end = table[i].address + table[i].type - sections[s].start;
+      for (word w = offset - sections[s].offset; w < end; w++) {
+        slot[sections[s].offset + w] = i;
+      }
+      offset = sections[s].offset + end;
+      sections[s].span = end;
+    }
+  }
+
+  static constexpr size_t size()      { return NREGS; }
+  static constexpr size_t span()      { return SPAN; }
+  static constexpr size_t numSections() { return NSECTIONS; }
+
+  // the section in the page of address, or nullptr
+  constexpr const regSection * page(word address) const {
+    int8_t s = sectionOf[address >> 12];
+    return s == NO_SECTION ? nullptr : &sections[s];
+  }
+
+  // the section containing address, or nullptr
+  constexpr const regSection * section(word address) const {
+    const regSection * sec = page(address);
+    if (sec == nullptr || address < sec->start || address >= sec->start + sec->span) return nullptr;
+    return sec;
+  }
+
+  // index of the register that starts at address, or -1
+  constexpr int index(word address) const {
+    const regSection * sec = section(address);
+    if (sec == nullptr) return -1;
+    uint8_t i = slot[sec->offset + address - sec->start];
+    return regs[i].address == address ? i : -1;
+  }
+
+  // index of the first register at or after address, NREGS if none
+  constexpr size_t lowerBound(word address) const {
+    const regSection * sec = section(address);
+    if (sec != nullptr) {
+      uint8_t i = slot[sec->offset + address - sec->start];
+      return regs[i].address < address ? i + 1 : i;
+    }
+    // not inside a section: the first section that starts after address
+    for (size_t s = 0; s < NSECTIONS; s++) {
+      if (sections[s].start > address) return slot[sections[s].offset];
+    }
+    return NREGS;
+  }
+
+  // offset of address in the flat word space, or -1 when not covered by a section
+  constexpr int offset(word address) const {
+    const regSection * sec = section(address);
+    return sec == nullptr ? -1 : sec->offset + address - sec->start;
+  }
+};
+
+// Instantiate a map from a table, with all compile time checks
+#define REGISTER_MAP(table) \
+  registerMap<ARRAY_SIZE(table), regsSections(table), regsSpan(table)>(table)
@@ -0,0 +1,103 @@
+/**
+ * @file Relay.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  A real meter mirrored by an emulated one: one meter reads the real one as a master,
+ *         another serves the data on a line of its own, and only what changed goes across
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <Meter.h>
+
+#define RELAY_DATA_MS     1000UL      // the measurements are read this often
+#define RELAY_CONFIG_MS   300000UL    // the configuration registers (below configEnd), this often
+
+typedef struct relayStats {
+  uint32_t  scans;          // complete and applied
+  uint32_t  configScans;    // of those, with the configuration registers
+  uint32_t  failed;
+  uint32_t  wordsCopied;    // to the downstream meter
+  uint32_t  wireBytes;      // on the upstream line, requests and responses of the complete scans
+  uint32_t  fullBytes;      // the same if every scan had read all registers
+} relayStats;
+
+/**
+ * @brief The relay. task() starts a scan of the upstream meter when one is due, the
+ *  configuration registers are read only every configMs. When a scan is complete,
+ *  upstream.copyTo(downstream) takes the registers that changed over, as one update. The
+ *  upstream meter is a master (slave id 0) on the line of the real meter, the downstream meter a
+ *  slave on the line of the battery; each line needs its task() called
+ */
+template <class Profile>
+class Relay {
+public:
+  Relay(Meter<Profile> & upstream, Meter<Profile> & downstream) : _up(upstream), _down(downstream) {}
+
+  // the real meter has slaveId on the line of upstream. The first scan reads all registers
+  void    begin(uint slaveId, ulong dataMs = RELAY_DATA_MS, ulong configMs = RELAY_CONFIG_MS, ulong now = millis()) {
+    _slaveId = slaveId;
+    _dataMs = dataMs;
+    _configMs = configMs;
+    _stats = {};
+    _fullScanBytes = 0;
+    _since = _scanAt = now;
+    _configDue = true;
+    _started = false;
+  }
+
+  void    task(ulong now = millis()) {
+    if (_up.isScanning() || (_started && now - _scanAt < _dataMs)) return;
+    bool config = _configDue || now - _configAt >= _configMs;
+    if (!_up.readMeterData(_slaveId, config, [this, config](bool ok, size_t) { scanned(ok, config); })) return;
+    _started = true;
+    _scanAt = now;
+    if (config) {
+      _configAt = now;
+      _configDue = false;
+    }
+  }
+
+  const relayStats & stats() const { return _stats; }
+  // since begin()
+  uint32_t wirePerMinute(ulong now = millis()) const { return perMinute(_stats.wireBytes, now); }
+  uint32_t fullPerMinute(ulong now = millis()) const { return perMinute(_stats.fullBytes, now); }
+
+protected:
+  void    scanned(bool ok, bool config) {
+    if (!ok) {
+      _stats.failed++;
+      if (config) _configDue = true;   // again with the next scan
+      return;
+    }
+    size_t bytes = _up.scanBytes();
+    if (config) {
+      _fullScanBytes = bytes;
+      _stats.configScans++;
+    }
+    _stats.scans++;
+    _stats.wireBytes += bytes;
+    _stats.fullBytes += _fullScanBytes;
+    _stats.wordsCopied += _up.copyTo(_down);
+  }
+
+  uint32_t perMinute(uint32_t bytes, ulong now) const {
+    ulong elapsed = now - _since;
+    return elapsed > 0 ? (uint64_t) bytes * 60000 / elapsed : 0;
+  }
+
+  Meter<Profile> & _up;
+  Meter<Profile> & _down;
+  uint      _slaveId = 0;
+  ulong     _dataMs = RELAY_DATA_MS;
+  ulong     _configMs = RELAY_CONFIG_MS;
+  ulong     _since = 0;
+  ulong     _scanAt = 0;
+  ulong     _configAt = 0;
+  bool      _configDue = true;
+  bool      _started = false;
+  size_t    _fullScanBytes = 0;   // of the last scan with the configuration
+  relayStats _stats = {};
+};
@@ -0,0 +1,85 @@
+/**
+ * @file RtuTransport.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  The serial line under the Modbus RTU layer: SoftwareSerial or a hardware UART,
+ *         (re)configured at runtime from the bAud and Prot registers
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <SoftwareSerial.h>
+
+// the character format, the values are those of the Prot register
+enum rtuFormat { RTU_8N2 = 0, RTU_8E1 = 1, RTU_8O1 = 2, RTU_8N1 = 3, NUM_RTU_FORMATS };
+
+/**
+ * @brief A serial line for Modbus RTU. begin() may be called again while running, to change
+ *  speed or format between two frames.
+ */
+class RtuTransport {
+public:
+  virtual ~RtuTransport() {}
+  virtual Stream * stream() = 0;
+  virtual bool  begin(uint32_t baud, rtuFormat format = RTU_8N1) = 0;
+
+  uint32_t  baud() const      { return _baud; }
+  rtuFormat format() const    { return _format; }
+  // the silence that ends a frame: 3.5 characters of 11 bits, fixed above 19200 baud
+  ulong     frameGapUs() const { return _baud > 19200 ? 1750 : 38500000UL / _baud; }
+
+protected:
+  uint32_t  _baud = 9600;
+  rtuFormat _format = RTU_8N1;
+};
+
+// bit banged. Receive runs from pin interrupts and can lose bytes when WiFi keeps them off
+class SoftwareRtu : public RtuTransport {
+public:
+  SoftwareRtu(SoftwareSerial & port) : _port(port) {}
+  Stream * stream() override { return &_port; }
+
+  bool begin(uint32_t baud, rtuFormat format = RTU_8N1) override {
+    static const decltype(SWSERIAL_8N1) configs[NUM_RTU_FORMATS] = { SWSERIAL_8N2, SWSERIAL_8E1, SWSERIAL_8O1, SWSERIAL_8N1 };
+    if (format >= NUM_RTU_FORMATS || baud == 0) return false;
+    _baud = baud;
+    _format = format;
+    _port.end();
+    _port.begin(baud, configs[format]);
+    return true;
+  }
+
+private:
+  SoftwareSerial & _port;
+};
+
+#ifdef ARDUINO_ARCH_ESP8266
+/**
+ * @brief UART0 with its pins swapped to GPIO13 (RX, D7) and GPIO15 (TX, D8), so USB stays
+ *  off the bus. The UART receives from its fifo interrupt into a ring buffer, the ESP8266 has
+ *  no DMA for it. Serial output (the log) goes to Serial1 (TX only, D4) then.
+ */
+class UartRtu : public RtuTransport {
+public:
+  UartRtu(HardwareSerial & uart, bool swap = true, size_t rxBuffer = 512) : _uart(uart), _swap(swap), _rxBuffer(rxBuffer) {}
+  Stream * stream() override { return &_uart; }
+
+  bool begin(uint32_t baud, rtuFormat format = RTU_8N1) override {
+    static const SerialConfig configs[NUM_RTU_FORMATS] = { SERIAL_8N2, SERIAL_8E1, SERIAL_8O1, SERIAL_8N1 };
+    if (format >= NUM_RTU_FORMATS || baud == 0) return false;
+    _baud = baud;
+    _format = format;
+    _uart.setRxBufferSize(_rxBuffer);
+    _uart.begin(baud, configs[format]);
+    if (_swap) _uart.pins(15, 13);
+    return true;
+  }
+
+private:
+  HardwareSerial & _uart;
+  bool    _swap;
+  size_t  _rxBuffer;
+};
+#endif
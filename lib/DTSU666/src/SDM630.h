@@ -0,0 +1,66 @@
+/**
+ * @file SDM630.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Profile of the Eastron SDM630, three phase. The measurements are input registers,
+ *         floats in V, A, W, Hz and kWh. Its configuration (holding registers) is not emulated,
+ *         the line is set by the application
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <Meter.h>
+
+inline constexpr registerDef SDM630Regs[] PROGMEM = {
+{ 0x0000,REG_FLOAT,"V1",  "Phase 1 line to neutral volts",0 } ,
+{ 0x0002,REG_FLOAT,"V2",  "Phase 2 line to neutral volts",0 } ,
+{ 0x0004,REG_FLOAT,"V3",  "Phase 3 line to neutral volts",0 } ,
+{ 0x0006,REG_FLOAT,"I1",  "Phase 1 current",0 } ,
+{ 0x0008,REG_FLOAT,"I2",  "Phase 2 current",0 } ,
+{ 0x000A,REG_FLOAT,"I3",  "Phase 3 current",0 } ,
+{ 0x000C,REG_FLOAT,"P1",  "Phase 1 power",0 } ,
+{ 0x000E,REG_FLOAT,"P2",  "Phase 2 power",0 } ,
+{ 0x0010,REG_FLOAT,"P3",  "Phase 3 power",0 } ,
+{ 0x0012,REG_FLOAT,"S1",  "Phase 1 volt amps",0 } ,
+{ 0x0014,REG_FLOAT,"S2",  "Phase 2 volt amps",0 } ,
+{ 0x0016,REG_FLOAT,"S3",  "Phase 3 volt amps",0 } ,
+{ 0x0018,REG_FLOAT,"Q1",  "Phase 1 volt amps reactive",0 } ,
+{ 0x001A,REG_FLOAT,"Q2",  "Phase 2 volt amps reactive",0 } ,
+{ 0x001C,REG_FLOAT,"Q3",  "Phase 3 volt amps reactive",0 } ,
+{ 0x001E,REG_FLOAT,"PF1", "Phase 1 power factor",0 } ,
+{ 0x0020,REG_FLOAT,"PF2", "Phase 2 power factor",0 } ,
+{ 0x0022,REG_FLOAT,"PF3", "Phase 3 power factor",0 } ,
+{ 0x002A,REG_FLOAT,"Vavg","Average line to neutral volts",0 } ,
+{ 0x0030,REG_FLOAT,"Isum","Sum of line currents",0 } ,
+{ 0x0034,REG_FLOAT,"Pt",  "Total system power",0 } ,
+{ 0x0038,REG_FLOAT,"St",  "Total system volt amps",0 } ,
+{ 0x003C,REG_FLOAT,"Qt",  "Total system volt amps reactive",0 } ,
+{ 0x003E,REG_FLOAT,"PFt", "Total system power factor",0 } ,
+{ 0x0046,REG_FLOAT,"Freq","Frequency of supply voltages",50 } ,
+{ 0x0048,REG_FLOAT,"ImpEp", "Import active energy",0 } ,
+{ 0x004A,REG_FLOAT,"ExpEp", "Export active energy",0 } ,
+{ 0x00C8,REG_FLOAT,"V12", "Line 1 to line 2 volts",0 } ,
+{ 0x00CA,REG_FLOAT,"V23", "Line 2 to line 3 volts",0 } ,
+{ 0x00CC,REG_FLOAT,"V31", "Line 3 to line 1 volts",0 } ,
+{ 0x0156,REG_FLOAT,"Ep",  "Total active energy",0 }
+};
+static_assert(regsOrdered(SDM630Regs), "SDM630Regs must be sorted, without duplicate or overlapping addresses");
+
+inline constexpr auto SDM630Map = REGISTER_MAP(SDM630Regs);
+
+// input registers, floats high word first
+struct SDM630Profile {
+  static constexpr auto &     map = SDM630Map;
+  typedef floatHighFirst      encoding;
+  static constexpr uint8_t    readFc = Modbus::FC_READ_INPUT_REGS;
+  static constexpr word       configEnd = 0;
+  static constexpr word       regProt = NO_REG, regBaud = NO_REG, regAddr = NO_REG;
+  static constexpr const uint32_t * bauds = nullptr;
+  static constexpr size_t     numBauds = 0;
+  static constexpr const derivedDef * derived = nullptr;
+  static constexpr size_t     numDerived = 0;
+};
+
+typedef Meter<SDM630Profile> SDM630;
@@ -0,0 +1,79 @@
+/**
+ * @file Arduino.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-in for the ESP8266 Arduino core
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+
+HardwareSerial Serial;
+
+static const auto bootTime = std::chrono::steady_clock::now();
+static std::vector<std::function<void()>> yieldTasks;
+static uint8_t pins[64];
+
+size_t Print::printf(const char * format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0) return 0;
+  return write((const uint8_t *) buf, min((size_t) len, sizeof(buf) - 1));
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (_charUs > 0) {
+    double now = micros();
+    if (_drainedAt < now) _drainedAt = now;
+    while (_drainedAt - micros() > (UART_TX_FIFO - 1) * _charUs) {}
+    _drainedAt += _charUs;
+  }
+  return _muted || fputc(c, stdout) != EOF ? 1 : 0;
+}
+
+int HardwareSerial::availableForWrite() {
+  if (_charUs == 0) return UART_TX_FIFO;
+  double backlog = (_drainedAt - micros()) / _charUs;
+  return backlog <= 0 ? UART_TX_FIFO : UART_TX_FIFO - (int) (backlog + 0.999);
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+// no sleeping on the host, but let the simulated peers run
+void delay(unsigned long) {
+  yield();
+}
+
+void yield() {
+  for (auto & task : yieldTasks) task();
+}
+
+void hostOnYield(std::function<void()> task) {
+  yieldTasks.push_back(task);
+}
+
+void hostClearYield() {
+  yieldTasks.clear();
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < sizeof(pins)) pins[pin] = value;
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < sizeof(pins) ? pins[pin] : LOW;
+}
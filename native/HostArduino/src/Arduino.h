@@ -0,0 +1,101 @@
+/**
+ * @file Arduino.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-in for the parts of the ESP8266 Arduino core that the emulator uses
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+
+typedef uint16_t      word;
+typedef uint8_t       byte;
+typedef unsigned int  uint;
+typedef unsigned long ulong;
+
+using std::min;
+using std::max;
+
+#define F(s)    (s)
+// flash is ordinary memory on the host
+#define PROGMEM
+#define memcpy_P(dest, src, len)  memcpy(dest, src, len)
+#define HIGH    1
+#define LOW     0
+#define INPUT   0
+#define OUTPUT  1
+#define INPUT_PULLUP  2
+#define LED_BUILTIN   2
+
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t * buffer, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+  }
+  size_t printf(const char * format, ...) __attribute__ ((format (printf, 2, 3)));
+  size_t print(const char * s)    { return write((const uint8_t *) s, strlen(s)); }
+  size_t print(long v)            { return printf("%ld", v); }
+  size_t println(const char * s = "") { return print(s) + print("\n"); }
+  size_t println(long v)          { return print(v) + print("\n"); }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
+
+// Serial goes to stdout, unless muted (host only) to keep benchmark output readable.
+// After begin() a write takes the time of the UART: once the 128 byte tx fifo is full, write() waits
+// for the line like it does on the ESP8266. Muted or not.
+#define UART_TX_FIFO  128
+
+class HardwareSerial : public Stream {
+public:
+  void    begin(unsigned long baud) { _charUs = baud ? 10e6 / baud : 0; }
+  void    mute(bool muted) { _muted = muted; }
+  size_t  write(uint8_t c) override;
+  using   Print::write;
+  int     availableForWrite();
+  int     available() override { return 0; }
+  int     read() override { return -1; }
+  int     peek() override { return -1; }
+  void    flush() override { fflush(stdout); }
+private:
+  bool    _muted = false;
+  double  _charUs = 0;      // 0: no line timing
+  double  _drainedAt = 0;   // micros() when the fifo is empty
+};
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void  delay(unsigned long ms);
+void  yield();
+void  pinMode(uint8_t pin, uint8_t mode);
+void  digitalWrite(uint8_t pin, uint8_t value);
+int   digitalRead(uint8_t pin);
+
+// Host only: functions run from yield() and delay(), this is how a simulated peer
+// (e.g. a slave on the other end of a SimBus) gets time while the code under test busy-waits
+void  hostOnYield(std::function<void()> task);
+void  hostClearYield();
@@ -0,0 +1,115 @@
+/**
+ * @file ModbusRTU.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-in for the modbus-esp8266 RTU API
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <ModbusRTU.h>
+
+static uint16_t crc16(const uint8_t * data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  while (len--) {
+    crc ^= *data++;
+    for (int b = 0; b < 8; b++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+  return crc;
+}
+
+bool ModbusRTU::begin(Stream * port, int16_t txEnablePin, bool) {
+  _port = static_cast<SimSerial *>(port);
+  _txEnablePin = txEnablePin;
+  if (_txEnablePin >= 0) {
+    pinMode(_txEnablePin, OUTPUT);
+    digitalWrite(_txEnablePin, LOW);
+  }
+  return true;
+}
+
+void ModbusRTU::send(uint8_t * frame, size_t len) {
+  uint16_t crc = crc16(frame, len);
+  frame[len++] = crc & 0xff;
+  frame[len++] = crc >> 8;
+  if (_txEnablePin >= 0) digitalWrite(_txEnablePin, HIGH);
+  _port->write(frame, len);
+  _port->flush();
+  if (_txEnablePin >= 0) digitalWrite(_txEnablePin, LOW);
+}
+
+uint16_t ModbusRTU::readHreg(uint8_t slaveId, uint16_t offset, uint16_t * value, uint16_t numregs, cbTransaction cb) {
+  return read(FC_READ_REGS, slaveId, offset, value, numregs, cb);
+}
+
+uint16_t ModbusRTU::readIreg(uint8_t slaveId, uint16_t offset, uint16_t * value, uint16_t numregs, cbTransaction cb) {
+  return read(FC_READ_INPUT_REGS, slaveId, offset, value, numregs, cb);
+}
+
+uint16_t ModbusRTU::read(uint8_t fc, uint8_t slaveId, uint16_t offset, uint16_t * value, uint16_t numregs, cbTransaction cb) {
+  if (_port == nullptr || !_master || _slaveId != 0 || numregs == 0 || numregs > 125) return 0;
+  uint8_t frame[8] = { slaveId, fc, (uint8_t) (offset >> 8), (uint8_t) offset,
+                       (uint8_t) (numregs >> 8), (uint8_t) numregs };
+  _txFc    = fc;
+  _slaveId = slaveId;
+  _txCount = numregs;
+  _txDest  = value;
+  _txCb    = cb;
+  _txStart = millis();
+  send(frame, 6);
+  if (++_txId == 0) _txId = 1;
+  return _txId;
+}
+
+void ModbusRTU::endTransaction(ResultCode result) {
+  cbTransaction cb = _txCb;
+  _slaveId = 0;
+  _txCb = nullptr;
+  if (cb) cb(result, _txId, nullptr);
+}
+
+void ModbusRTU::task() {
+  if (_port == nullptr) return;
+
+  size_t len = _port->frameAvailable();
+  if (len == 0) {
+    if (_master && _slaveId != 0 && millis() - _txStart > MODBUSRTU_TIMEOUT) endTransaction(EX_TIMEOUT);
+    return;
+  }
+
+  uint8_t frame[256];
+  for (size_t i = 0; i < len; i++) {
+    int c = _port->read();
+    if (i < sizeof(frame)) frame[i] = c;
+  }
+  // too short, too long or a bad crc: dropped, like the real library does
+  if (len < 4 || len > sizeof(frame) || crc16(frame, len) != 0) return;
+
+  uint8_t address = frame[0];
+  uint8_t * pdu = frame + 1;
+  uint8_t pduLen = len - 3;
+
+  if (_cbRaw) {
+    frame_arg_t header(address, !_master);
+    if (_cbRaw(pdu, pduLen, &header) != EX_PASSTHROUGH) return;
+  }
+
+  if (_master) {
+    // the response to our request?
+    if (_slaveId == 0 || address != _slaveId) return;
+    if (pdu[0] == (_txFc | 0x80)) {
+      endTransaction((ResultCode) pdu[1]);
+    } else if (pdu[0] != _txFc || pdu[1] != _txCount * 2 || pduLen != 2 + _txCount * 2) {
+      endTransaction(EX_UNEXPECTED_RESPONSE);
+    } else {
+      for (uint16_t r = 0; r < _txCount; r++) _txDest[r] = (pdu[2 + r*2] << 8) | pdu[3 + r*2];
+      endTransaction(EX_SUCCESS);
+    }
+    return;
+  }
+
+  // slave: the stand-in has no register containers of its own
+  if (_slaveId == 0 || address != _slaveId) return;
+  uint8_t response[5] = { _slaveId, (uint8_t) (pdu[0] | 0x80), EX_ILLEGAL_FUNCTION };
+  send(response, 3);
+}
@@ -0,0 +1,91 @@
+/**
+ * @file ModbusRTU.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-in for the modbus-esp8266 RTU API, the subset the emulator uses.
+ *         Frames are taken from a SimBus, so no inter-frame timing is needed.
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <SimSerial.h>
+
+#define MODBUSRTU_TIMEOUT 1000
+
+class Modbus {
+public:
+  enum FunctionCode {
+    FC_READ_COILS       = 0x01,
+    FC_READ_INPUT_STAT  = 0x02,
+    FC_READ_REGS        = 0x03,
+    FC_READ_INPUT_REGS  = 0x04,
+    FC_WRITE_COIL       = 0x05,
+    FC_WRITE_REG        = 0x06,
+    FC_WRITE_COILS      = 0x0F,
+    FC_WRITE_REGS       = 0x10,
+  };
+  enum ResultCode {
+    EX_SUCCESS              = 0x00,
+    EX_ILLEGAL_FUNCTION     = 0x01,
+    EX_ILLEGAL_ADDRESS      = 0x02,
+    EX_ILLEGAL_VALUE        = 0x03,
+    EX_SLAVE_FAILURE        = 0x04,
+    EX_ACKNOWLEDGE          = 0x05,
+    EX_SLAVE_DEVICE_BUSY    = 0x06,
+    EX_GENERAL_FAILURE      = 0xE1,
+    EX_DATA_MISMACH         = 0xE2,
+    EX_UNEXPECTED_RESPONSE  = 0xE3,
+    EX_TIMEOUT              = 0xE4,
+    EX_CONNECTION_LOST      = 0xE5,
+    EX_CANCEL               = 0xE6,
+    EX_PASSTHROUGH          = 0xE7,
+  };
+  struct frame_arg_t {
+    bool    to_server;
+    uint8_t slaveId;
+    frame_arg_t(uint8_t s, bool m = false) : to_server(m), slaveId(s) {}
+  };
+};
+
+typedef std::function<bool(Modbus::ResultCode, uint16_t, void *)> cbTransaction;
+typedef std::function<Modbus::ResultCode(uint8_t *, uint8_t, void *)> cbRaw;
+
+class ModbusRTU : public Modbus {
+public:
+  // the host has only SimSerial lines
+  bool      begin(Stream * port, int16_t txEnablePin = -1, bool direct = true);
+  void      setBaudrate(uint32_t baud) { _baud = baud; }
+  void      task();
+
+  void      master()            { _master = true; _slaveId = 0; }
+  void      slave(uint8_t id)   { _slaveId = id; }
+  // like the library: the id we serve as a slave, as a master the id of the slave of the
+  // active transaction, 0 if none
+  uint8_t   slave()             { return _slaveId; }
+
+  bool      onRaw(cbRaw cb)     { _cbRaw = cb; return true; }
+  uint16_t  readHreg(uint8_t slaveId, uint16_t offset, uint16_t * value, uint16_t numregs = 1, cbTransaction cb = nullptr);
+  uint16_t  readIreg(uint8_t slaveId, uint16_t offset, uint16_t * value, uint16_t numregs = 1, cbTransaction cb = nullptr);
+
+private:
+  void      send(uint8_t * frame, size_t len);
+  uint16_t  read(uint8_t fc, uint8_t slaveId, uint16_t offset, uint16_t * value, uint16_t numregs, cbTransaction cb);
+  void      endTransaction(ResultCode result);
+
+  SimSerial *   _port = nullptr;
+  uint32_t      _baud = 9600;   // frames come from the SimBus, no timing derived from it
+  int16_t       _txEnablePin = -1;
+  uint8_t       _slaveId = 0;
+  bool          _master = false;
+  cbRaw         _cbRaw;
+
+  // master side, one transaction at a time like the real library, to _slaveId
+  uint8_t       _txFc = FC_READ_REGS;
+  uint16_t      _txCount = 0;
+  uint16_t *    _txDest = nullptr;
+  uint16_t      _txId = 0;
+  ulong         _txStart = 0;
+  cbTransaction _txCb;
+};
@@ -0,0 +1,69 @@
+/**
+ * @file SimSerial.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  A simulated RS485 bus for host builds
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <SimSerial.h>
+
+void SimBus::detach(SimSerial * node) {
+  _nodes.erase(std::remove(_nodes.begin(), _nodes.end(), node), _nodes.end());
+}
+
+void SimBus::transmit(SimSerial * from, const uint8_t * data, size_t len) {
+  bytes += len;
+  for (auto node : _nodes) {
+    if (node == from) continue;
+    if (node->baud() == from->baud() && node->format() == from->format()) {
+      node->receive(data, len);
+    } else {
+      // framing errors: what arrives has little to do with what was sent
+      for (size_t i = 0; i < len; i++) {
+        uint8_t garbage = data[i] ^ 0x5A;
+        node->receive(&garbage, 1);
+      }
+    }
+  }
+}
+
+void SimBus::endFrame(SimSerial * from) {
+  frames++;
+  for (auto node : _nodes) {
+    if (node != from) node->receiveEnd();
+  }
+}
+
+size_t SimSerial::write(const uint8_t * buffer, size_t size) {
+  if (_bus) _bus->transmit(this, buffer, size);
+  return size;
+}
+
+void SimSerial::flush() {
+  if (_bus) _bus->endFrame(this);
+}
+
+int SimSerial::read() {
+  if (_rx.empty()) return -1;
+  uint8_t c = _rx.front();
+  _rx.pop_front();
+  // keep the frame administration in step with bytes read one by one
+  if (!_frames.empty()) {
+    if (--_frames.front() == 0) _frames.pop_front();
+  } else if (_pending > 0) {
+    _pending--;
+  }
+  return c;
+}
+
+void SimSerial::receive(const uint8_t * data, size_t len) {
+  _rx.insert(_rx.end(), data, data + len);
+  _pending += len;
+}
+
+void SimSerial::receiveEnd() {
+  if (_pending > 0) _frames.push_back(_pending);
+  _pending = 0;
+}
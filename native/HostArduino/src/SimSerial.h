@@ -0,0 +1,69 @@
+/**
+ * @file SimSerial.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  A simulated RS485 bus for host builds. Every node sees what the others write,
+ *         like on a real two wire bus. A flush() ends a frame, which stands in for the
+ *         3.5 character silence that delimits RTU frames on the line. A node with another
+ *         speed or character format than the sender receives garbage, as on a real line.
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <deque>
+#include <vector>
+
+class SimSerial;
+
+class SimBus {
+public:
+  void      attach(SimSerial * node)  { _nodes.push_back(node); }
+  void      detach(SimSerial * node);
+  // bytes from one node, delivered to all others
+  void      transmit(SimSerial * from, const uint8_t * data, size_t len);
+  void      endFrame(SimSerial * from);
+
+  uint32_t  bytes  = 0;   // line statistics
+  uint32_t  frames = 0;
+
+private:
+  std::vector<SimSerial *> _nodes;
+};
+
+class SimSerial : public Stream {
+public:
+  SimSerial() {}
+  SimSerial(SimBus & bus) { attach(bus); }
+  virtual ~SimSerial() { if (_bus) _bus->detach(this); }
+
+  void      attach(SimBus & bus)  { _bus = &bus; bus.attach(this); }
+  void      begin(uint32_t baud, uint8_t format = 0)  { _baud = baud; _format = format; }
+  uint32_t  baud()                { return _baud; }
+  uint8_t   format()              { return _format; }
+
+  size_t    write(uint8_t c) override { return write(&c, 1); }
+  size_t    write(const uint8_t * buffer, size_t size) override;
+  int       available() override  { return _rx.size(); }
+  int       read() override;
+  int       peek() override       { return _rx.empty() ? -1 : _rx.front(); }
+  void      flush() override;
+
+  // length of the next complete frame in the receive buffer, 0 if none
+  size_t    frameAvailable()      { return _frames.empty() ? 0 : _frames.front(); }
+  // time the line needs for len bytes, start and stop bit included
+  ulong     wireMicros(size_t len) { return len * 10 * 1000000UL / _baud; }
+
+  // called by the bus
+  void      receive(const uint8_t * data, size_t len);
+  void      receiveEnd();
+
+private:
+  SimBus *            _bus = nullptr;
+  uint32_t            _baud = 9600;
+  uint8_t             _format = 0;
+  std::deque<uint8_t> _rx;
+  std::deque<size_t>  _frames;    // lengths of complete frames in _rx
+  size_t              _pending = 0;  // bytes of the frame being received
+};
@@ -0,0 +1,23 @@
+/**
+ * @file SoftwareSerial.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-in for EspSoftwareSerial: a node on a simulated RS485 bus
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <SimSerial.h>
+
+enum SoftwareSerialConfig { SWSERIAL_8N1 = 0, SWSERIAL_8E1, SWSERIAL_8O1, SWSERIAL_8N2 };
+
+class SoftwareSerial : public SimSerial {
+public:
+  SoftwareSerial() {}
+  SoftwareSerial(int8_t, int8_t) {}
+  SoftwareSerial(SimBus & bus) : SimSerial(bus) {}
+  void begin(uint32_t baud, SoftwareSerialConfig config = SWSERIAL_8N1) { SimSerial::begin(baud, config); }
+  void end() {}
+};
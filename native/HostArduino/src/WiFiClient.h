@@ -0,0 +1,43 @@
+/**
+ * @file WiFiClient.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-in for the ESP8266 WiFiClient: a TCP connection on a non blocking socket.
+ *         Copies share the connection, like on the ESP8266
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <memory>
+
+#define HOST_TCP_SNDBUF   4096    // availableForWrite() of a connection
+
+class WiFiClient : public Stream {
+public:
+  WiFiClient() {}
+  WiFiClient(int fd);
+
+  uint8_t   connected();
+  explicit operator bool() { return _sock != nullptr && _sock->fd >= 0; }
+  void      stop();
+  void      setNoDelay(bool nodelay);
+  void      setTimeout(unsigned long) {}   // never blocks
+
+  size_t    write(uint8_t c) override { return write(&c, 1); }
+  size_t    write(const uint8_t * buffer, size_t size) override;
+  int       availableForWrite();
+  int       available() override;
+  int       read() override;
+  int       read(uint8_t * buffer, size_t size);
+  int       peek() override;
+  void      flush() override {}
+
+private:
+  struct socket {
+    int fd = -1;
+    ~socket();
+  };
+  std::shared_ptr<socket> _sock;
+};
@@ -0,0 +1,127 @@
+/**
+ * @file WiFiServer.cpp
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-ins for the ESP8266 WiFiServer and WiFiClient, on POSIX sockets
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <WiFiServer.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+static void nonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+WiFiClient::socket::~socket() {
+  if (fd >= 0) ::close(fd);
+}
+
+WiFiClient::WiFiClient(int fd) : _sock(std::make_shared<socket>()) {
+  _sock->fd = fd;
+  nonBlocking(fd);
+  int size = HOST_TCP_SNDBUF;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+void WiFiClient::stop() {
+  if (!_sock || _sock->fd < 0) return;
+  ::close(_sock->fd);
+  _sock->fd = -1;
+}
+
+void WiFiClient::setNoDelay(bool nodelay) {
+  int on = nodelay;
+  if (*this) setsockopt(_sock->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// open, or closed by the peer with data still to read
+uint8_t WiFiClient::connected() {
+  if (!*this) return 0;
+  if (available() > 0) return 1;
+  uint8_t b;
+  ssize_t n = recv(_sock->fd, &b, 1, MSG_PEEK);
+  return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+size_t WiFiClient::write(const uint8_t * buffer, size_t size) {
+  if (!*this) return 0;
+  ssize_t n = send(_sock->fd, buffer, size, MSG_NOSIGNAL);
+  return n < 0 ? 0 : n;
+}
+
+// what the socket takes without blocking
+int WiFiClient::availableForWrite() {
+  if (!*this) return 0;
+  int queued = 0;
+  ioctl(_sock->fd, TIOCOUTQ, &queued);
+  return max(0, HOST_TCP_SNDBUF - queued);
+}
+
+int WiFiClient::available() {
+  if (!*this) return 0;
+  int n = 0;
+  ioctl(_sock->fd, FIONREAD, &n);
+  return n;
+}
+
+int WiFiClient::read(uint8_t * buffer, size_t size) {
+  if (!*this) return -1;
+  ssize_t n = recv(_sock->fd, buffer, size, 0);
+  return n < 0 ? -1 : n;
+}
+
+int WiFiClient::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int WiFiClient::peek() {
+  uint8_t b;
+  if (!*this) return -1;
+  return recv(_sock->fd, &b, 1, MSG_PEEK) == 1 ? b : -1;
+}
+
+void WiFiServer::begin() {
+  _fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(_port);
+  if (bind(_fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(_fd, 4) < 0) {
+    close();
+    return;
+  }
+  socklen_t len = sizeof(addr);
+  getsockname(_fd, (sockaddr *) &addr, &len);
+  _port = ntohs(addr.sin_port);
+  nonBlocking(_fd);
+}
+
+bool WiFiServer::hasClient() {
+  if (_pending < 0 && _fd >= 0) _pending = ::accept(_fd, nullptr, nullptr);
+  return _pending >= 0;
+}
+
+WiFiClient WiFiServer::accept() {
+  if (!hasClient()) return WiFiClient();
+  WiFiClient client(_pending);
+  _pending = -1;
+  client.setNoDelay(_noDelay);
+  return client;
+}
+
+void WiFiServer::close() {
+  if (_pending >= 0) ::close(_pending);
+  if (_fd >= 0) ::close(_fd);
+  _pending = _fd = -1;
+}
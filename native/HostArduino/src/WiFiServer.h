@@ -0,0 +1,34 @@
+/**
+ * @file WiFiServer.h
+ * @author Michiel STeltman (git: michielfromNL, msteltman@disway.nl
+ * @brief  Host stand-in for the ESP8266 WiFiServer: a listening TCP socket on the loopback,
+ *         non blocking, so a test can connect to it with a plain socket
+ * @version 0.1
+ * @date 2024-06-17
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+class WiFiServer {
+public:
+  // port 0: any free port, see port()
+  WiFiServer(uint16_t port) : _port(port) {}
+  ~WiFiServer() { close(); }
+  void        begin();
+  bool        hasClient();
+  WiFiClient  accept();
+  void        setNoDelay(bool nodelay) { _noDelay = nodelay; }
+  void        close();
+  void        stop() { close(); }
+  uint8_t     status() { return _fd >= 0 ? 1 : 0; }   // LISTEN or CLOSED
+  uint16_t    port() const { return _port; }
+
+private:
+  uint16_t    _port;
+  int         _fd = -1;
+  int         _pending = -1;
+  bool        _noDelay = false;
+};
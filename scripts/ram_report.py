@@ -0,0 +1,90 @@
+# RAM budget report, run by PlatformIO after the firmware is linked (extra_scripts in platformio.ini)
+#
+# The ESP8266 has ~80 KB of data RAM for .data, .rodata and .bss together, what is left is the heap:
+# wifi, TLS and the MQTT buffer (PV_MAX_PAYLOAD) come from there, and for the time of a reload of the
+# ingest mapping its scratch IngestMap (~1.2 KB, see HEAP_TRANSIENT). Every symbol in data RAM is put in
+# a subsystem, by name or by the source file it comes from, and the totals are checked against the
+# budgets below: a build that goes over fails, so a footprint regression shows up in the commit that
+# made it. Raise a budget on purpose, in the same commit, when the growth is wanted.
+
+Import("env")
+
+import re
+import subprocess
+
+DRAM_START = 0x3FFE8000
+DRAM_END   = 0x40000000
+
+# name, symbols, source files, budget in bytes (None: reported only). First match wins
+SUBSYSTEMS = [
+    ("meters",      r"^(PV|Meter2|bus)$|DTSU666|DDSU666|SDM630|registerMap|derivedDeps",
+                    r"lib/DTSU666/src/(Meter|RegisterMap|Estimator|DTSU666|DDSU666|SDM630)", 6144),
+    ("ingest",      r"^pv(Energy)?Map$|pvingest|IngestMap|jsonscan",
+                    r"src/(pvingest|ingestmap|jsonscan)", 3840),
+    ("capture",     r"^capture$|FrameCapture",          r"lib/DTSU666/src/Capture", 2304),
+    ("history",     r"^history$|History",               r"lib/DTSU666/src/History", 4096),
+    ("profile",     r"^profile$|PollProfile",           r"lib/DTSU666/src/PollProfile", 1280),
+    ("log",         None,                               r"lib/DTSU666/src/Log", 1280),
+    ("energy",      r"^energy",                         r"lib/DTSU666/src/Energy", 512),
+    ("modbus tcp",  r"^tcp$|ModbusTcp",                 r"lib/DTSU666/src/ModbusTcp", 1024),
+    ("modbus rtu",  r"^(rtu|S1)$|ModbusRTU|SoftwareSerial", r"modbus-esp8266|SoftwareSerial", 1024),
+    ("mqtt",        r"^(mqtt|wificlient)$|PubSubClient", r"PubSubClient", 512),
+    ("wifi portal", r"^(wm|custom_)|WiFiManager",       r"WiFiManager", 2048),
+    ("application", None,                               r"src/main\.cpp", 2048),
+    ("core and sdk", None, None, None),
+]
+
+
+# heap a subsystem takes for a short while, on top of its static data: its peak is checked against
+# the budget, static data and this together
+HEAP_TRANSIENT = {
+    "ingest":   1200,   # IngestMap::compile(), the scratch map
+}
+
+
+def classify(name, source):
+    for subsystem, symbols, sources, _ in SUBSYSTEMS:
+        if symbols and re.search(symbols, name):
+            return subsystem
+        if sources and source and re.search(sources, source.replace("\\", "/")):
+            return subsystem
+    return SUBSYSTEMS[-1][0]
+
+
+def ram_report(source, target, env):
+    elf = str(target[0])
+    nm = env.subst("$CC").replace("gcc", "nm")
+    out = subprocess.run([nm, "-S", "-C", "-l", elf], capture_output=True, text=True).stdout
+
+    totals = {s[0]: 0 for s in SUBSYSTEMS}
+    largest = {s[0]: ("", 0) for s in SUBSYSTEMS}
+    for line in out.splitlines():
+        symbol, _, where = line.partition("\t")
+        # address size type name, undefined symbols have no address and size
+        fields = re.match(r"([0-9a-fA-F]+) ([0-9a-fA-F]+) \S (.*)", symbol)
+        if not fields:
+            continue
+        address, size, name = int(fields[1], 16), int(fields[2], 16), fields[3]
+        if not DRAM_START <= address < DRAM_END:
+            continue
+        subsystem = classify(name, where)
+        totals[subsystem] += size
+        if size > largest[subsystem][1]:
+            largest[subsystem] = (name, size)
+
+    over = []
+    print("RAM budget, static data (.data .rodata .bss)")
+    for subsystem, _, _, budget in SUBSYSTEMS:
+        name, size = largest[subsystem]
+        limit = "%6d" % budget if budget else "     -"
+        transient = "   + %d heap while busy" % HEAP_TRANSIENT[subsystem] if subsystem in HEAP_TRANSIENT else ""
+        print("  %-14s %6d / %s   largest: %s (%d)%s" % (subsystem, totals[subsystem], limit, name, size, transient))
+        if budget and totals[subsystem] + HEAP_TRANSIENT.get(subsystem, 0) > budget:
+            over.append(subsystem)
+    print("  %-14s %6d of %d" % ("total", sum(totals.values()), DRAM_END - DRAM_START))
+    if over:
+        print("RAM budget exceeded: " + ", ".join(over))
+        env.Exit(1)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", ram_report)
@@ -0,0 +1,190 @@
+/**
+ * @file    ingestmap.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl 
+ * @brief   The JSON key to register mapping of the ingest, compiled at runtime from a text
+ * @version 1.0
+ * @date    2024-06-30
+ * 
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <memory>
+#include <new>
+#include "ingestmap.h"
+
+static inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// [b,e) without leading and trailing blanks
+static void trim(const char * & b, const char * & e) {
+  while (b < e && isBlank(*b)) b++;
+  while (e > b && isBlank(e[-1])) e--;
+}
+
+// a key, stored once in the text, the slot is the order of appearance
+int IngestMap::addKey(const char * key, size_t len) {
+  uint32_t hash = fnv1a(key, len);
+  for (size_t i=0; i< _numKeys; i++) {
+    if (_keys[i].hash == hash && strncmp(_keys[i].key, key, len) == 0 && _keys[i].key[len] == 0) return _keys[i].slot;
+  }
+  if (_numKeys == INGEST_MAX_KEYS || _textUsed + len + 1 > sizeof(_text)) return -1;
+
+  char * k = &_text[_textUsed];
+  memcpy(k, key, len);
+  k[len] = 0;
+  _textUsed += len + 1;
+
+  // insert sorted on hash
+  size_t i = _numKeys++;
+  for (; i > 0 && _keys[i-1].hash > hash; i--) _keys[i] = _keys[i-1];
+  _keys[i] = { hash, (uint8_t) (_numKeys - 1), k };
+  return _keys[i].slot;
+}
+
+// the text into this map, which is empty
+bool IngestMap::parse(const char * text, const MeterBase * meter) {
+
+  for (const char * line = text; *line; ) {
+    const char * end = line + strcspn(line, ";\n");
+    const char * next = *end ? end + 1 : end;
+    const char * hash = (const char *) memchr(line, '#', end - line);
+    if (hash) end = hash;
+    trim(line, end);
+    if (line == end) { line = next; continue; }
+
+    // the fields
+    const char * field[5][2];   // one spare, for the slave id
+    size_t n = 0;
+    for (const char * f = line; f <= end && n < 4; n++) {
+      const char * fe = (const char *) memchr(f, ',', end - f);
+      if (fe == nullptr) fe = end;
+      field[n][0] = f; field[n][1] = fe;
+      trim(field[n][0], field[n][1]);
+      f = fe + 1;
+    }
+    if (n < 3 || memchr(field[n-1][1], ',', end - field[n-1][1])) {
+      LOG_W("Ingest map: %.*s: need key, scale, [offset,] register\n", (int) (end - line), line);
+      return false;
+    }
+
+    char num[16];
+    auto number = [&](size_t i, bool integer, float & f, ulong & u) {
+      size_t len = field[i][1] - field[i][0];
+      if (len == 0 || len >= sizeof(num)) return false;
+      memcpy(num, field[i][0], len);
+      num[len] = 0;
+      char * e;
+      if (integer) u = strtoul(num, &e, 0); else f = strtof(num, &e);
+      return *e == 0;
+    };
+
+    ingestTarget t = {};
+    ulong address = 0, slave = 0;
+    float dummy;
+    t.offset = 0;
+    // [slave:]register
+    const char * colon = (const char *) memchr(field[n-1][0], ':', field[n-1][1] - field[n-1][0]);
+    if (colon) {
+      field[n][0] = field[n-1][0]; field[n][1] = colon;
+      field[n-1][0] = colon + 1;
+      trim(field[n][0], field[n][1]);
+      trim(field[n-1][0], field[n-1][1]);
+    }
+    if (!number(1, false, t.scale, address) || (n == 4 && !number(2, false, t.offset, address))
+      || !number(n-1, true, dummy, address) || address > 0xffff
+      || (meter ? !meter->isRegister(address) : DTSU666Map.index(address) < 0)
+      || (colon && (!number(n, true, dummy, slave) || slave == 0 || slave > MODBUS_MAX_ID))) {
+      LOG_W("Ingest map: %.*s: bad scale, offset or register\n", (int) (end - line), line);
+      return false;
+    }
+    t.slave = slave;
+    t.address = address;
+
+    // the key, or the keys to sum
+    for (const char * k = field[0][0]; ; k++) {
+      const char * ke = (const char *) memchr(k, '+', field[0][1] - k);
+      if (ke == nullptr) ke = field[0][1];
+      const char * kb = k;
+      k = ke;
+      trim(kb, ke);
+      int slot = kb < ke && t.terms < INGEST_MAX_TERMS ? addKey(kb, ke - kb) : -1;
+      if (slot < 0) {
+        LOG_W("Ingest map: %.*s: bad key, or too many\n", (int) (end - line), line);
+        return false;
+      }
+      t.term[t.terms++] = slot;
+      if (k == field[0][1]) break;
+    }
+    if (t.terms == 0 || _numTargets == INGEST_MAX_TARGETS) {
+      LOG_W("Ingest map: %.*s: no key, or too many registers\n", (int) (end - line), line);
+      return false;
+    }
+    _targets[_numTargets++] = t;
+    line = next;
+  }
+  return true;
+}
+
+bool IngestMap::compile(const char * text, const MeterBase * meter) {
+
+  // built in a scratch map on the heap, for the time of the compile only, so an error leaves
+  // this one as it was
+  std::unique_ptr<IngestMap> scratch(new (std::nothrow) IngestMap());
+  if (!scratch) {
+    LOG_W("Ingest map: no memory to compile\n");
+    return false;
+  }
+  if (!scratch->parse(text, meter)) return false;
+
+  // the key pointers point into the text, so they move along
+  memcpy(_text, scratch->_text, scratch->_textUsed);
+  for (size_t i=0; i< scratch->_numKeys; i++) {
+    _keys[i] = scratch->_keys[i];
+    _keys[i].key = _text + (scratch->_keys[i].key - scratch->_text);
+  }
+  memcpy(_targets, scratch->_targets, scratch->_numTargets * sizeof(ingestTarget));
+  _numKeys = scratch->_numKeys;
+  _numTargets = scratch->_numTargets;
+  _textUsed = scratch->_textUsed;
+  return true;
+}
+
+
+int IngestMap::find(uint32_t hash, const char * key, size_t len) const {
+  size_t lo = 0, hi = _numKeys;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (_keys[mid].hash < hash) lo = mid + 1; else hi = mid;
+  }
+  // equal hashes are adjacent
+  for (; lo < _numKeys && _keys[lo].hash == hash; lo++) {
+    if (strncmp(_keys[lo].key, key, len) == 0 && _keys[lo].key[len] == 0) return _keys[lo].slot;
+  }
+  return -1;
+}
+
+float IngestMap::value(size_t i, const float * values) const {
+  const ingestTarget & t = _targets[i];
+  float sum = 0;
+  for (uint8_t k=0; k< t.terms; k++) sum += values[t.term[k]];
+  return sum * t.scale + t.offset;
+}
+
+bool IngestMap::writes(word address, uint8_t slave) const {
+  for (size_t i=0; i< _numTargets; i++) {
+    if (_targets[i].address == address && _targets[i].slave == slave) return true;
+  }
+  return false;
+}
+
+void IngestMap::print(Print & out) const {
+  for (size_t i=0; i< _numTargets; i++) {
+    const ingestTarget & t = _targets[i];
+    if (t.slave) out.printf("%u:", t.slave);
+    out.printf("0x%04X = (", t.address);
+    for (uint8_t k=0; k< t.terms; k++) {
+      for (size_t j=0; j< _numKeys; j++) {
+        if (_keys[j].slot == t.term[k]) out.printf("%s%s", k ? " + " : "", _keys[j].key);
+      }
+    }
+    out.printf(") * %g + %g\n", t.scale, t.offset);
+  }
+}
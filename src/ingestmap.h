@@ -0,0 +1,81 @@
+/**
+ * @file    ingestmap.h
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl 
+ * @brief   The JSON key to register mapping of the ingest, compiled at runtime from a text
+ * @version 1.0
+ * @date    2024-06-30
+ * 
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <DTSU666.h>
+#include "jsonscan.h"
+
+#define INGEST_MAX_TEXT     512   // bytes of key names
+#define INGEST_MAX_KEYS     24    // distinct source keys
+#define INGEST_MAX_TARGETS  24    // registers written
+#define INGEST_MAX_TERMS    3     // source keys summed into one register
+
+// a source key, the table is sorted on hash
+typedef struct ingestKey {
+  uint32_t      hash;     // fnv1a(key)
+  uint8_t       slot;     // where its value goes
+  const char *  key;      // in the text of the map
+} ingestKey;
+
+// a register: scale * (sum of the values of its terms) + offset
+typedef struct ingestTarget {
+  uint8_t   slave;      // the meter with this id on the line, 0: the meter ingested into
+  word      address;
+  float     scale;
+  float     offset;
+  uint8_t   terms;
+  uint8_t   term[INGEST_MAX_TERMS];   // slots
+} ingestTarget;
+
+/**
+ * @brief The mapping from JSON keys to registers. Written as text, one entry per line or
+ *  separated by ';', fields separated by ',' and '#' starts a comment:
+ *
+ *    key, scale, [offset,] register
+ *
+ *  e.g. "GridFrequency, 100, 0x2044". A derived register sums source keys:
+ *  "L1Power+L2Power+L3Power, 10, 0x2012" gives Pt when the source has no total.
+ *  With more meters on the line, "2:0x2012" is register 0x2012 of the meter with slave id 2.
+ *  compile() turns the text into a table sorted on key hash, so matching a key costs a
+ *  binary search on an integer, whatever the mapping.
+ */
+class IngestMap {
+public:
+  // false, and the map unchanged, if the text has an error. The registers must exist in the
+  // meter, a DTSU666 if none is given
+  bool    compile(const char * text, const MeterBase * meter = nullptr);
+
+  // the value slot of a key, or -1
+  int     find(uint32_t hash, const char * key, size_t len) const;
+
+  size_t  numKeys() const     { return _numKeys; }
+  size_t  numTargets() const  { return _numTargets; }
+  const ingestTarget & target(size_t i) const { return _targets[i]; }
+
+  // is the register written by the mapping? slave 0: the meter ingested into
+  bool    writes(word address, uint8_t slave = 0) const;
+
+  // the value of a target, from the values of the slots
+  float   value(size_t i, const float * values) const;
+
+  void    print(Print & out) const;
+
+protected:
+  char          _text[INGEST_MAX_TEXT];
+  ingestKey     _keys[INGEST_MAX_KEYS];
+  ingestTarget  _targets[INGEST_MAX_TARGETS];
+  size_t        _numKeys = 0;
+  size_t        _numTargets = 0;
+  size_t        _textUsed = 0;
+
+private:
+  bool  parse(const char * text, const MeterBase * meter);
+  int   addKey(const char * key, size_t len);
+};
@@ -0,0 +1,133 @@
+/**
+ * @file    jsonscan.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl 
+ * @brief   Single pass, allocation free extraction of numbers from a flat JSON object
+ * @version 1.0
+ * @date    2024-06-30
+ * 
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include "jsonscan.h"
+
+static const float POW10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+// a cursor over the payload, never reads past the end
+typedef struct cursor {
+  const char * p;
+  const char * end;
+} cursor;
+
+static inline void skipSpace(cursor & c) {
+  while (c.p < c.end && (*c.p == ' ' || *c.p == '\t' || *c.p == '\n' || *c.p == '\r')) c.p++;
+}
+
+// skip a string, c.p is at the opening quote
+static bool skipString(cursor & c) {
+  for (c.p++; c.p < c.end; c.p++) {
+    if (*c.p == '\\') c.p++;
+    else if (*c.p == '"') { c.p++; return true; }
+  }
+  return false;
+}
+
+// skip any value: number, literal, string, or a nested object or array
+static bool skipValue(cursor & c) {
+  if (c.p >= c.end) return false;
+  if (*c.p == '"') return skipString(c);
+  if (*c.p == '{' || *c.p == '[') {
+    int depth = 0;
+    while (c.p < c.end) {
+      char ch = *c.p;
+      if (ch == '"') { if (!skipString(c)) return false; continue; }
+      if (ch == '{' || ch == '[') depth++;
+      else if (ch == '}' || ch == ']') depth--;
+      c.p++;
+      if (depth == 0) return true;
+    }
+    return false;
+  }
+  while (c.p < c.end && *c.p != ',' && *c.p != '}' && *c.p != ']' && *c.p != ' ') c.p++;
+  return true;
+}
+
+// parse a number, without strtod: mantissa as an integer, then one scaling
+static bool parseNumber(cursor & c, float & value) {
+  bool negative = false;
+  if (c.p < c.end && *c.p == '-') { negative = true; c.p++; }
+
+  uint32_t mantissa = 0;
+  int exponent = 0, digits = 0;
+  for (; c.p < c.end && *c.p >= '0' && *c.p <= '9'; c.p++, digits++) {
+    if (mantissa < 100000000u) mantissa = mantissa * 10 + (*c.p - '0');
+    else exponent++;
+  }
+  if (c.p < c.end && *c.p == '.') {
+    for (c.p++; c.p < c.end && *c.p >= '0' && *c.p <= '9'; c.p++, digits++) {
+      if (mantissa < 100000000u) {
+        mantissa = mantissa * 10 + (*c.p - '0');
+        exponent--;
+      }
+    }
+  }
+  if (digits == 0) return false;
+  if (c.p < c.end && (*c.p == 'e' || *c.p == 'E')) {
+    c.p++;
+    bool negexp = false;
+    if (c.p < c.end && (*c.p == '+' || *c.p == '-')) negexp = *c.p++ == '-';
+    int e = 0;
+    for (; c.p < c.end && *c.p >= '0' && *c.p <= '9'; c.p++) e = min(e * 10 + (*c.p - '0'), 100);
+    exponent += negexp ? -e : e;
+  }
+
+  float v = mantissa;
+  while (exponent > 0) { int e = min(exponent, 10); v *= POW10[e]; exponent -= e; }
+  while (exponent < 0) { int e = min(-exponent, 10); v /= POW10[e]; exponent += e; }
+  value = negative ? -v : v;
+  return true;
+}
+
+bool jsonScan(const char * json, size_t len, JsonSink & sink, size_t * members) {
+  cursor c = { json, json + len };
+  size_t n = 0;
+  if (members) *members = 0;
+
+  skipSpace(c);
+  if (c.p >= c.end || *c.p++ != '{') return false;
+  skipSpace(c);
+  if (c.p < c.end && *c.p == '}') return true;
+
+  while (c.p < c.end) {
+    // the key, hashed while we pass over it
+    skipSpace(c);
+    if (c.p >= c.end || *c.p != '"') return false;
+    const char * key = ++c.p;
+    uint32_t hash = FNV_BASIS;
+    while (c.p < c.end && *c.p != '"') {
+      if (*c.p == '\\') hash = (hash ^ (uint8_t) *c.p++) * FNV_PRIME;
+      if (c.p < c.end) hash = (hash ^ (uint8_t) *c.p++) * FNV_PRIME;
+    }
+    if (c.p >= c.end) return false;
+    size_t keyLen = c.p++ - key;
+
+    skipSpace(c);
+    if (c.p >= c.end || *c.p++ != ':') return false;
+    skipSpace(c);
+
+    int slot = sink.match(hash, key, keyLen);
+    float value;
+    if (slot >= 0 && c.p < c.end && (*c.p == '-' || (*c.p >= '0' && *c.p <= '9'))) {
+      if (!parseNumber(c, value)) return false;
+      sink.value(slot, value);
+    } else if (!skipValue(c)) {
+      return false;
+    }
+    n++;
+    if (members) *members = n;
+
+    skipSpace(c);
+    if (c.p >= c.end) return false;
+    if (*c.p == '}') return true;
+    if (*c.p++ != ',') return false;
+  }
+  return false;
+}
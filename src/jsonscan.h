@@ -0,0 +1,42 @@
+/**
+ * @file    jsonscan.h
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl 
+ * @brief   Single pass, allocation free extraction of numbers from a flat JSON object
+ * @version 1.0
+ * @date    2024-06-30
+ * 
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+
+// FNV-1a, keys are matched on their hash, computed by the compiler for the tables
+constexpr uint32_t FNV_BASIS = 2166136261u;
+constexpr uint32_t FNV_PRIME = 16777619u;
+
+constexpr uint32_t fnv1a(const char * s, size_t len, uint32_t h = FNV_BASIS) {
+  return len == 0 ? h : fnv1a(s + 1, len - 1, (h ^ (uint8_t) *s) * FNV_PRIME);
+}
+
+constexpr uint32_t fnv1a(const char * s) {
+  uint32_t h = FNV_BASIS;
+  while (*s) h = (h ^ (uint8_t) *s++) * FNV_PRIME;
+  return h;
+}
+
+// what to do with the members of the object
+class JsonSink {
+public:
+  // a top level key: a slot if its (numeric) value is wanted, or -1
+  virtual int   match(uint32_t hash, const char * key, size_t len) = 0;
+  virtual void  value(int slot, float value) = 0;
+};
+
+/**
+ * @brief scan a JSON object in place, in one pass. Only values of wanted keys are parsed,
+ *        everything else (strings, nested objects, arrays) is skipped.
+ * 
+ * @param members if not null, receives the # top level members
+ * @return false if the payload is not a well formed object
+ */
+bool jsonScan(const char * json, size_t len, JsonSink & sink, size_t * members = nullptr);
@@ -16,15 +16,28 @@
 #include <ArduinoOTA.h>
 #include <WiFiManager.h>  
 #include <PubSubClient.h>
-#include <ArduinoJson.h>
 #include <Preferences.h>
 #include <DTSU666.h>
+#include <Energy.h>
+#include <ModbusTcp.h>
+#include <Capture.h>
+#include <History.h>
+#include <PollProfile.h>
+#include "pvingest.h"
 
 // Max485 module, We use 3v3 which works fine for not very long lines
+// Build with -DRTU_UART for the hardware UART: UART0 swapped to RO on D7, DI on D8, and
+// the log on Serial1 (D4). Otherwise SoftwareSerial on the pins below
 #define TX1     D7  // 485 DI Pin
 #define RX1     D6  // 485 RO pin
 #define RE_DE1  D2  // 485 combined RE DE
 
+#ifdef RTU_UART
+#define LOG_PORT  Serial1
+#else
+#define LOG_PORT  Serial
+#endif
+
 #define BUTTON  D5
 
 // Fixed configs
@@ -35,21 +48,55 @@ const char * MQTT_CLIENT_ID     = "ESP8266_DTSU666PV";
 const char * HOSTNAME           = "dtsu666PV.local";
 const char * AC_AP_NAME         = "DTSU666PV_AC";
 const char * CFG_AP_NAME        = "DTSU666PV_CFG";
+const char * STATS_TOPIC        = "dtsu666pv/stats";
+const char * MAP_TOPIC          = "dtsu666pv/ingestmap";
+const char * LOG_TOPIC          = "dtsu666pv/loglevel";
+const char * CAPTURE_TOPIC      = "dtsu666pv/capture";
+const char * FRAMES_TOPIC       = "dtsu666pv/capture/frames";
+const char * HISTORY_TOPIC      = "dtsu666pv/history";
+const char * PROFILE_TOPIC      = "dtsu666pv/profile";
+const char * LISTEN_TOPIC       = "dtsu666pv/listen";
 
 #else
 #define LEDPIN  LED_BUILTIN  // Interal led, LOW is on
 #define DEFAULT_MQTTSERVER         "diskstation.local"
 const char * MQTT_CLIENT_ID       = "ESP8266_DTSU666PV_DBG";
 const char * HOSTNAME             = "dtsu666PV_DBG.local";
-const char * AP_NAME              = "DTSU666PV_DBG_AP";
+const char * AC_AP_NAME           = "DTSU666PV_DBG_AC";
+const char * CFG_AP_NAME          = "DTSU666PV_DBG_CFG";
+const char * STATS_TOPIC          = "dtsu666pv_dbg/stats";
+const char * MAP_TOPIC            = "dtsu666pv_dbg/ingestmap";
+const char * LOG_TOPIC            = "dtsu666pv_dbg/loglevel";
+const char * CAPTURE_TOPIC        = "dtsu666pv_dbg/capture";
+const char * FRAMES_TOPIC         = "dtsu666pv_dbg/capture/frames";
+const char * HISTORY_TOPIC        = "dtsu666pv_dbg/history";
+const char * PROFILE_TOPIC        = "dtsu666pv_dbg/profile";
+const char * LISTEN_TOPIC         = "dtsu666pv_dbg/listen";
 #endif
 
-#define CHECK_INTERVAL        5432  // milliseconds interval to check if still connected
+// Uplink timing. Every step of the link state machine is bounded by these, so the gap
+// between two bus.task() calls stays well below the poll timeout of the battery
+#define DNS_TIMEOUT           250   // ms, resolving the broker name
+#define MQTT_CONNECT_TIMEOUT  250   // ms, TCP connect to the broker
+#define MQTT_SOCKET_TIMEOUT   1     // s, waiting for the CONNACK
+#define BACKOFF_MIN           1000  // ms, first retry after a failed connect
+#define BACKOFF_MAX           30000 // ms
+#define PORTAL_AFTER          60000 // ms without wifi before the config portal opens
+#define PORTAL_TIMEOUT        120   // s, the portal closes again and we retry wifi
+#define STATS_INTERVAL        60000 // ms between stats publications
+#define CAPTURE_INTERVAL      1000  // ms between capture publications, sooner when the ring is half full
+#define CAPTURE_CHUNK         1024  // characters per publication or serial write
+
+// The dongle publishes every few seconds, the battery polls every second. Between two messages
+// the powers are served as: EST_HOLD the last message, EST_LINEAR along the last two, EST_ALPHA_BETA
+// filtered. See test/test_estimator for how they track real traces
+#define PV_ESTIMATOR          EST_HOLD
+// ms without PV data after which a read gets an exception instead of the last data, 0: never
+#define PV_STALE_AFTER        0
 
 Preferences   prefs;
 WiFiClient    wificlient;
 PubSubClient  mqtt(wificlient);
-JsonDocument  doc;
 
 // the custome parameters strings for configuration, with defaults
 // The defaults will show up in the portal
@@ -57,10 +104,45 @@ char mqttserver[40] = DEFAULT_MQTTSERVER;
 char mqttport[6]    = "1883";
 char mqtttopic[32]  = "pvdata/#";
 char address[4]     = "1";
+char address2[4]    = "0";  // a second meter on the line, e.g. grid or house. 0: none
 
-// Declare the meters and serial lines
+// Declare the meters and serial lines. The meters share the line, each has its own slave id
+#ifdef RTU_UART
+UartRtu rtu(Serial);
+#else
 SoftwareSerial S1(RX1,TX1);
+SoftwareRtu rtu(S1);
+#endif
+MeterBus bus;
 DTSU666 PV;
+DTSU666 Meter2;
+
+// monitoring tools read the same registers over Modbus TCP, unit id = slave id
+ModbusTcpServer tcp(MODBUS_TCP_PORT);
+
+// ImpEp and ExpEp from Pt, unless the mapping has them. The totals are logged in the sectors
+// after the filesystem, the one the core reserves for EEPROM included: with two, the previous
+// sector still has the last record while the next one is erased
+EnergyIntegrator  energy;
+SpiFlashSectors   energyFlash(SpiFlashSectors::firstFreeSector(), SpiFlashSectors::freeSectors());
+EnergyLog         energyLog(energyFlash);
+bool              integrateEnergy = false;
+bool              energyFromSource = false;   // a message on the energy subtopic came in
+
+// the frames on the line, for the replay in test/test_load. Switched on and off by a message
+// on the capture topic: "serial", "mqtt" or "off"
+enum captureOut { CAPTURE_OFF, CAPTURE_SERIAL, CAPTURE_MQTT };
+FrameCapture  capture;
+captureOut    captureTo = CAPTURE_OFF;
+
+// what the meter reported recently, readable from HISTORY_BASE. "dump" on the history topic
+// publishes it as binary, one part per "<topic>/<part>"
+History       history(DTSU666History, ARRAY_SIZE(DTSU666History));
+uint8_t       historyPart = History::numParts();   // next to publish, none
+
+// what the battery polls, learned from the line and published with the stats. "on" on the
+// listen topic keeps the meters quiet, to learn the profile next to a real meter
+PollProfile   profile;
 
 // Led flash 
 ulong ledOnSince = 0;   // switch off in mainloop
@@ -74,79 +156,114 @@ void LedOn(bool on) {
   }
 }
 
-/**
- * @brief This is the data-source implementation specific part
- * THis specifies where to het DATA from a json record.  
- * 
- */
-typedef struct JsonEntry {
-  const char * key;
-  int         multiplier;
-  word        address; // the target address
-} JsonEntry;
-
-JsonEntry pvData[] = {
-  { "GridFrequency",100,0x2044 } ,
-  { "L1ThreePhaseGridVoltage",10,0x2006 } ,
-  { "L2ThreePhaseGridVoltage",10,0x2008 } ,
-  { "L3ThreePhaseGridVoltage",10,0x200A } ,
-  { "L1ThreePhaseGridOutputCurrent",1000,0x200C } ,
-  { "L2ThreePhaseGridOutputCurrent",1000,0x200E } ,
-  { "L3ThreePhaseGridOutputCurrent",1000,0x2010 } ,
-  { "OutputPower",10,0x2012 } ,
-  { "L1ThreePhaseGridOutputPower",10,0x2014 } ,
-  { "L2ThreePhaseGridOutputPower",10,0x2016 } ,
-  { "L3ThreePhaseGridOutputPower",10,0x2018 }
-};
-const size_t NUM_PVREGS = ARRAY_SIZE(pvData); 
-
-
-// the MQTT inbound message callback
+// A new JSON to register mapping, see IngestMap for the format. Kept in flash when it compiles,
+// an empty message goes back to the built in mapping
+void configureMapping(const byte * payload, unsigned int length) {
+  String text;
+  text.reserve(length);
+  for (unsigned int i = 0; i < length; i++) text += (char) payload[i];
+  if (text.length() == 0) {
+    loadMapping();
+    prefs.remove("ingestmap");
+    LOG_I("Ingest mapping: built in\n");
+  } else if (loadMapping(text.c_str())) {
+    prefs.putString("ingestmap", text.c_str());
+    LOG_I("Ingest mapping: loaded\n");
+  } else {
+    return;
+  }
+  pvMap.print(LOG_PORT);
+  integrateEnergy = !energyFromSource && !pvMap.writes(REG_IMPEP) && !pvMap.writes(REG_EXPEP);
+}
+
+// the totals into the registers, in one update
+void publishEnergy() {
+  PV.beginUpdate();
+  PV.setValue(REG_IMPEP, energy.importedKWh());
+  PV.setValue(REG_EXPEP, energy.exportedKWh());
+  PV.commit();
+}
+
+// the last known totals: from the log. A layout with one free sector only keeps them in prefs
+// as well, for a reset that comes while that sector is erased
+void setupEnergy() {
+  energyTotals totals = {};
+  if (!energyLog.restore(totals) && prefs.isKey("energy")) prefs.getBytes("energy", &totals, sizeof(totals));
+  if (energyFlash.numSectors() < 2) {
+    LOG_W("Energy log: 1 sector, kept in prefs on erase\n");
+    energyLog.onErase([](const energyTotals & t) { prefs.putBytes("energy", &t, sizeof(t)); });
+  }
+  energy.begin(totals);
+  LOG_I("Energy: %.2f kWh imported, %.2f kWh exported\n", energy.importedKWh(), energy.exportedKWh());
+  if (integrateEnergy) publishEnergy();
+}
+
+void setCapture(captureOut to) {
+  capture.clear();
+  bus.capture(to == CAPTURE_OFF ? nullptr : &capture);
+  captureTo = to;
+  LOG_I("Capture %s\n", to == CAPTURE_SERIAL ? "to serial" : to == CAPTURE_MQTT ? "to mqtt" : "off");
+}
+
+// the MQTT inbound message callback. Routed on its topic, and kept until the meter
+// has been polled, so a burst of messages is written to the meter only once
 //
 void readPV (char* topic, byte* payload, unsigned int length) {
-
-  doc.clear();
-  deserializeJson(doc, payload);
-
-  if (doc.size() > 1) {
-    // Led on, builtin leed = LOW on.
-    LedOn(true); 
-    for (size_t i=0; i< NUM_PVREGS; i++) {
-      float val = 0;
-      val = doc[pvData[i].key].as<float>() * pvData[i].multiplier;
-      if (pvData[i].address == 0x2012) {
-        Serial.printf("%s = %.1f\n", pvData[i].key,val);
-      }
-      PV.setReg(pvData[i].address,val);
-    }
+  if (strcmp(topic, MAP_TOPIC) == 0) {
+    configureMapping(payload, length);
+    return;
+  }
+  // 0 (none) .. 4 (debug), up to the level compiled in
+  if (strcmp(topic, LOG_TOPIC) == 0) {
+    if (length > 0 && payload[0] >= '0' && payload[0] <= '9') logSetLevel(payload[0] - '0');
+    return;
+  }
+  if (strcmp(topic, CAPTURE_TOPIC) == 0) {
+    setCapture(length >= 1 && payload[0] == 's' ? CAPTURE_SERIAL : length >= 1 && payload[0] == 'm' ? CAPTURE_MQTT : CAPTURE_OFF);
+    return;
   }
+  if (strcmp(topic, HISTORY_TOPIC) == 0) {
+    if (length == 4 && memcmp(payload, "dump", 4) == 0) historyPart = 0;
+    return;
+  }
+  if (strcmp(topic, LISTEN_TOPIC) == 0) {
+    bus.listen(length == 2 && memcmp(payload, "on", 2) == 0);
+    LOG_I("Listen %s\n", bus.listening() ? "only" : "off");
+    return;
+  }
+  // the source publishes its totals: no more integrating
+  if (integrateEnergy && routePV(mqtttopic, topic)->map == &pvEnergyMap) {
+    energyFromSource = true;
+    integrateEnergy = false;
+    LOG_I("Energy totals: from the source\n");
+  }
+  queuePV(PV, mqtttopic, topic, payload, length);
 }
 
 /**
- * @brief reconnect to wifi, and/or configure
- * @param Force if true, we start config AP mode on demand witout a timeout
- * Else there is a 2 minute timeout, reason: if wifi goes away we otherwise would 
- * stay in autoconf (AP) mode. So in this case try to reconnect every 2 minutes
+ * @brief Wifi configuration. The portal runs non blocking, driven by linkStep() from the mainloop,
+ * so the Modbus RTU slave keeps serving the last known data while it is open.
+ * Force: started by the button, no timeout. Else it opens when wifi is gone for a while, and
+ * closes after 2 minutes, reason: if wifi goes away we otherwise would stay in autoconf (AP) mode.
  */
 bool shouldSaveConfig = false;  // flag indicating that we should save parameters in flash
 
 // a separate Callback, since the way the Wifimanerg class defines the callback ( as a pointer), we cannot ue a lambda
 // see c++ 
 void saveCb() {
-  Serial.println(F("Parameters changed, must save them"));
+  LOG_I("Parameters changed, must save them\n");
   shouldSaveConfig = true; 
 }
 
-// Automatic Wifi configuration mode
-//
-void WifiautoConnect(bool force = false) {
-  // local vars, when done no need to have them around
-  WiFiManager   wm;
-  WiFiManagerParameter custom_mqtt_server("server", "mqtt server", mqttserver, sizeof(mqttserver));
-  WiFiManagerParameter custom_mqtt_port("port", "mqtt port", mqttport, sizeof(mqttport));
-  WiFiManagerParameter custom_mqtt_topic("topic", "mqtt topic", mqtttopic, sizeof(mqtttopic));
-  WiFiManagerParameter custom_rtu_address("address", "Modbus address", address, sizeof(address));
+// The portal outlives the call that starts it, so these are global
+WiFiManager   wm;
+WiFiManagerParameter custom_mqtt_server("server", "mqtt server", mqttserver, sizeof(mqttserver));
+WiFiManagerParameter custom_mqtt_port("port", "mqtt port", mqttport, sizeof(mqttport));
+WiFiManagerParameter custom_mqtt_topic("topic", "mqtt topic", mqtttopic, sizeof(mqtttopic));
+WiFiManagerParameter custom_rtu_address("address", "Modbus address", address, sizeof(address));
+WiFiManagerParameter custom_rtu_address2("address2", "Modbus address 2nd meter (0: none)", address2, sizeof(address2));
 
+void setupWifiManager() {
   //set config save notify callback. 
   // Problem: if call expetcs a function pointer, we can't use a lambda with capture so the use
   // of a lambda is pointless
@@ -158,94 +275,280 @@ void WifiautoConnect(bool force = false) {
   wm.addParameter(&custom_mqtt_port);
   wm.addParameter(&custom_mqtt_topic);
   wm.addParameter(&custom_rtu_address);
+  wm.addParameter(&custom_rtu_address2);
 #ifdef PRODUCTION
   wm.setDebugOutput(false);
 #endif
+  wm.setConfigPortalBlocking(false);
+}
+
+// parameters changed in the portal ?
+void saveConfig() {
+  LOG_I("Saving MQTT and RTU parameters\n");
+  strcpy(mqttserver, custom_mqtt_server.getValue());
+  prefs.putString("mqttserver", mqttserver);
+
+  strcpy(mqttport, custom_mqtt_port.getValue());
+  prefs.putString("mqttport",mqttport);
+
+  strcpy(mqtttopic, custom_mqtt_topic.getValue());
+  prefs.putString("mqtttopic", mqtttopic);
+  
+  strcpy(address, custom_rtu_address.getValue());
+  prefs.putString("address", address);
+
+  strcpy(address2, custom_rtu_address2.getValue());
+  prefs.putString("address2", address2);
+
+  shouldSaveConfig = false;
+}
 
-  // go into config mode , block or wat and retry 
-  // this is usefull to prevent a block in AP mode when Wifi is offline
-  // indefinite wait should only happen whe nothing is configured
+// the master changed the line or the slave id of a meter: keep it for the next boot
+void saveLineConfig(word reg, word value, const char * key, char * addr) {
+  if (reg == REG_BAUD) prefs.putUInt("bAud", value);
+  else if (reg == REG_PROT) prefs.putUInt("Prot", value);
+  else if (reg == REG_ADDR) {
+    snprintf(addr, sizeof(address), "%u", value);
+    prefs.putString(key, addr);
+  }
+}
+
+/**
+ * @brief The uplink (wifi, MQTT) as a state machine. linkStep() is called every loop and does
+ * at most one bounded step: no delay(), no retry loops. Worst case is a step that waits for the
+ * network, bounded by DNS_TIMEOUT, MQTT_CONNECT_TIMEOUT and MQTT_SOCKET_TIMEOUT.
+ */
+enum linkState { LINK_WIFI, LINK_PORTAL, LINK_RESOLVE, LINK_MQTT, LINK_SUBSCRIBE, LINK_UP, LINK_BACKOFF };
+const char * linkNames[] = { "wifi", "portal", "resolve", "mqtt", "subscribe", "up", "backoff" };
+
+linkState linkstate  = LINK_WIFI;
+ulong     linkSince  = 0;           // millis() of the last state change
+ulong     backoff    = BACKOFF_MIN;
+bool      portalForced = false;
+IPAddress brokerIP;
+
+void linkTo(linkState state) {
+  if (state != linkstate) {
+    LOG_I("Link %s -> %s\n", linkNames[linkstate], linkNames[state]);
+  }
+  linkstate = state;
+  linkSince = millis();
+}
+
+// a failed attempt: wait, and try again with a longer interval
+void linkRetry() {
+  linkTo(LINK_BACKOFF);
+  backoff = min(backoff * 2, (ulong) BACKOFF_MAX);
+}
+
+// Start the config portal, non blocking
+void startPortal(bool force) {
+  portalForced = force;
+  wm.setConfigPortalTimeout(force ? 0 : PORTAL_TIMEOUT);
   LedOn(true);
   if (force) {
-    Serial.println(F("Start AP and configuration mode (forced) "));
+    LOG_I("Start AP and configuration mode (forced)\n");
+    mqtt.disconnect();
     wm.startConfigPortal(CFG_AP_NAME);
   } else {
-    wm.setTimeout(120);
-    Serial.println(F("Try to connect, if not goto AP and configuration mode for 2 minutes"));
-    if (!wm.autoConnect(AC_AP_NAME)) {
-      Serial.println(F("failed to connect and hit timeout, restart"));
-      delay(3000);
-      //reset and try again. 
-      // Best to restart since otherwise we could remain serving autodated PV RTU data
-      ESP.restart();
-      delay(5000);
-    }
+    LOG_W("No wifi, start AP and configuration mode for 2 minutes\n");
+    wm.startConfigPortal(AC_AP_NAME);
   }
+  linkTo(LINK_PORTAL);
+}
 
-  // We have come out of AP mode and are connected to Wifi
-  LedOn(false);
-
-  Serial.print(F("Connected to SSID ")) ; Serial.println(WiFi.SSID());
-  Serial.print(F("IP address ")) ; Serial.println(WiFi.localIP());
+void linkStep(ulong now) {
 
-  // parameters changed ?
-  if (shouldSaveConfig) {
-    Serial.print(F("Saving MQTT and RTU parameters ")) ;
-    strcpy(mqttserver, custom_mqtt_server.getValue());
-    prefs.putString("mqttserver", mqttserver);
+  switch (linkstate) {
+  case LINK_WIFI:
+    // the SDK reconnects by itself, we wait for it
+    if (WiFi.isConnected()) {
+      LOG_I("Connected to SSID %s, IP address %s\n", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
+      linkTo(LINK_RESOLVE);
+    } else if (now - linkSince > PORTAL_AFTER) {
+      startPortal(false);
+    }
+    break;
 
-    strcpy(mqttport, custom_mqtt_port.getValue());
-    prefs.putString("mqttport",mqttport);
+  case LINK_PORTAL:
+    wm.process();
+    if (shouldSaveConfig) {
+      saveConfig();
+      brokerIP = IPAddress();   // may have changed
+    }
+    if (!wm.getConfigPortalActive() || (!portalForced && WiFi.isConnected())) {
+      // We have come out of AP mode, connected to Wifi or timed out
+      if (wm.getConfigPortalActive()) wm.stopConfigPortal();
+      LedOn(false);
+      WiFi.setAutoReconnect(true);
+      linkTo(LINK_WIFI);
+    }
+    break;
+
+  case LINK_RESOLVE:
+    if (!WiFi.isConnected()) { linkTo(LINK_WIFI); break; }
+    if (brokerIP.fromString(mqttserver) || WiFi.hostByName(mqttserver, brokerIP, DNS_TIMEOUT)) {
+      mqtt.setServer(brokerIP, String(mqttport).toInt());
+      linkTo(LINK_MQTT);
+    } else {
+      LOG_W("Cannot resolve MQTT broker %s\n", mqttserver);
+      linkRetry();
+    }
+    break;
+
+  case LINK_MQTT:
+    if (!WiFi.isConnected()) { linkTo(LINK_WIFI); break; }
+    LOG_I("(re)connecting to MQTT broker %s on port %s\n", mqttserver, mqttport);
+    if (mqtt.connect(MQTT_CLIENT_ID)) {
+      linkTo(LINK_SUBSCRIBE);
+    } else {
+      LOG_W("MQTT connect failed\n");
+      linkRetry();
+    }
+    break;
+
+  case LINK_SUBSCRIBE:
+    // Subscribe to a topic, the incoming messages are processed by readPV()
+    if (mqtt.subscribe(mqtttopic) && mqtt.subscribe(MAP_TOPIC) && mqtt.subscribe(LOG_TOPIC)
+        && mqtt.subscribe(CAPTURE_TOPIC) && mqtt.subscribe(HISTORY_TOPIC) && mqtt.subscribe(LISTEN_TOPIC)) {
+      LOG_I("Subscribed to topic %s, MQTT broker connected\n", mqtttopic);
+      backoff = BACKOFF_MIN;
+      linkTo(LINK_UP);
+    } else {
+      LOG_W("Subscribe to topic %s failed\n", mqtttopic);
+      mqtt.disconnect();
+      linkRetry();
+    }
+    break;
 
-    strcpy(mqtttopic, custom_mqtt_topic.getValue());
-    prefs.putString("mqtttopic", mqtttopic);
-    
-    strcpy(address, custom_rtu_address.getValue());
-    prefs.putString("address", address);
+  case LINK_UP:
+    if (!WiFi.isConnected()) linkTo(LINK_WIFI);
+    else if (!mqtt.connected()) linkTo(LINK_MQTT);
+    break;
 
-    shouldSaveConfig = false;
+  case LINK_BACKOFF:
+    if (now - linkSince > backoff) linkTo(WiFi.isConnected() ? (brokerIP.isSet() ? LINK_MQTT : LINK_RESOLVE) : LINK_WIFI);
+    break;
   }
-  
-  WiFi.setAutoReconnect(true);
 }
 
-// (Re) connect to MQTT broker with known parameters
-// no use to leave this, if we can't connect we will restart
-bool reConnectMQTT() {
-
-  int numtries = 10;
-  Serial.print(F("(re)connecting to MQTT broker ")); Serial.print(mqttserver);
-  Serial.print(F(" on port ")); Serial.println(mqttport);
-
-  mqtt.connect(MQTT_CLIENT_ID);
-  while (!mqtt.connected() && numtries-- > 0) {
-    delay(1000);
-    // during retries, also check wifi which may have gone away
-    if (!WiFi.isConnected())  WifiautoConnect(false);
-    mqtt.connect(MQTT_CLIENT_ID);
-    Serial.print(".");
-  }
-  
-  // Still notconnected ? then return, because we need to be able to cehck the button state
-  // ofor an eventaal reconfiguration
-  if (!mqtt.connected()) {
-    Serial.println(F("\nMQTT connect Timeout"));
-    return false;
+// the capture goes out when the bus is idle: to serial no more than the uart fifo takes, to
+// MQTT every interval. Returns false while a serial chunk is in flight, the log then waits so
+// the lines do not mix
+bool captureTask(ulong now) {
+  static char   text[CAPTURE_CHUNK];
+  static size_t len = 0, sent = 0;
+  static ulong  lastPublish = 0;
+
+  if (captureTo == CAPTURE_SERIAL) {
+    if (sent == len) {
+      len = capture.drain(text, sizeof(text));
+      sent = 0;
+    }
+    size_t n = min(len - sent, (size_t) max(LOG_PORT.availableForWrite(), 0));
+    LOG_PORT.write((const uint8_t *) text + sent, n);
+    sent += n;
+    return sent == len;
   }
-  Serial.println(" OK");
-
-  // Subscribe to a topic, the incoming messages are processed by messageHandler() function
-  Serial.print(F("Subscribe to topic ")); Serial.print(mqtttopic);
-  if (mqtt.subscribe(mqtttopic))
-    Serial.println(F(" : OK"));
-  else {
-    Serial.println(F(" : Failed"));
-    return false;
+  if (captureTo == CAPTURE_MQTT && linkstate == LINK_UP &&
+      (capture.used() > CAPTURE_BUFFER / 2 || now - lastPublish > CAPTURE_INTERVAL)) {
+    size_t n = capture.drain(text, sizeof(text));
+    if (n > 0) mqtt.publish(FRAMES_TOPIC, (const uint8_t *) text, n);
+    lastPublish = now;
   }
-  Serial.println(F("MQTT broker Connected!"));
   return true;
 }
 
+// one part of the history dump per call, so a dump never holds up the bus for long
+void historyTask(ulong now) {
+  static uint8_t buf[History::maxDump()];
+  static_assert(sizeof(buf) < PV_MAX_PAYLOAD, "a history part does not fit the MQTT buffer");
+  char topic[48];
+
+  if (historyPart >= History::numParts() || linkstate != LINK_UP) return;
+  size_t n = history.dump(historyPart, buf, sizeof(buf), now);
+  snprintf(topic, sizeof(topic), "%s/%u", HISTORY_TOPIC, historyPart);
+  if (n > 0) mqtt.publish(topic, buf, n);
+  historyPart++;
+}
+
+/**
+ * @brief Metrics. The meter keeps its own: requests, exceptions, response latency, data age at
+ *  poll time and the gap between two bus.task() calls. If that gap gets longer than the poll timeout
+ *  of the battery, it flags the meter as lost. We add the loop gap and the heap, all are readable
+ *  as holding registers from METRICS_BASE and published on the stats topic.
+ */
+enum appMetric { APP_FREE_HEAP, APP_HEAP_FRAG, APP_MAX_BLOCK, APP_LOOP_GAP_MAX, 
+                 APP_MQTT_RECEIVED, APP_MQTT_DROPPED, APP_MQTT_DECODED, APP_UPTIME };
+#define METRICS_INTERVAL      1000  // ms between updates of the heap metrics
+
+ulong lastLoop   = 0;   // micros()
+ulong maxLoopGap = 0;   // micros, since boot
+
+void modbusTask() {
+  bus.task();
+}
+
+void updateMetrics() {
+  const ingestStats & in = ingestCounters();
+  PV.setMetric(APP_FREE_HEAP, ESP.getFreeHeap());
+  PV.setMetric(APP_HEAP_FRAG, ESP.getHeapFragmentation());
+  PV.setMetric(APP_MAX_BLOCK, ESP.getMaxFreeBlockSize());
+  PV.setMetric(APP_LOOP_GAP_MAX, maxLoopGap);
+  PV.setMetric(APP_MQTT_RECEIVED, in.received);
+  PV.setMetric(APP_MQTT_DROPPED, in.dropped);
+  PV.setMetric(APP_MQTT_DECODED, in.decoded);
+  PV.setMetric(APP_UPTIME, millis() / 1000);
+}
+
+// a histogram as a json array of its buckets
+static size_t histJson(char * buf, size_t len, const char * name, const histogram & h) {
+  size_t n = snprintf(buf, len, ",\"%s\":{\"max\":%u,\"p99\":%u,\"buckets\":[", name, h.max, h.percentile(99));
+  for (size_t b = 0; b < HIST_BUCKETS && n < len; b++) {
+    n += snprintf(buf + n, len - n, b ? ",%u" : "%u", h.bucket[b]);
+  }
+  if (n < len) n += snprintf(buf + n, len - n, "]}");
+  return n;
+}
+
+void publishStats() {
+  static char stats[1024];
+  const meterMetrics & m = PV.stats();
+  const ingestStats & in = ingestCounters();
+  uint32_t requests = 0;
+  for (size_t fc = 0; fc < METRIC_FCS; fc++) requests += m.requests[fc];
+
+  size_t n = snprintf(stats, sizeof(stats), "{\"link\":\"%s\",\"uptime\":%u,\"heap\":%u,\"frag\":%u,\"maxBlock\":%u,"
+    "\"maxLoopGapUs\":%u,\"fc3\":%u,\"fcOther\":%u,\"exFunction\":%u,\"exAddress\":%u,\"exValue\":%u,"
+    "\"badFrames\":%u,\"hits\":%u,\"misses\":%u,\"received\":%u,\"dropped\":%u,\"coalesced\":%u,"
+    "\"decoded\":%u,\"rejected\":%u,\"logDropped\":%u,\"stale\":%u",
+    linkNames[linkstate], m.app[APP_UPTIME], m.app[APP_FREE_HEAP], m.app[APP_HEAP_FRAG], m.app[APP_MAX_BLOCK],
+    m.app[APP_LOOP_GAP_MAX], m.requests[Modbus::FC_READ_REGS], requests - m.requests[Modbus::FC_READ_REGS],
+    m.illegalFunction, m.illegalAddress, m.illegalValue, m.badFrames, m.hits, m.misses,
+    in.received, in.dropped, in.coalesced, in.decoded, in.rejected, logDropped(), m.stale);
+  if (n < sizeof(stats)) n += snprintf(stats + n, sizeof(stats) - n, ",\"energyGaps\":%u,\"flashWrites\":%u,\"flashErases\":%u",
+    energy.stats().gaps, energyLog.stats().writes, energyLog.stats().erases);
+  if (n < sizeof(stats)) n += snprintf(stats + n, sizeof(stats) - n, ",\"tcpRequests\":%u,\"tcpExceptions\":%u,\"tcpClients\":%u,\"tcpRefused\":%u",
+    tcp.stats().requests, tcp.stats().exceptions, (unsigned) tcp.numClients(), tcp.stats().refused);
+  if (n < sizeof(stats)) n += snprintf(stats + n, sizeof(stats) - n, ",\"captured\":%u,\"captureDropped\":%u",
+    capture.captured(), capture.dropped());
+  if (n < sizeof(stats)) n += snprintf(stats + n, sizeof(stats) - n, ",\"profileFrames\":%u,\"profileUnmatched\":%u,\"listening\":%u",
+    profile.frames(), profile.unmatched(), bus.listening());
+  if (n < sizeof(stats)) n += histJson(stats + n, sizeof(stats) - n, "latencyUs", m.latency);
+  if (n < sizeof(stats)) n += histJson(stats + n, sizeof(stats) - n, "dataAgeMs", m.dataAge);
+  if (n < sizeof(stats)) n += histJson(stats + n, sizeof(stats) - n, "taskGapUs", m.taskGap);
+  if (n < sizeof(stats)) snprintf(stats + n, sizeof(stats) - n, "}");
+  mqtt.publish(STATS_TOPIC, stats);
+
+  // the poll profile, 4 windows per "<topic>/<part>"
+  char topic[48];
+  for (size_t i = 0; i < profile.numWindows(); i += 4) {
+    profile.json(stats, sizeof(stats), i, 4);
+    snprintf(topic, sizeof(topic), "%s/%u", PROFILE_TOPIC, (unsigned) (i / 4));
+    mqtt.publish(topic, stats);
+  }
+}
+
 // Standard code from Arduino OTA
 // 
 void setupOTA() {
@@ -255,88 +558,131 @@ void setupOTA() {
 	// MD5("admin") = 21232f297a57a5a743894a0e4a801fc3
 	ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
 	
+	// an update blocks the mainloop, the log is not drained then: straight to its port
 	ArduinoOTA.onStart([]() {
-		String type;
-		type = ArduinoOTA.getCommand() == U_FLASH ? "sketch" : "filesystem";
-		Serial.println("Start updating " + type);
+		LOG_PORT.printf("Start updating %s\n", ArduinoOTA.getCommand() == U_FLASH ? "sketch" : "filesystem");
 	});
 	
-	ArduinoOTA.onEnd([]() { Serial.println("\nEnd"); });
+	ArduinoOTA.onEnd([]() { LOG_PORT.println("\nEnd"); });
 	
 	ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-		Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+		LOG_PORT.printf("Progress: %u%%\r", (progress / (total / 100)));
 	});
 
 	ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("OTA Error[%u]", error);
+    LOG_PORT.printf("OTA Error[%u]\n", error);
   });
 
 	ArduinoOTA.begin();
-	Serial.println(F("OTA Ready"));
+	LOG_I("OTA Ready\n");
 }
 
 // 
 void setup() {
 
-  Serial.begin(115200);
-  Serial.println(F("Modbus DTSU666 PV emulator V 1.0"));
+  // with RTU_UART, Serial is the RS485 line: UartRtu opens it with the line settings
+  LOG_PORT.begin(115200);
+  LOG_PORT.println(F("Modbus DTSU666 PV emulator V 1.0"));
 
   pinMode(LEDPIN,OUTPUT);
   LedOn(false);
 
   pinMode(BUTTON,INPUT_PULLUP);
   
+  setupWifiManager();
   prefs.begin("DTSU666"); // use "dtsu" namespace
   // get stored persistent values. If nothing there? Goto config mode and stay there
   if (! (prefs.isKey("mqttserver") && prefs.isKey("mqttport") 
         && prefs.isKey("mqtttopic") && prefs.isKey("address"))) {
-    WifiautoConnect(true);
+    // nothing to serve yet, so we can wait for the configuration
+    wm.setConfigPortalBlocking(true);
+    wm.startConfigPortal(CFG_AP_NAME);
+    wm.setConfigPortalBlocking(false);
+    if (shouldSaveConfig) saveConfig();
   } else {
     // aparently we have been configured in the past, so all should work
     prefs.getString("mqttserver", mqttserver, sizeof(mqttserver));
     prefs.getString("mqttport", mqttport, sizeof(mqttport));
     prefs.getString("mqtttopic", mqtttopic, sizeof(mqtttopic));
     prefs.getString("address", address, sizeof(address));
-    // just keep trying until we are online
-    WifiautoConnect(false);
+    prefs.getString("address2", address2, sizeof(address2));
+    // connect with the stored credentials, the link state machine takes it from here
+    WiFi.mode(WIFI_STA);
+    WiFi.begin();
+  }
+  WiFi.setAutoReconnect(true);
+
+  // init Serial line and our Modbus RTU Slaves. Line settings the master wrote are kept in flash
+  bus.begin(&rtu,RE_DE1);
+  bus.profile(&profile);
+  PV.begin(bus,String(address).toInt());
+  if (prefs.isKey("bAud") || prefs.isKey("Prot")) {
+    PV.setReg(REG_BAUD, prefs.getUInt("bAud", 3));
+    PV.setReg(REG_PROT, prefs.getUInt("Prot", RTU_8N1));
+    PV.applyLineConfig();
+  }
+  PV.onConfigWrite([](word reg, word value) { saveLineConfig(reg, value, "address", address); });
+  PV.printRegs(LOG_PORT, 0x0,11);
+  PV.history(&history);
+  if (PV_ESTIMATOR != EST_HOLD) {
+    static const word powers[] = { REG_PT, 0x2014, 0x2016, 0x2018 };
+    for (word reg : powers) PV.estimate(reg, estimatorOf(PV_ESTIMATOR));
+  }
+  PV.staleAfter(PV_STALE_AFTER);
+  if (String(address2).toInt() > 0) {
+    Meter2.begin(bus,String(address2).toInt());
+    Meter2.onConfigWrite([](word reg, word value) { saveLineConfig(reg, value, "address2", address2); });
   }
 
-  // init Serial line and out Modbus RTU Slave
-  S1.begin(9600, SWSERIAL_8N1);
-  PV.begin(&S1,RE_DE1,String(address).toInt());
-  PV.printRegs(0x0,11);
+  // the JSON to register mapping, from flash if it was configured
+  if (!prefs.isKey("ingestmap") || !loadMapping(prefs.getString("ingestmap").c_str())) loadMapping();
+  pvMap.print(LOG_PORT);
+  loadEnergyMapping(&PV);
+  integrateEnergy = !energyFromSource && !pvMap.writes(REG_IMPEP) && !pvMap.writes(REG_EXPEP);
+  setupEnergy();
 
-  // Connect to the MQTT broker
-  mqtt.setBufferSize(2048);
-  mqtt.setServer(mqttserver, String(mqttport).toInt());
-  mqtt.setCallback(readPV);
+  // listens on any interface, serves once wifi is up
+  tcp.begin(bus);
 
-  // Attempt connection which will try until success because without MQTT there is no use to continue to run  
-  reConnectMQTT();
+  // the MQTT broker, connecting is done by linkStep() in the main loop
+  wificlient.setTimeout(MQTT_CONNECT_TIMEOUT);
+  mqtt.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+  mqtt.setBufferSize(PV_MAX_PAYLOAD);
+  mqtt.setCallback(readPV);
+  linkTo(LINK_WIFI);
   
   setupOTA();
 
-  Serial.println(F("Setup done "));
+  LOG_I("Setup done\n");
 
 }
 
 // Mainloop.
+// The Modbus slave comes first and is served before and after anything that may take time
 // check if button pressed, still connected to wifi and/or mqtt.
 //
 void loop() {
 
-  static ulong lastcheck = 0;
+  static ulong lastStats = 0;
+  static ulong lastMetrics = 0;
   static ulong firstPressed = 0;
   ulong now = millis();
 
+  ulong loopAt = micros();
+  if (lastLoop != 0 && loopAt - lastLoop > maxLoopGap) maxLoopGap = loopAt - lastLoop;
+  lastLoop = loopAt;
+
+  modbusTask();
+  // Modbus TCP: one step, and only when the RS485 master is not waiting for us
+  if (bus.isIdle()) tcp.task();
+
   // if button pressed longer than 2 seconds, goto config mode
   if (digitalRead(BUTTON) == LOW) {
     if (firstPressed == 0) {
       firstPressed = now; 
-    } else if (now - firstPressed > 2000) {
-      Serial.println(F("Button pressed > 2 seconds, start AP config mode"));  
-      LedOn(true);
-      WifiautoConnect(true);
+    } else if (now - firstPressed > 2000 && linkstate != LINK_PORTAL) {
+      LOG_I("Button pressed > 2 seconds, start AP config mode\n");
+      startPortal(true);
     }
   } else {
     firstPressed = 0;
@@ -347,16 +693,39 @@ void loop() {
     LedOn(false);
   }
 
-  if (now - lastcheck > CHECK_INTERVAL) {
-    // not connected? TRy to reconnect . If that fails the unit will restart,
-    // there is no point keep serving modbus requests with outdated data
-    if (!WiFi.isConnected())  WifiautoConnect(false);
-    if (!mqtt.connected())    reConnectMQTT();
-      //PV.printRegs(0x2006,20);
-    lastcheck = now;
+  // not connected? the state machine reconnects, one step at a time. While the uplink is down
+  // we keep serving the last known data
+  linkStep(now);
+  modbusTask();
+
+  if (linkstate == LINK_UP) {
+    mqtt.loop();
+    if (now - lastStats > STATS_INTERVAL) {
+      publishStats();
+      lastStats = now;
+    }
+  }
+  if (now - lastMetrics > METRICS_INTERVAL) {
+    updateMetrics();
+    lastMetrics = now;
+  }
+  // the newest PV message, once the meter has been polled. Led on, builtin leed = LOW on.
+  if (flushPV(PV)) {
+    LedOn(true);
+    // stamped with when the source measured Pt, not when it was decoded. A message without
+    // Pt keeps the stamp, the integrator skips it as stale
+    ulong age;
+    if (integrateEnergy && PV.sourceAge(REG_PT, age)) {
+      energy.sample(PV.getValue(REG_PT), millis() - age);
+      publishEnergy();
+    }
   }
+  // an erase blocks for tens of ms, only when nothing happens on the bus
+  if (integrateEnergy && bus.isIdle() && energyLog.due(energy.totals(), now)) energyLog.persist(energy.totals(), now);
   ArduinoOTA.handle();
-  mqtt.loop();
-  PV.task();
+  // the log and the capture go out when nothing happens on the bus, never more than the uart fifo takes
+  if (bus.isIdle() && captureTask(now)) logDrain(LOG_PORT);
+  if (bus.isIdle()) historyTask(now);
+  modbusTask();
   yield();
 }
@@ -0,0 +1,227 @@
+/**
+ * @file    pvingest.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl 
+ * @brief   The data-source implementation specific part: PV data from MQTT into the meter
+ * @version 1.0
+ * @date    2024-06-30
+ * 
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include "pvingest.h"
+
+// The Growatt inverter
+const char * PV_DEFAULT_MAP =
+  "GridFrequency, 100, 0x2044\n"
+  "L1ThreePhaseGridVoltage, 10, 0x2006\n"
+  "L2ThreePhaseGridVoltage, 10, 0x2008\n"
+  "L3ThreePhaseGridVoltage, 10, 0x200A\n"
+  "L1ThreePhaseGridOutputCurrent, 1000, 0x200C\n"
+  "L2ThreePhaseGridOutputCurrent, 1000, 0x200E\n"
+  "L3ThreePhaseGridOutputCurrent, 1000, 0x2010\n"
+  "OutputPower, 10, 0x2012\n"
+  "L1ThreePhaseGridOutputPower, 10, 0x2014\n"
+  "L2ThreePhaseGridOutputPower, 10, 0x2016\n"
+  "L3ThreePhaseGridOutputPower, 10, 0x2018\n";
+
+// The totals of the inverter, published on their own subtopic. What the panels generated is
+// positive Pt, which counts as imported
+const char * PV_ENERGY_MAP =
+  "TotalGenerateEnergy, 1, 0x101E\n";
+
+IngestMap pvMap;
+IngestMap pvEnergyMap;
+
+// the values of the mapped keys of one message, by slot of its map
+typedef struct pvValues {
+  float     values[INGEST_MAX_KEYS];
+  uint32_t  seen;       // slots in the message
+} pvValues;
+static_assert(INGEST_MAX_KEYS <= 32, "a slot is a bit in pvValues::seen");
+
+// the newest message not yet written to the meter: its values, not its text. Those would
+// take another MQTT buffer
+static struct {
+  const TopicRoute * route;    // nullptr: none
+  ulong         since;         // ms, arrival of the first message it replaced
+  ulong         at;            // ms, arrival of this one
+  pvValues      pv;
+} pending = {};
+
+// the slots of a new mapping are not those of the pending values
+static void dropPending(const IngestMap & map) {
+  if (pending.route != nullptr && pending.route->map == &map) pending.route = nullptr;
+}
+
+bool loadMapping(const char * text, const MeterBase * meter) {
+  dropPending(pvMap);
+  return pvMap.compile(text ? text : PV_DEFAULT_MAP, meter);
+}
+
+bool loadEnergyMapping(const MeterBase * meter) {
+  dropPending(pvEnergyMap);
+  return pvEnergyMap.compile(PV_ENERGY_MAP, meter);
+}
+
+// The subtopics of the subscription. The gateway publishes its state, log and settings next
+// to the data, those are dropped unseen, and its energy totals with a mapping of their own.
+// Anything not listed is decoded as PV data.
+constexpr TopicRoute pvRoutes[] = {
+  ROUTE_DECODE( "energy", pvEnergyMap ) ,
+  ROUTE_DROP( "state" ) ,
+  ROUTE_DROP( "status" ) ,
+  ROUTE_DROP( "log" ) ,
+  ROUTE_DROP( "settings" ) ,
+  ROUTE_DROP( "stats" )
+};
+constexpr TopicRoute defaultRoute = ROUTE_DECODE( "", pvMap );
+
+// collects the values of the mapped keys
+class PVSink : public JsonSink {
+public:
+  const IngestMap & map;
+  pvValues & pv;
+
+  PVSink(const IngestMap & map, pvValues & pv) : map(map), pv(pv) {}
+
+  int match(uint32_t hash, const char * key, size_t len) override {
+    return map.find(hash, key, len);
+  }
+  void value(int slot, float value) override {
+    pv.values[slot] = value;
+    pv.seen |= 1UL << slot;
+  }
+};
+
+// the meter a target goes to: the one ingested into, or another one on its line
+static MeterBase * targetMeter(MeterBase & meter, uint8_t slave) {
+  if (slave == 0 || slave == meter.slaveId()) return &meter;
+  return meter.bus() ? meter.bus()->meter(slave) : nullptr;
+}
+
+// the responses of all meters on the line, to see if it was polled
+static uint32_t responsesOf(MeterBase & meter) {
+  MeterBus * bus = meter.bus();
+  if (bus == nullptr) return meter.stats().responses;
+  uint32_t responses = 0;
+  for (size_t i=0; i< bus->numMeters(); i++) responses += bus->meterAt(i)->stats().responses;
+  return responses;
+}
+
+static ingestStats counters = {};
+
+// the values of a message for the keys of map, false if it has no PV data
+static bool decode(const IngestMap & map, const byte * payload, unsigned int length, pvValues & pv) {
+  pv = {};
+  PVSink  sink(map, pv);
+  size_t  members;
+  counters.decoded++;
+  if (!jsonScan((const char *) payload, length, sink, &members) || members <= 1) {
+    counters.rejected++;
+    return false;
+  }
+  return true;
+}
+
+// receivedAt: millis() when the message came in, the source time of its values
+static void apply(MeterBase & meter, const IngestMap & map, const pvValues & pv, ulong receivedAt) {
+  // all values of one message are published together, per meter. A register is written when
+  // the message has one of its keys, so sources for different meters can share a mapping.
+  // Keys of a sum that are not in the message are 0
+  MeterBase * updating[BUS_MAX_METERS];
+  size_t    numUpdating = 0;
+  for (size_t i=0; i< map.numTargets(); i++) {
+    const ingestTarget & t = map.target(i);
+    bool seen = false;
+    for (uint8_t k=0; k< t.terms; k++) seen |= pv.seen & (1UL << t.term[k]);
+    MeterBase * m = seen ? targetMeter(meter, t.slave) : nullptr;
+    if (m == nullptr) continue;
+
+    size_t u = 0;
+    while (u < numUpdating && updating[u] != m) u++;
+    if (u == numUpdating) {
+      if (numUpdating == BUS_MAX_METERS) continue;
+      updating[numUpdating++] = m;
+      m->beginUpdate();
+      m->sourceTime(receivedAt);
+    }
+    float val = map.value(i, pv.values);
+    if (t.address == 0x2012) {
+      LOG_D("Pt = %.1f\n", val);
+    }
+    m->setReg(t.address,val);
+  }
+  for (size_t u=0; u< numUpdating; u++) updating[u]->commit();
+}
+
+bool ingestPV(MeterBase & meter, const IngestMap & map, const byte * payload, unsigned int length) {
+  pvValues pv;
+  if (!decode(map, payload, length, pv)) return false;
+  apply(meter, map, pv, millis());
+  return true;
+}
+
+bool ingestPV(MeterBase & meter, const byte * payload, unsigned int length) {
+  return ingestPV(meter, pvMap, payload, length);
+}
+
+// the subtopic: topic without the literal part of the filter, "pvdata/#" gives "" for "pvdata"
+static const char * subtopicOf(const char * filter, const char * topic) {
+  size_t n = strcspn(filter, "#+");
+  if (strncmp(topic, filter, n) == 0) return topic + n;
+  if (n > 0 && filter[n-1] == '/' && strncmp(topic, filter, n-1) == 0 && topic[n-1] == 0) return topic + n-1;
+  return topic;
+}
+
+const TopicRoute * routePV(const char * filter, const char * topic) {
+  const char * sub = subtopicOf(filter, topic);
+  uint32_t hash = fnv1a(sub);
+  for (size_t i=0; i< ARRAY_SIZE(pvRoutes); i++) {
+    if (pvRoutes[i].hash == hash && strcmp(pvRoutes[i].subtopic, sub) == 0) return &pvRoutes[i];
+  }
+  return &defaultRoute;
+}
+
+static uint32_t polledAt = 0;  // meter responses at the last write
+
+static void applyPending(MeterBase & meter) {
+  const TopicRoute * route = pending.route;
+  pending.route = nullptr;
+  polledAt = responsesOf(meter);
+  apply(meter, *route->map, pending.pv, pending.at);
+}
+
+void queuePV(MeterBase & meter, const char * filter, const char * topic, const byte * payload, unsigned int length) {
+
+  counters.received++;
+  const TopicRoute * route = routePV(filter, topic);
+  if (route->map == nullptr) {
+    counters.dropped++;
+    return;
+  }
+  pvValues pv;
+  if (!decode(*route->map, payload, length, pv)) return;
+
+  // another mapping: the pending message has other registers, so it can not be replaced
+  if (pending.route != nullptr && pending.route != route) applyPending(meter);
+
+  if (pending.route != nullptr) {
+    counters.coalesced++;
+  } else {
+    pending.since = millis();
+  }
+  pending.route = route;
+  pending.at = millis();
+  pending.pv = pv;
+}
+
+bool flushPV(MeterBase & meter, bool force) {
+  if (pending.route == nullptr) return false;
+  if (!force && responsesOf(meter) == polledAt && millis() - pending.since < COALESCE_MAX) return false;
+  applyPending(meter);
+  return true;
+}
+
+const ingestStats & ingestCounters() {
+  return counters;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file    pvingest.h
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl 
+ * @brief   The data-source implementation specific part: PV data from MQTT into the meter
+ * @version 1.0
+ * @date    2024-06-30
+ * 
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <DTSU666.h>
+#include "jsonscan.h"
+#include "ingestmap.h"
+
+// The mapping of the PV source: the built in one, or loaded at runtime, see IngestMap
+extern IngestMap pvMap;
+extern const char * PV_DEFAULT_MAP;
+// The mapping of the energy subtopic, where the source publishes its totals
+extern IngestMap pvEnergyMap;
+extern const char * PV_ENERGY_MAP;
+
+// compile a new mapping into pvMap, nullptr for the built in one. False if it has errors,
+// pvMap is then unchanged. The registers are checked against the meter, a DTSU666 if none
+bool loadMapping(const char * text = nullptr, const MeterBase * meter = nullptr);
+// the same for the energy subtopic, its built in mapping
+bool loadEnergyMapping(const MeterBase * meter = nullptr);
+
+/**
+ * @brief What to do with the messages of a subtopic of the subscription, matched on the hash
+ *  of the subtopic before the payload is looked at: decode with a field mapping, or drop
+ */
+typedef struct TopicRoute {
+  const char *      subtopic;   // the topic with the subscription prefix stripped, "" for the prefix itself
+  uint32_t          hash;       // fnv1a(subtopic)
+  IngestMap *       map;        // nullptr: drop
+} TopicRoute;
+
+#define ROUTE_DECODE(subtopic, map) { subtopic, fnv1a(subtopic), &map }
+#define ROUTE_DROP(subtopic)        { subtopic, fnv1a(subtopic), nullptr }
+
+// a message is held this long at most for a newer one to replace it
+#define COALESCE_MAX      250   // ms
+#define PV_MAX_PAYLOAD    2048  // the MQTT buffer, the largest message that comes in
+
+typedef struct ingestStats {
+  uint32_t  received;
+  uint32_t  dropped;     // by route
+  uint32_t  coalesced;   // replaced by a newer message before it was written to the meter
+  uint32_t  decoded;     // on arrival
+  uint32_t  rejected;    // decoded, but no PV data
+} ingestStats;
+
+// decode one MQTT message into the meter, true if it contained PV data
+bool ingestPV(MeterBase & meter, const byte * payload, unsigned int length);
+bool ingestPV(MeterBase & meter, const IngestMap & map, const byte * payload, unsigned int length);
+
+// route a message of the subscription filter and decode it. Its values are kept until flushPV(),
+// unless it is dropped
+const TopicRoute * routePV(const char * filter, const char * topic);
+void  queuePV(MeterBase & meter, const char * filter, const char * topic, const byte * payload, unsigned int length);
+
+// write the pending values once the meter was polled since the last write, or they got too old.
+// True if the meter was updated
+bool  flushPV(MeterBase & meter, bool force = false);
+
+const ingestStats & ingestCounters();
@@ -0,0 +1,28 @@
+/**
+ * @file growatt_sample.h
+ * @brief A message as published by the Growatt ShineWiFi-X open firmware on pvdata/, ~1.4KB
+ */
+#pragma once
+
+static const char GROWATT_SAMPLE[] =
+  "{\"InverterStatus\":1,\"InputPower\":5321.4,\"PV1Voltage\":612.3,\"PV1InputCurrent\":4.3,"
+  "\"PV1InputPower\":2633.1,\"PV2Voltage\":598.7,\"PV2InputCurrent\":4.5,\"PV2InputPower\":2688.3,"
+  "\"OutputPower\":5187.6,\"GridFrequency\":49.98,\"L1ThreePhaseGridVoltage\":231.4,"
+  "\"L1ThreePhaseGridOutputCurrent\":7.48,\"L1ThreePhaseGridOutputPower\":1731.2,"
+  "\"L2ThreePhaseGridVoltage\":229.8,\"L2ThreePhaseGridOutputCurrent\":7.51,"
+  "\"L2ThreePhaseGridOutputPower\":1725.9,\"L3ThreePhaseGridVoltage\":232.1,"
+  "\"L3ThreePhaseGridOutputCurrent\":7.44,\"L3ThreePhaseGridOutputPower\":1730.5,"
+  "\"TodayGenerateEnergy\":18.4,\"TotalGenerateEnergy\":21873.2,\"TWorkTimeTotal\":27481530,"
+  "\"PV1EnergyToday\":9.1,\"PV1EnergyTotal\":10912.7,\"PV2EnergyToday\":9.3,\"PV2EnergyTotal\":10960.5,"
+  "\"PVEnergyTotal\":21873.2,\"InverterTemperature\":41.3,\"TemperatureInsideIPM\":43.9,"
+  "\"BoostTemperature\":0,\"DischargePower\":0,\"ChargePower\":0,\"BatteryVoltage\":0,\"SOC\":0,"
+  "\"ACPowerToUser\":0,\"ACPowerToUserTotal\":0,\"ACPowerToGrid\":0,\"ACPowerToGridTotal\":0,"
+  "\"INVPowerToLocalLoad\":0,\"INVPowerToLocalLoadTotal\":0,\"BatteryTemperature\":0,"
+  "\"BatteryState\":0,\"EnergyToUserToday\":0,\"EnergyToUserTotal\":0,\"EnergyToGridToday\":0,"
+  "\"EnergyToGridTotal\":0,\"DischargeEnergyToday\":0,\"DischargeEnergyTotal\":0,"
+  "\"ChargeEnergyToday\":0,\"ChargeEnergyTotal\":0,\"LocalLoadEnergyToday\":0,"
+  "\"LocalLoadEnergyTotal\":0,\"DeratingMode\":0,\"FaultCode\":0,\"WarningCode\":0,"
+  "\"IPFMode\":0,\"ExportLimitApparentPower\":0,\"PowerFactor\":1.0,\"PV1FaultValue\":0,"
+  "\"PV2FaultValue\":0,\"IsolationResistance\":3000,\"GFCIValue\":12,\"DCIValue\":0.1,"
+  "\"RealOPPercent\":52,\"Mac\":\"E8:DB:84:12:34:56\",\"Cnt\":48213,\"DataloggerVersion\":\"3.2.0.1\","
+  "\"RSSI\":-67}";
@@ -0,0 +1,351 @@
+/**
+ * @file    test_bench.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host latency benchmarks for the Modbus request path and the MQTT ingest.
+ *          Run with: pio test -e native -f test_bench
+ *          Results are appended to bench/history.csv (or $BENCH_HISTORY), labelled with
+ *          $BENCH_LABEL (e.g. the git commit), and compared with the previous label in the file.
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <DTSU666.h>
+#include <SoftwareSerial.h>
+#include "pvingest.h"
+#include "growatt_sample.h"
+
+typedef struct benchResult {
+  std::string name;
+  double      nsPerOp;
+} benchResult;
+
+static std::vector<benchResult> results;
+
+// run f n times, report and remember the time per call
+template <class F>
+static double bench(const char * name, size_t n, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) f(i);
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
+  results.push_back({ name, ns });
+  char msg[96];
+  snprintf(msg, sizeof(msg), "%-24s %10.1f ns/op", name, ns);
+  TEST_MESSAGE(msg);
+  return ns;
+}
+
+// a read request frame as the master sends it
+static size_t readRequest(uint8_t * frame, uint8_t slaveId, word start, word count) {
+  frame[0] = slaveId;
+  frame[1] = Modbus::FC_READ_REGS;
+  frame[2] = start >> 8;
+  frame[3] = start & 0xff;
+  frame[4] = count >> 8;
+  frame[5] = count & 0xff;
+  return appendCrc(frame, 6);
+}
+
+SimBus          bus;
+SoftwareSerial  slaveLine(bus);
+SoftwareSerial  masterLine(bus);
+SoftwareRtu     slaveRtu(slaveLine);
+SoftwareRtu     masterRtu(masterLine);
+DTSU666         meter(1);
+
+// the battery's favourite windows, and one more than the frame cache holds
+static const word windows[][2] = {
+  { 0x2000, 0x46 }, { 0x2012, 8 }, { 0x2044, 2 }, { 0x101E, 12 }, { 0x0000, 0x2f }
+};
+
+void setUp() {}
+void tearDown() {}
+
+void bench_lookup() {
+  volatile int sink = 0;
+  bench("map lookup", 1000000, [&](size_t i) {
+    sink += DTSU666Map.index(DTSU666Regs[i % NUM_DTSU666_REGS].address);
+  });
+}
+
+void bench_decode() {
+  uint8_t frame[8];
+  size_t len = readRequest(frame, 1, 0x2000, 0x46);
+  volatile word sink = 0;
+  bench("request decode", 1000000, [&](size_t) {
+    if (crc16(frame, len) == 0) sink += ((frame[2] << 8) | frame[3]) + ((frame[4] << 8) | frame[5]);
+  });
+}
+
+// one full request through the simulated line: frame in, decode, lookup, encode, frame out
+static void serve(const uint8_t * frame, size_t len) {
+  masterLine.write(frame, len);
+  masterLine.flush();
+  meter.task();
+  while (masterLine.available()) masterLine.read();
+}
+
+static uint8_t pollFrame[8];
+
+void bench_request_hit() {
+  uint8_t frame[8];
+  size_t len = readRequest(frame, 1, 0x2000, 0x46);
+  serve(frame, len);
+  uint32_t hits = meter.stats().hits;
+  bench("request 0x2000+70 hit", 200000, [&](size_t) { serve(frame, len); });
+  TEST_ASSERT_GREATER_THAN(hits, meter.stats().hits);
+}
+
+void bench_request_miss() {
+  // round robin over more windows than the cache holds: every request is a miss
+  uint8_t frames[ARRAY_SIZE(windows)][8];
+  for (size_t w = 0; w < ARRAY_SIZE(windows); w++) readRequest(frames[w], 1, windows[w][0], windows[w][1]);
+  uint32_t misses = meter.stats().misses;
+  bench("request miss", 200000, [&](size_t i) { serve(frames[i % ARRAY_SIZE(windows)], 8); });
+  TEST_ASSERT_GREATER_THAN(misses, meter.stats().misses);
+}
+
+// recording must stay well below a microsecond, the vendor window reads what was recorded
+void bench_metrics() {
+  static histogram h = {};
+  volatile uint32_t step = 7919;
+  bench("metrics record", 1000000, [&](size_t i) { h.record(i * step); });
+  TEST_ASSERT_EQUAL(1000000, h.count);
+  TEST_ASSERT_TRUE(h.percentile(99) <= h.max);
+  histogram small = {};
+  small.record(300);
+  small.record(352);
+  TEST_ASSERT_EQUAL(352, small.percentile(99));    // not 511, the top of its bucket
+
+  // the counters, the window takes more than one request
+  uint8_t frame[8];
+  readRequest(frame, 1, METRICS_BASE, 16);
+  masterLine.write(frame, 8);
+  masterLine.flush();
+  meter.task();
+  uint8_t response[3 + 2 * 16 + 2];
+  size_t len = 0;
+  while (masterLine.available() && len < sizeof(response)) response[len++] = masterLine.read();
+  TEST_ASSERT_EQUAL(sizeof(response), len);
+  TEST_ASSERT_EQUAL(0, crc16(response, len));
+  // requests[3] is the 4th value: high word at register 6, low at 7
+  uint32_t fc3 = ((uint32_t) response[3 + 12] << 24) | (response[3 + 13] << 16) | (response[3 + 14] << 8) | response[3 + 15];
+  TEST_ASSERT_EQUAL(meter.stats().requests[Modbus::FC_READ_REGS], fc3);
+
+  readRequest(frame, 1, METRICS_BASE + METRIC_REGS - 1, 2);
+  uint32_t illegal = meter.stats().illegalAddress;
+  serve(frame, 8);
+  TEST_ASSERT_EQUAL(illegal + 1, meter.stats().illegalAddress);
+}
+
+// a float register as the master sees it
+static float regFloat(word address) {
+  uint32_t raw = ((uint32_t) meter.Hreg(address) << 16) | meter.Hreg(address + 1);
+  float f;
+  memcpy(&f, &raw, sizeof(f));
+  return f;
+}
+
+void bench_readpv() {
+  TEST_ASSERT_TRUE(ingestPV(meter, (const byte *) GROWATT_SAMPLE, strlen(GROWATT_SAMPLE)));
+  TEST_ASSERT_EQUAL_FLOAT(51876.0f, regFloat(0x2012));
+  TEST_ASSERT_EQUAL_FLOAT(4998.0f, regFloat(0x2044));
+  TEST_ASSERT_EQUAL_FLOAT(7480.0f, regFloat(0x200C));
+  TEST_ASSERT_FALSE(ingestPV(meter, (const byte *) "{\"status\":1}", 12));
+  bench("readPV message", 20000, [&](size_t) {
+    ingestPV(meter, (const byte *) GROWATT_SAMPLE, strlen(GROWATT_SAMPLE));
+  });
+}
+
+// a mapping loaded at runtime, with Pt derived from the phases, costs the same per message
+void bench_mapping() {
+  TEST_ASSERT_FALSE(loadMapping("OutputPower, 10"));
+  TEST_ASSERT_FALSE(loadMapping("OutputPower, 10, 0x2013"));
+  TEST_ASSERT_FALSE(loadMapping("OutputPower, ten, 0x2012"));
+  TEST_ASSERT_EQUAL(11, pvMap.numTargets());
+
+  TEST_ASSERT_TRUE(loadMapping(
+    "# phases only, Pt is derived\n"
+    "GridFrequency, 100, 0x2044; L1ThreePhaseGridVoltage, 10, 0x2006\n"
+    "L1ThreePhaseGridOutputPower, 10, 0x2014\n"
+    "L2ThreePhaseGridOutputPower, 10, 0x2016\n"
+    "L3ThreePhaseGridOutputPower, 10, 0x2018\n"
+    "L1ThreePhaseGridOutputPower + L2ThreePhaseGridOutputPower + L3ThreePhaseGridOutputPower, 10, 0, 0x2012\n"
+    "GridFrequency, 1, -50, 0x201A\n"));
+  TEST_ASSERT_EQUAL(7, pvMap.numTargets());
+  TEST_ASSERT_EQUAL(5, pvMap.numKeys());
+  TEST_ASSERT_TRUE(ingestPV(meter, (const byte *) GROWATT_SAMPLE, strlen(GROWATT_SAMPLE)));
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 51876.0f, regFloat(0x2012));
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, -0.02f, regFloat(0x201A));
+
+  bench("readPV runtime map", 20000, [&](size_t) {
+    ingestPV(meter, (const byte *) GROWATT_SAMPLE, strlen(GROWATT_SAMPLE));
+  });
+  TEST_ASSERT_TRUE(loadMapping());
+}
+
+// the gateway's other subtopics are dropped on their hash, a burst is decoded once
+void bench_routing() {
+  const byte * msg = (const byte *) GROWATT_SAMPLE;
+  size_t len = strlen(GROWATT_SAMPLE);
+  TEST_ASSERT_NULL(routePV("pvdata/#", "pvdata/status")->map);
+  TEST_ASSERT_EQUAL_PTR(&pvMap, routePV("pvdata/#", "pvdata")->map);
+  TEST_ASSERT_EQUAL_PTR(&pvMap, routePV("pvdata/#", "pvdata/growatt")->map);
+
+  ingestStats before = ingestCounters();
+  bench("route drop", 1000000, [&](size_t) { queuePV(meter, "pvdata/#", "pvdata/status", msg, len); });
+  TEST_ASSERT_EQUAL(before.decoded, ingestCounters().decoded);
+
+  // ten messages between two polls: each is decoded as it comes in, only the last one is written
+  before = ingestCounters();
+  bench("readPV burst of 10", 2000, [&](size_t) {
+    for (int m = 0; m < 10; m++) queuePV(meter, "pvdata/#", "pvdata", msg, len);
+    serve(pollFrame, 8);
+    flushPV(meter);
+  });
+  TEST_ASSERT_EQUAL(before.decoded + 10 * 2000, ingestCounters().decoded);
+  TEST_ASSERT_EQUAL(before.coalesced + 9 * 2000, ingestCounters().coalesced);
+
+  // a new mapping has other slots: the values pending for the old one are dropped
+  queuePV(meter, "pvdata/#", "pvdata", msg, len);
+  TEST_ASSERT_TRUE(loadMapping());
+  TEST_ASSERT_FALSE(flushPV(meter, true));
+
+  // the totals on their own subtopic: the pending PV data is written first, with its own mapping
+  TEST_ASSERT_TRUE(loadEnergyMapping(&meter));
+  TEST_ASSERT_EQUAL_PTR(&pvEnergyMap, routePV("pvdata/#", "pvdata/energy")->map);
+  const char * totals = "{\"TodayGenerateEnergy\":3.2,\"TotalGenerateEnergy\":1234.5}";
+  meter.setValue(REG_PT, 0);
+  meter.setValue(REG_IMPEP, 0);
+  before = ingestCounters();
+  queuePV(meter, "pvdata/#", "pvdata", msg, len);
+  queuePV(meter, "pvdata/#", "pvdata/energy", (const byte *) totals, strlen(totals));
+  TEST_ASSERT_EQUAL(before.decoded + 2, ingestCounters().decoded);
+  TEST_ASSERT_EQUAL(before.coalesced, ingestCounters().coalesced);
+  TEST_ASSERT_TRUE(meter.getValue(REG_PT) != 0);
+  TEST_ASSERT_EQUAL(0, meter.getValue(REG_IMPEP));
+  TEST_ASSERT_TRUE(flushPV(meter, true));
+  TEST_ASSERT_FLOAT_WITHIN(0.05f, 1234.5f, meter.getValue(REG_IMPEP));
+}
+
+// meters on one line: each answers for its own id from its own image, at the cost of one
+void bench_multislave() {
+  static SimBus line;
+  static SoftwareSerial slaves(line), master(line);
+  static SoftwareRtu rtu(slaves);
+  static MeterBus shared;
+  static DTSU666 meters[BUS_MAX_METERS];
+  static const uint8_t ids[BUS_MAX_METERS] = { 1, 17, 100, 247 };
+  slaves.begin(9600);
+  master.begin(9600);
+  shared.begin(&rtu, -1);
+  for (size_t m = 0; m < BUS_MAX_METERS; m++) meters[m].begin(shared, ids[m]);
+  DTSU666 extra(2);
+  extra.begin(shared, 2);
+  TEST_ASSERT_EQUAL(BUS_MAX_METERS, shared.numMeters());
+  TEST_ASSERT_NULL(shared.meter(2));
+
+  // one mapping for two meters
+  TEST_ASSERT_FALSE(loadMapping("OutputPower, 10, 0:0x2012"));
+  TEST_ASSERT_TRUE(loadMapping("OutputPower, 10, 0x2012; OutputPower, 1, 17:0x2012"));
+  TEST_ASSERT_TRUE(ingestPV(meters[0], (const byte *) GROWATT_SAMPLE, strlen(GROWATT_SAMPLE)));
+  TEST_ASSERT_TRUE(loadMapping());
+
+  uint8_t frames[BUS_MAX_METERS][8];
+  for (size_t m = 0; m < BUS_MAX_METERS; m++) readRequest(frames[m], ids[m], 0x2012, 2);
+  for (size_t m = 0; m < BUS_MAX_METERS; m++) {
+    master.write(frames[m], 8);
+    master.flush();
+    shared.task();
+    uint8_t response[9];
+    size_t len = 0;
+    while (master.available() && len < sizeof(response)) response[len++] = master.read();
+    TEST_ASSERT_EQUAL(sizeof(response), len);
+    TEST_ASSERT_EQUAL(ids[m], response[0]);
+    uint32_t raw = ((uint32_t) response[3] << 24) | (response[4] << 16) | (response[5] << 8) | response[6];
+    float pt;
+    memcpy(&pt, &raw, sizeof(pt));
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, m == 0 ? 51876.0f : m == 1 ? 5187.6f : 0.0f, pt);
+  }
+
+  bench("request hit, 4 slaves", 200000, [&](size_t i) {
+    master.write(frames[i % BUS_MAX_METERS], 8);
+    master.flush();
+    shared.task();
+    while (master.available()) master.read();
+  });
+  for (size_t m = 0; m < BUS_MAX_METERS; m++) TEST_ASSERT_EQUAL(50000, meters[m].stats().hits);
+}
+
+void bench_master_scan() {
+  DTSU666 master;
+  master.begin(&masterRtu, -1);
+  hostOnYield([] { meter.task(); });
+  TEST_ASSERT_GREATER_THAN(0, master.readMeterData(1, true));
+  bench("master full scan", 2000, [&](size_t) { master.readMeterData(1, true); });
+  hostClearYield();
+}
+
+// append to the history file, and compare with the most recent other label in it
+static void saveResults() {
+  const char * path  = getenv("BENCH_HISTORY") ? getenv("BENCH_HISTORY") : "bench/history.csv";
+  const char * label = getenv("BENCH_LABEL") ? getenv("BENCH_LABEL") : "local";
+
+  std::vector<std::pair<std::string, benchResult>> previous;
+  if (FILE * in = fopen(path, "r")) {
+    char line[160], l[64], n[64];
+    double ns;
+    while (fgets(line, sizeof(line), in)) {
+      if (sscanf(line, "%63[^,],%63[^,],%lf", l, n, &ns) == 3 && strcmp(l, label) != 0) {
+        previous.push_back({ l, { n, ns } });
+      }
+    }
+    fclose(in);
+  }
+  std::string base = previous.empty() ? "" : previous.back().first;
+
+  mkdir("bench", 0755);
+  FILE * out = fopen(path, "a");
+  for (auto & r : results) {
+    if (out) fprintf(out, "%s,%s,%.1f\n", label, r.name.c_str(), r.nsPerOp);
+    for (auto & p : previous) {
+      if (p.first == base && p.second.name == r.name) {
+        printf("%-24s %10.1f ns/op  %+6.1f%% vs %s\n", r.name.c_str(), r.nsPerOp,
+          100.0 * (r.nsPerOp - p.second.nsPerOp) / p.second.nsPerOp, base.c_str());
+      }
+    }
+  }
+  if (out) fclose(out);
+}
+
+int main() {
+  Serial.mute(true);
+  Serial.begin(115200);   // writes take the time of the line, as on the ESP8266
+  slaveLine.begin(9600);
+  masterLine.begin(9600);
+  meter.begin(&slaveRtu, -1, 1);
+  readRequest(pollFrame, 1, 0x2000, 0x46);
+  loadMapping();
+
+  UNITY_BEGIN();
+  RUN_TEST(bench_lookup);
+  RUN_TEST(bench_decode);
+  RUN_TEST(bench_request_hit);
+  RUN_TEST(bench_request_miss);
+  RUN_TEST(bench_metrics);
+  RUN_TEST(bench_readpv);
+  RUN_TEST(bench_mapping);
+  RUN_TEST(bench_routing);
+  RUN_TEST(bench_multislave);
+  RUN_TEST(bench_master_scan);
+  int failures = UNITY_END();
+
+  saveResults();
+  return failures;
+}
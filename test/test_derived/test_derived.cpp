@@ -0,0 +1,149 @@
+/**
+ * @file    test_derived.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the derived registers: computed when a read covers them, and only then.
+ *          Run with: pio test -e native -f test_derived
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <DTSU666.h>
+#include <SoftwareSerial.h>
+
+SimBus          line;
+SoftwareSerial  slaveLine(line);
+SoftwareSerial  masterLine(line);
+SoftwareRtu     slaveRtu(slaveLine);
+DTSU666         meter(1);
+
+static uint8_t  response[MODBUS_MAX_FRAME];
+static size_t   responseLen;
+
+static void request(word address, word count) {
+  uint8_t frame[8] = { 1, Modbus::FC_READ_REGS, (uint8_t) (address >> 8), (uint8_t) address, (uint8_t) (count >> 8), (uint8_t) count };
+  masterLine.write(frame, appendCrc(frame, 6));
+  masterLine.flush();
+  meter.task();
+  responseLen = 0;
+  while (masterLine.available() && responseLen < sizeof(response)) response[responseLen++] = masterLine.read();
+  TEST_ASSERT_EQUAL(3 + count * 2 + 2, responseLen);
+}
+
+// a float of the last response, in physical units
+static float value(word first, word address, float scale) {
+  const uint8_t * b = response + 3 + (address - first) * 2;
+  return floatHighFirst::get((b[0] << 8) | b[1], (b[2] << 8) | b[3]) / scale;
+}
+
+// 230 V, 10 A and 2000 W on each phase
+static void balanced() {
+  meter.beginUpdate();
+  for (word p = 0; p < 3; p++) {
+    meter.setValue(0x2006 + 2 * p, 230);
+    meter.setValue(0x200c + 2 * p, 10);
+    meter.setValue(0x2014 + 2 * p, 2000);
+  }
+  meter.commit();
+}
+
+void setUp() {
+  // a fresh image for every test
+  meter.begin(&slaveRtu, -1, 1);
+}
+void tearDown() {}
+
+// changing the inputs computes nothing, nor does reading other registers
+void test_unread_not_computed() {
+  uint32_t before = meter.derivedComputed();
+  balanced();
+  TEST_ASSERT_EQUAL(before, meter.derivedComputed());
+  request(0x2006, 12);    // U and I
+  request(0x2044, 2);     // Freq
+  request(0x101E, 12);
+  TEST_ASSERT_EQUAL(before, meter.derivedComputed());
+
+  // Uab only
+  request(0x2000, 2);
+  TEST_ASSERT_EQUAL(before + 1, meter.derivedComputed());
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 398.37f, value(0x2000, 0x2000, 10));
+  // again: it is up to date
+  request(0x2000, 2);
+  TEST_ASSERT_EQUAL(before + 1, meter.derivedComputed());
+}
+
+void test_values() {
+  balanced();
+  uint32_t before = meter.derivedComputed();
+  request(0x2000, 0x32);
+  TEST_ASSERT_EQUAL(before + 12, meter.derivedComputed());
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 398.37f, value(0x2000, 0x2004, 10));   // Uca
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 6000.0f, value(0x2000, 0x2012, 10));    // Pt
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 1135.8f, value(0x2000, 0x201C, 10));    // Qa
+  TEST_ASSERT_FLOAT_WITHIN(0.3f, 3407.3f, value(0x2000, 0x201A, 10));    // Qt
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.8696f, value(0x2000, 0x202E, 1000)); // PFb
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.8696f, value(0x2000, 0x202A, 1000)); // PFt
+}
+
+// one changed input: only what depends on it, and through Qa, Qt
+void test_dependencies() {
+  balanced();
+  request(0x2000, 0x32);
+  uint32_t before = meter.derivedComputed();
+  meter.setValue(0x200c, 12);     // Ia
+  request(0x201A, 2);             // Qt needs Qa first
+  TEST_ASSERT_EQUAL(before + 2, meter.derivedComputed());
+  request(0x2000, 0x32);          // PFa and PFt are left
+  TEST_ASSERT_EQUAL(before + 4, meter.derivedComputed());
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 2000.0f / 2760, value(0x2000, 0x202C, 1000));
+}
+
+// a cached response that holds a derived register is patched when it is computed
+void test_cached_frame() {
+  balanced();
+  request(0x2000, 0x32);
+  request(0x2000, 0x32);
+  uint32_t hits = meter.stats().hits;
+  meter.setValue(0x2008, 240);    // Ub
+  request(0x2000, 0x32);
+  TEST_ASSERT_EQUAL(hits + 1, meter.stats().hits);
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, sqrtf(230 * 230 + 240 * 240 + 230 * 240), value(0x2000, 0x2000, 10));
+  TEST_ASSERT_EQUAL(0, crc16(response, responseLen));
+}
+
+// a register the source has is not derived: Pt from the source stays
+void test_override() {
+  balanced();
+  meter.setValue(0x2012, 5000);
+  request(0x2012, 2);
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 5000.0f, value(0x2012, 0x2012, 10));
+  meter.setValue(0x2014, 0);      // Pa
+  request(0x2000, 0x32);
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 5000.0f, value(0x2000, 0x2012, 10));
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 5000.0f / 6900, value(0x2000, 0x202A, 1000));
+}
+
+// the application reads the computed value as well
+void test_get_value() {
+  balanced();
+  uint32_t before = meter.derivedComputed();
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 6000.0f, meter.getValue(0x2012));
+  TEST_ASSERT_EQUAL(before + 1, meter.derivedComputed());
+}
+
+int main() {
+  Serial.mute(true);
+  slaveLine.begin(9600);
+  masterLine.begin(9600);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_unread_not_computed);
+  RUN_TEST(test_values);
+  RUN_TEST(test_dependencies);
+  RUN_TEST(test_cached_frame);
+  RUN_TEST(test_override);
+  RUN_TEST(test_get_value);
+  return UNITY_END();
+}
@@ -0,0 +1,306 @@
+/**
+ * @file    test_energy.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the energy integrator and its flash log: the integration error on a
+ *          synthetic power profile, gaps, the flash writes and erases per day, and the writes
+ *          of the main loop between the polls of a master.
+ *          Run with: pio test -e native -f test_energy
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <math.h>
+#include <vector>
+#include <Energy.h>
+#include <DTSU666.h>
+#include <SoftwareSerial.h>
+
+// NOR flash in RAM: a write can only clear bits. Counts the erases per sector
+class RamFlash : public FlashSectors {
+public:
+  RamFlash(size_t sectors, uint8_t fill = 0xff) : mem(sectors * FLASH_SECTOR_BYTES, fill), erases(sectors, 0) {}
+  size_t numSectors() const override { return erases.size(); }
+  bool erase(size_t sector) override {
+    memset(&mem[sector * FLASH_SECTOR_BYTES], 0xff, FLASH_SECTOR_BYTES);
+    erases[sector]++;
+    return true;
+  }
+  bool read(uint32_t offset, void * data, size_t len) override {
+    memcpy(data, &mem[offset], len);
+    return true;
+  }
+  bool write(uint32_t offset, const void * data, size_t len) override {
+    // a reset halfway: only part of it gets written
+    if (tearAfter >= 0 && (size_t) tearAfter < len) len = tearAfter;
+    const uint8_t * b = (const uint8_t *) data;
+    for (size_t i = 0; i < len; i++) mem[offset + i] &= b[i];
+    return tearAfter < 0;
+  }
+  std::vector<uint8_t> mem;
+  std::vector<uint32_t> erases;
+  int tearAfter = -1;
+};
+
+// the power profile of a day, W: a solar bump, a base load and a few large loads
+static double power(double s) {
+  double p = 400 + 150 * sin(s / 97.0);
+  double day = fmod(s, 86400.0);
+  if (day > 25200 && day < 68400) p -= 3200 * sin(M_PI * (day - 25200) / 43200);
+  if (fmod(s, 3600) < 600) p += 2000;
+  return p;
+}
+
+// the exact energy, imported and exported, in mJ
+static void reference(double from, double to, double & imported, double & exported) {
+  const double step = 0.01;   // s
+  imported = exported = 0;
+  for (double t = from; t < to; t += step) {
+    double p = (power(t) + power(t + step)) / 2;
+    if (p > 0) imported += p * step * 1000;
+    else exported -= p * step * 1000;
+  }
+}
+
+// a sample every 5 s give or take a second, as MQTT messages come in
+static ulong nextSample(ulong ms, uint32_t & seed) {
+  seed = seed * 1103515245 + 12345;
+  return ms + 4000 + (seed >> 16) % 2000;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_constant_power() {
+  EnergyIntegrator e;
+  e.begin({});
+  for (ulong ms = 0; ms <= 3600000; ms += 5000) e.sample(1000, ms);
+  TEST_ASSERT_EQUAL_UINT64(3600000000ULL, e.totals().imported);
+  TEST_ASSERT_EQUAL_UINT64(0, e.totals().exported);
+  TEST_ASSERT_EQUAL_FLOAT(1.0f, e.importedKWh());
+  TEST_ASSERT_EQUAL(720, e.stats().samples);
+}
+
+// the interval is split where the power goes through zero
+void test_zero_crossing() {
+  EnergyIntegrator e;
+  e.begin({ 1000, 2000 });
+  e.sample(1000, 0);
+  e.sample(-3000, 8000);      // zero at 2 s
+  TEST_ASSERT_EQUAL_UINT64(1000 + 1000000, e.totals().imported);
+  TEST_ASSERT_EQUAL_UINT64(2000 + 9000000, e.totals().exported);
+}
+
+void test_gaps_and_stale() {
+  EnergyIntegrator e;
+  e.begin({}, 60000);
+  e.sample(500, 1000);
+  e.sample(500, 6000);
+  e.sample(500, 6000);        // the same message again
+  e.sample(500, 3000);        // older
+  e.sample(500, 206000);      // the source was gone for 200 s
+  e.sample(500, 211000);
+  TEST_ASSERT_EQUAL_UINT64(5000000, e.totals().imported);
+  TEST_ASSERT_EQUAL(2, e.stats().samples);
+  TEST_ASSERT_EQUAL(2, e.stats().stale);
+  TEST_ASSERT_EQUAL(1, e.stats().gaps);
+  TEST_ASSERT_EQUAL(200000, e.stats().gapMs);
+}
+
+// 2 days of the synthetic profile, against the exact integral
+void test_integration_error() {
+  EnergyIntegrator e;
+  e.begin({});
+  uint32_t seed = 1;
+  ulong end = 2 * 86400000UL;
+  ulong ms = 0;
+  for (; ms < end; ms = nextSample(ms, seed)) e.sample(power(ms / 1000.0), ms);
+  // the reference up to the last sample
+  seed = 1;
+  ulong last = 0;
+  for (ulong t = 0; t < end; t = nextSample(t, seed)) last = t;
+  double imported, exported;
+  reference(0, last / 1000.0, imported, exported);
+
+  double importError = (e.totals().imported - imported) / imported;
+  double exportError = (e.totals().exported - exported) / exported;
+  char msg[96];
+  snprintf(msg, sizeof(msg), "import %.3f kWh error %+.4f%%, export %.3f kWh error %+.4f%%",
+           e.importedKWh(), importError * 100, e.exportedKWh(), exportError * 100);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_FLOAT_WITHIN(0.002f, 0.0f, importError);
+  TEST_ASSERT_FLOAT_WITHIN(0.002f, 0.0f, exportError);
+}
+
+// whatever was in the sectors, the log starts clean and restores what it wrote last
+void test_log_restore() {
+  RamFlash flash(2, 0x00);
+  EnergyLog log(flash);
+  energyTotals t;
+  TEST_ASSERT_FALSE(log.restore(t));
+  for (uint64_t i = 1; i <= 5; i++) TEST_ASSERT_TRUE(log.persist({ i * 123456789012ULL, i }, i));
+  TEST_ASSERT_EQUAL(1, flash.erases[0]);
+
+  EnergyLog after(flash);
+  TEST_ASSERT_TRUE(after.restore(t));
+  TEST_ASSERT_EQUAL_UINT64(5 * 123456789012ULL, t.imported);
+  TEST_ASSERT_EQUAL_UINT64(5, t.exported);
+  // and goes on where it was, without an erase
+  TEST_ASSERT_TRUE(after.persist({ 6, 6 }, 6));
+  TEST_ASSERT_EQUAL(1, flash.erases[0]);
+  EnergyLog again(flash);
+  TEST_ASSERT_TRUE(again.restore(t));
+  TEST_ASSERT_EQUAL_UINT64(6, t.imported);
+}
+
+// a reset halfway a write: the record before it counts, the torn slot is skipped
+void test_log_torn_write() {
+  RamFlash flash(2);
+  EnergyLog log(flash);
+  energyTotals t;
+  log.restore(t);
+  log.persist({ 1, 1 }, 0);
+  log.persist({ 2, 2 }, 0);
+  flash.tearAfter = 10;
+  TEST_ASSERT_FALSE(log.persist({ 3, 3 }, 0));
+  flash.tearAfter = -1;
+
+  EnergyLog after(flash);
+  TEST_ASSERT_TRUE(after.restore(t));
+  TEST_ASSERT_EQUAL_UINT64(2, t.imported);
+  TEST_ASSERT_TRUE(after.persist({ 4, 4 }, 0));
+  EnergyLog again(flash);
+  TEST_ASSERT_TRUE(again.restore(t));
+  TEST_ASSERT_EQUAL_UINT64(4, t.imported);
+}
+
+// one sector: the totals go out through onErase before the only copy is erased
+void test_log_single_sector() {
+  RamFlash flash(1);
+  EnergyLog log(flash);
+  energyTotals t, saved = {};
+  log.restore(t);
+  log.onErase([&](const energyTotals & totals) { saved = totals; });
+  for (uint64_t i = 1; i <= ENERGY_RECORDS_PER_SECTOR + 1; i++) log.persist({ i, 0 }, 0);
+  TEST_ASSERT_EQUAL(2, flash.erases[0]);
+  TEST_ASSERT_EQUAL_UINT64(ENERGY_RECORDS_PER_SECTOR + 1, saved.imported);
+  EnergyLog after(flash);
+  TEST_ASSERT_TRUE(after.restore(t));
+  TEST_ASSERT_EQUAL_UINT64(ENERGY_RECORDS_PER_SECTOR + 1, t.imported);
+}
+
+// two sectors: a reset right after the erase of the next one, the previous one has the totals
+void test_log_two_sectors() {
+  RamFlash flash(2);
+  EnergyLog log(flash);
+  energyTotals t;
+  log.restore(t);
+  for (uint64_t i = 1; i <= ENERGY_RECORDS_PER_SECTOR; i++) log.persist({ i, 0 }, 0);
+  flash.tearAfter = 0;
+  TEST_ASSERT_FALSE(log.persist({ ENERGY_RECORDS_PER_SECTOR + 1, 0 }, 0));
+  flash.tearAfter = -1;
+  TEST_ASSERT_EQUAL(1, flash.erases[1]);
+
+  EnergyLog after(flash);
+  TEST_ASSERT_TRUE(after.restore(t));
+  TEST_ASSERT_EQUAL_UINT64(ENERGY_RECORDS_PER_SECTOR, t.imported);
+  TEST_ASSERT_TRUE(after.persist({ ENERGY_RECORDS_PER_SECTOR + 2, 0 }, 0));
+  EnergyLog again(flash);
+  TEST_ASSERT_TRUE(again.restore(t));
+  TEST_ASSERT_EQUAL_UINT64(ENERGY_RECORDS_PER_SECTOR + 2, t.imported);
+}
+
+// 30 days of the profile with the default write policy: writes per day and erases per sector
+void test_log_wear() {
+  RamFlash flash(4);
+  EnergyLog log(flash);
+  EnergyIntegrator e;
+  energyTotals t;
+  log.restore(t);
+  e.begin({});
+  uint32_t seed = 7;
+  const ulong days = 30;
+  energyTotals lastWritten = {};
+  for (ulong ms = 0; ms < days * 86400000UL; ms = nextSample(ms, seed)) {
+    e.sample(power(ms / 1000.0), ms);
+    if (log.due(e.totals(), ms)) {
+      TEST_ASSERT_TRUE(log.persist(e.totals(), ms));
+      lastWritten = e.totals();
+    }
+  }
+  uint32_t minErases = flash.erases[0], maxErases = flash.erases[0];
+  for (auto n : flash.erases) {
+    minErases = min(minErases, n);
+    maxErases = max(maxErases, n);
+  }
+  char msg[96];
+  snprintf(msg, sizeof(msg), "%.1f writes/day, %.2f erases/day, %u..%u erases per sector",
+           log.stats().writes / (double) days, log.stats().erases / (double) days, minErases, maxErases);
+  TEST_MESSAGE(msg);
+  // a write per 15 minutes, and one per kWh on top
+  double kWh = e.importedKWh() + e.exportedKWh();
+  TEST_ASSERT_LESS_OR_EQUAL(days * 96 + kWh, log.stats().writes);
+  TEST_ASSERT_LESS_OR_EQUAL(1, maxErases - minErases);
+
+  EnergyLog after(flash);
+  TEST_ASSERT_TRUE(after.restore(t));
+  TEST_ASSERT_EQUAL_MEMORY(&lastWritten, &t, sizeof(t));
+}
+
+// the main loop on a line we serve: a poll every 20 ms, the log writes only when the bus is idle,
+// which it is between the polls
+void test_log_between_polls() {
+  static SimBus line;
+  static SoftwareSerial slaveSide(line), masterSide(line);
+  static SoftwareRtu rtu(slaveSide);
+  static DTSU666 meter(1);
+  meter.begin(&rtu, -1, 1);
+  masterSide.begin(9600);
+
+  RamFlash flash(2);
+  EnergyLog log(flash);
+  energyTotals t;
+  log.restore(t);
+  log.setPolicy(50, ENERGY_LOG_DELTA);
+  uint8_t poll[8] = { 1, Modbus::FC_READ_REGS, 0x20, 0x12, 0, 2 };
+  size_t pollLen = appendCrc(poll, 6);
+  uint32_t polls = 0, writesWaiting = 0;
+  ulong start = millis(), lastPoll = 0;
+  for (ulong now = start; now - start < 500; now = millis()) {
+    if (now - lastPoll >= 20) {
+      masterSide.write(poll, pollLen);
+      masterSide.flush();
+      lastPoll = now;
+      polls++;
+    }
+    bool waiting = slaveSide.available() > 0;
+    if (meter.isIdle() && log.due({ now, 0 }, now)) {
+      if (waiting) writesWaiting++;
+      log.persist({ now, 0 }, now);
+    }
+    meter.task();
+    while (masterSide.available()) masterSide.read();
+  }
+  TEST_ASSERT_GREATER_OR_EQUAL(20, polls);
+  TEST_ASSERT_EQUAL(polls, meter.stats().responses);
+  TEST_ASSERT_GREATER_OR_EQUAL(5, log.stats().writes);
+  TEST_ASSERT_EQUAL(0, writesWaiting);
+}
+
+int main() {
+  Serial.mute(true);
+  UNITY_BEGIN();
+  RUN_TEST(test_constant_power);
+  RUN_TEST(test_zero_crossing);
+  RUN_TEST(test_gaps_and_stale);
+  RUN_TEST(test_integration_error);
+  RUN_TEST(test_log_restore);
+  RUN_TEST(test_log_torn_write);
+  RUN_TEST(test_log_single_sector);
+  RUN_TEST(test_log_two_sectors);
+  RUN_TEST(test_log_wear);
+  RUN_TEST(test_log_between_polls);
+  return UNITY_END();
+}
@@ -0,0 +1,271 @@
+/**
+ * @file    test_estimator.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the estimators and the freshness of the meter: PV traces sampled every
+ *          5 s and polled every second, with the tracking error of each mode, the estimates in
+ *          a read of the meter, and the exception once the source went silent.
+ *          Run with: pio test -e native -f test_estimator
+ *          A recorded trace, lines of "<ms> <W>", is replayed with PV_TRACE=<file>.
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <math.h>
+#include <vector>
+#include <fstream>
+#include <DTSU666.h>
+#include <Estimator.h>
+#include <SoftwareSerial.h>
+
+typedef struct tracePoint {
+  ulong   ms;
+  float   watts;
+} tracePoint;
+
+typedef std::vector<tracePoint> trace;
+
+static uint32_t nextRandom(uint32_t & seed) {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+// the PV power at t, between the points of the trace
+static float truthAt(const trace & tr, ulong ms) {
+  if (ms <= tr.front().ms) return tr.front().watts;
+  if (ms >= tr.back().ms) return tr.back().watts;
+  size_t hi = 1;
+  while (tr[hi].ms < ms) hi++;
+  const tracePoint & a = tr[hi - 1], & b = tr[hi];
+  return a.watts + (b.watts - a.watts) * (ms - a.ms) / (float) (b.ms - a.ms);
+}
+
+// an hour of a clear morning, the panels go from 500 W to 3500 W
+static trace morning() {
+  trace tr;
+  for (ulong s = 0; s <= 3600; s++) tr.push_back({ s * 1000, (float) (500 + 3000 * sin(M_PI / 2 * s / 3600.0)) });
+  return tr;
+}
+
+// an hour of passing clouds: every 20 to 80 s the sun goes in or out, in 2 to 10 s
+static trace clouds() {
+  trace tr;
+  uint32_t seed = 7;
+  float level = 3000;
+  for (ulong s = 0; s <= 3600; ) {
+    tr.push_back({ s * 1000, level });
+    s += 20 + nextRandom(seed) % 60;
+    tr.push_back({ s * 1000, level });
+    level = level > 2000 ? 600 + nextRandom(seed) % 800 : 2600 + nextRandom(seed) % 800;
+    s += 2 + nextRandom(seed) % 8;
+  }
+  return tr;
+}
+
+typedef struct trackingError {
+  double  rms;
+  float   max;
+  float   lo, hi;     // of the estimates
+} trackingError;
+
+// the dongle publishes every 5 s give or take a second, the battery reads every second
+static trackingError track(const trace & tr, const estimatorConfig & config) {
+  Estimator e;
+  e.begin(config);
+  uint32_t seed = 1;
+  ulong published = 0;
+  double sum = 0;
+  size_t n = 0;
+  trackingError r = { 0, 0, INFINITY, -INFINITY };
+  for (ulong poll = 0; poll <= tr.back().ms; poll += 1000) {
+    while (published <= poll) {
+      e.sample(truthAt(tr, published), published);
+      published += 4000 + nextRandom(seed) % 2000;
+    }
+    float served = e.estimate(poll);
+    float error = served - truthAt(tr, poll);
+    sum += error * error;
+    n++;
+    r.max = max(r.max, fabsf(error));
+    r.lo = min(r.lo, served);
+    r.hi = max(r.hi, served);
+  }
+  r.rms = sqrt(sum / n);
+  return r;
+}
+
+static const estimatorMode modes[] = { EST_HOLD, EST_LINEAR, EST_ALPHA_BETA };
+static const char * modeNames[] = { "hold", "linear", "alpha-beta" };
+
+static void report(const char * name, const trace & tr, trackingError * errors) {
+  for (size_t m = 0; m < 3; m++) {
+    errors[m] = track(tr, estimatorOf(modes[m], 0, 4000));
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%-10s %-10s rms %6.1f W  max %6.1f W  served %6.1f .. %6.1f W",
+             name, modeNames[m], errors[m].rms, errors[m].max, errors[m].lo, errors[m].hi);
+    TEST_MESSAGE(msg);
+  }
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_modes() {
+  Estimator e;
+  e.begin(estimatorOf(EST_LINEAR, -100, 1000, 3000));
+  e.sample(100, 10000);
+  TEST_ASSERT_EQUAL_FLOAT(100, e.estimate(12000));     // one sample: held
+  e.sample(200, 15000);                                // 20 W/s
+  TEST_ASSERT_EQUAL_FLOAT(200, e.estimate(15000));
+  TEST_ASSERT_EQUAL_FLOAT(240, e.estimate(17000));
+  TEST_ASSERT_EQUAL_FLOAT(260, e.estimate(30000));     // not past the horizon
+  TEST_ASSERT_EQUAL_FLOAT(200, e.estimate(14000));     // nor before the sample
+  e.sample(900, 16000);
+  TEST_ASSERT_EQUAL_FLOAT(1000, e.estimate(17000));    // clamped
+  e.sample(NAN, 17000);
+  TEST_ASSERT_EQUAL_FLOAT(900, e.estimate(16000));
+
+  e.begin(estimatorOf(EST_HOLD));
+  e.sample(100, 0);
+  e.sample(200, 5000);
+  TEST_ASSERT_EQUAL_FLOAT(200, e.estimate(8000));
+
+  // a constant rate is tracked without error
+  e.begin(estimatorOf(EST_ALPHA_BETA));
+  for (ulong ms = 0; ms <= 60000; ms += 5000) e.sample(ms / 100.0f, ms);
+  TEST_ASSERT_FLOAT_WITHIN(0.5f, 620, e.estimate(62000));
+}
+
+void test_trace_morning() {
+  trackingError errors[3];
+  report("morning", morning(), errors);
+  // a ramp: the lag of hold is gone
+  TEST_ASSERT_TRUE(errors[1].rms < errors[0].rms / 4);
+  TEST_ASSERT_TRUE(errors[2].rms < errors[0].rms / 4);
+}
+
+void test_trace_clouds() {
+  trackingError errors[3];
+  report("clouds", clouds(), errors);
+  // a step can not be predicted: the estimates overshoot it, never out of the clamp, and do
+  // not do much worse than hold. The filter overshoots less than the line
+  for (size_t m = 0; m < 3; m++) {
+    TEST_ASSERT_TRUE(errors[m].lo >= 0 && errors[m].hi <= 4000);
+    TEST_ASSERT_TRUE(errors[m].rms < errors[0].rms * 1.2);
+  }
+  TEST_ASSERT_TRUE(errors[2].lo > errors[1].lo && errors[2].hi < errors[1].hi);
+}
+
+// a recorded trace, if there is one
+void test_trace_file() {
+  const char * path = getenv("PV_TRACE");
+  if (path == nullptr) {
+    TEST_MESSAGE("no PV_TRACE, skipped");
+    return;
+  }
+  std::ifstream in(path);
+  TEST_ASSERT_TRUE(in.good());
+  trace tr;
+  unsigned long ms, first = 0;
+  float watts;
+  while (in >> ms >> watts) {
+    if (tr.empty()) first = ms;
+    tr.push_back({ ms - first, watts });
+  }
+  TEST_ASSERT_TRUE(tr.size() > 1);
+  trackingError errors[3];
+  report(path, tr, errors);
+}
+
+SimBus          bus;
+SoftwareSerial  slaveLine(bus);
+SoftwareSerial  masterLine(bus);
+SoftwareRtu     slaveRtu(slaveLine);
+DTSU666         meter(1);
+
+static float readFloat(word address) {
+  uint8_t scratch[4];
+  const uint8_t * data;
+  TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, meter.readView(Modbus::FC_READ_REGS, address, 2, data, scratch));
+  return DTSU666::encoding::get((data[0] << 8) | data[1], (data[2] << 8) | data[3]);
+}
+
+// a sample of the source, measured ago ms
+static void sampleAt(word address, float value, ulong ago) {
+  meter.beginUpdate();
+  meter.sourceTime(millis() - ago);
+  meter.setValue(address, value);
+  meter.commit();
+}
+
+// the estimate goes into the read, and into the derived registers it covers
+void test_meter_estimate() {
+  meter.begin(&slaveRtu, -1, 1);
+  TEST_ASSERT_TRUE(meter.estimate(0x2014, estimatorOf(EST_LINEAR)));
+  TEST_ASSERT_FALSE(meter.estimate(REG_BAUD, estimatorOf(EST_LINEAR)));
+  TEST_ASSERT_FALSE(meter.estimate(0x2015, estimatorOf(EST_LINEAR)));
+  sampleAt(0x2016, 500, 2000);
+  sampleAt(0x2014, 1000, 2000);
+  sampleAt(0x2014, 1100, 1000);      // 100 W/s
+
+  TEST_ASSERT_FLOAT_WITHIN(50, 12000, readFloat(0x2014));
+  TEST_ASSERT_FLOAT_WITHIN(50, 17000, readFloat(REG_PT));   // Pa + Pb, 0.1 W
+  TEST_ASSERT_FLOAT_WITHIN(5, 1200, meter.getValue(0x2014));
+  ulong age;
+  TEST_ASSERT_TRUE(meter.sourceAge(0x2014, age));
+  TEST_ASSERT_TRUE(age >= 1000 && age < 1100);
+  TEST_ASSERT_TRUE(meter.sourceAge(REG_PT, age));          // its oldest input
+  TEST_ASSERT_TRUE(age >= 2000 && age < 2100);
+  TEST_ASSERT_FALSE(meter.sourceAge(0x2044, age));         // a default
+
+  // the sample replaces the estimate
+  sampleAt(0x2014, 800, 0);
+  TEST_ASSERT_FLOAT_WITHIN(0.5f, 800, meter.getValue(0x2014));
+  meter.estimate(0x2014, estimatorOf(EST_HOLD));
+}
+
+void test_meter_stale() {
+  meter.begin(&slaveRtu, -1, 1);
+  meter.staleAfter(1000);
+  uint8_t scratch[0x46 * 2];
+  const uint8_t * data;
+  // nothing from the source yet, the defaults are served
+  TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, meter.readView(Modbus::FC_READ_REGS, 0x2000, 0x46, data, scratch));
+  sampleAt(0x2014, 1000, 1500);
+  TEST_ASSERT_EQUAL(Modbus::EX_SLAVE_FAILURE, meter.readView(Modbus::FC_READ_REGS, 0x2000, 0x46, data, scratch));
+  TEST_ASSERT_EQUAL(Modbus::EX_SLAVE_FAILURE, meter.readView(Modbus::FC_READ_REGS, REG_PT, 2, data, scratch));
+  TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, meter.readView(Modbus::FC_READ_REGS, 0x2044, 2, data, scratch));
+  TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, meter.readView(Modbus::FC_READ_REGS, 0x0, 0x2f, data, scratch));
+  TEST_ASSERT_EQUAL(2, meter.stats().stale);
+
+  // and over the line
+  uint8_t frame[8] = { 1, Modbus::FC_READ_REGS, 0x20, 0x12, 0, 2 };
+  masterLine.write(frame, appendCrc(frame, 6));
+  masterLine.flush();
+  meter.task();
+  uint8_t response[5];
+  size_t len = 0;
+  while (masterLine.available() && len < sizeof(response)) response[len++] = masterLine.read();
+  TEST_ASSERT_EQUAL(5, len);
+  TEST_ASSERT_EQUAL(Modbus::FC_READ_REGS | 0x80, response[1]);
+  TEST_ASSERT_EQUAL(Modbus::EX_SLAVE_FAILURE, response[2]);
+
+  // the same value again is fresh data
+  sampleAt(0x2014, 1000, 0);
+  TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, meter.readView(Modbus::FC_READ_REGS, 0x2000, 0x46, data, scratch));
+  meter.staleAfter(0);
+}
+
+int main() {
+  Serial.mute(true);
+  UNITY_BEGIN();
+  RUN_TEST(test_modes);
+  RUN_TEST(test_trace_morning);
+  RUN_TEST(test_trace_clouds);
+  RUN_TEST(test_trace_file);
+  RUN_TEST(test_meter_estimate);
+  RUN_TEST(test_meter_stale);
+  return UNITY_END();
+}
@@ -0,0 +1,242 @@
+/**
+ * @file    test_history.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the history: the raw ring, the rollups and their gaps, the paged
+ *          register window and the dump, and the recording on commit by the meter.
+ *          Run with: pio test -e native -f test_history
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <DTSU666.h>
+#include <History.h>
+#include <SoftwareSerial.h>
+
+// memory is fixed at compile time, and stays small
+static_assert(sizeof(History) < 4096, "history too large");
+
+static const historyChannel channels[] = { { 0x2012, 1 }, { 0x2006, 10 } };
+
+static History  history(channels, 2);
+
+static word reg(History & h, word address, ulong now) {
+  uint8_t data[2];
+  TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, h.read(address, 1, data, now));
+  return (data[0] << 8) | data[1];
+}
+
+// Pt ramps 0, 1, 2 .. W one sample per second, U stays at 230.4 V
+static void ramp(History & h, ulong fromMs, size_t seconds) {
+  for (size_t s = 0; s < seconds; s++) {
+    float values[] = { (float) (fromMs / 1000 + s), 230.4f };
+    h.sample(values, fromMs + s * 1000);
+  }
+}
+
+void setUp() {
+  history = History(channels, 2);
+}
+
+void tearDown() {}
+
+void test_rollups() {
+  ramp(history, 0, 125);
+  ulong now = 125000;
+  // 10 s: 12 closed buckets, newest first: 110..119
+  TEST_ASSERT_EQUAL(12, reg(history, HISTORY_BASE + 4 + 2, now));
+  word b = HISTORY_LEVEL_BASE(0);
+  TEST_ASSERT_EQUAL(10, reg(history, b, now));
+  TEST_ASSERT_EQUAL(110, reg(history, b + 1, now));
+  TEST_ASSERT_EQUAL(119, reg(history, b + 2, now));
+  TEST_ASSERT_EQUAL(115, reg(history, b + 3, now));    // 114.5, rounded
+  TEST_ASSERT_EQUAL(2304, reg(history, b + 4, now));
+  TEST_ASSERT_EQUAL(2304, reg(history, b + 6, now));
+  // the oldest one: 0..9
+  b += 11 * HISTORY_BUCKET_REGS;
+  TEST_ASSERT_EQUAL(0, reg(history, b + 1, now));
+  TEST_ASSERT_EQUAL(9, reg(history, b + 2, now));
+  TEST_ASSERT_EQUAL(5, reg(history, b + 3, now));
+
+  // 1 min: 0..59 and 60..119
+  TEST_ASSERT_EQUAL(2, reg(history, HISTORY_BASE + 8 + 2, now));
+  b = HISTORY_LEVEL_BASE(1);
+  TEST_ASSERT_EQUAL(60, reg(history, b, now));
+  TEST_ASSERT_EQUAL(60, reg(history, b + 1, now));
+  TEST_ASSERT_EQUAL(119, reg(history, b + 2, now));
+  TEST_ASSERT_EQUAL(90, reg(history, b + 3, now));
+  TEST_ASSERT_EQUAL(5, reg(history, HISTORY_BASE + 8 + 3, now));   // closed at 120 s
+  // 15 min: nothing closed yet
+  TEST_ASSERT_EQUAL(0, reg(history, HISTORY_BASE + 12 + 2, now));
+  TEST_ASSERT_EQUAL((word) HISTORY_NO_DATA, reg(history, HISTORY_LEVEL_BASE(2) + 1, now));
+}
+
+void test_gaps() {
+  float values[] = { 100, 230 };
+  history.sample(values, 1000);
+  history.sample(values, 45000);     // 10..39 s had no samples
+  ulong now = 45000;
+  TEST_ASSERT_EQUAL(4, reg(history, HISTORY_BASE + 4 + 2, now));
+  word b = HISTORY_LEVEL_BASE(0);
+  for (int k = 0; k < 3; k++) {
+    TEST_ASSERT_EQUAL(0, reg(history, b + k * HISTORY_BUCKET_REGS, now));
+    TEST_ASSERT_EQUAL((word) HISTORY_NO_DATA, reg(history, b + k * HISTORY_BUCKET_REGS + 1, now));
+  }
+  TEST_ASSERT_EQUAL(1, reg(history, b + 3 * HISTORY_BUCKET_REGS, now));
+  TEST_ASSERT_EQUAL(100, reg(history, b + 3 * HISTORY_BUCKET_REGS + 3, now));
+
+  // a gap longer than the ring: one ring of empty buckets, not one per period
+  history.sample(values, 4000000);
+  TEST_ASSERT_EQUAL(24, reg(history, HISTORY_BASE + 4 + 2, now));
+  TEST_ASSERT_EQUAL(0, reg(history, b, 4000000));
+}
+
+void test_raw() {
+  ramp(history, 0, 40);
+  ulong now = 40000;
+  TEST_ASSERT_EQUAL(HISTORY_RAW, reg(history, HISTORY_BASE + 2, now));
+  TEST_ASSERT_EQUAL(40, reg(history, HISTORY_BASE + 0x11, now));
+  // newest first, with its age
+  TEST_ASSERT_EQUAL(1, reg(history, HISTORY_RAW_BASE, now));
+  TEST_ASSERT_EQUAL(39, reg(history, HISTORY_RAW_BASE + 1, now));
+  TEST_ASSERT_EQUAL(2304, reg(history, HISTORY_RAW_BASE + 2, now));
+  word last = HISTORY_RAW_BASE + (HISTORY_RAW - 1) * HISTORY_RAW_REGS;
+  TEST_ASSERT_EQUAL(32, reg(history, last, now));
+  TEST_ASSERT_EQUAL(8, reg(history, last + 1, now));
+  // the channels that are not used
+  TEST_ASSERT_EQUAL((word) HISTORY_NO_DATA, reg(history, HISTORY_RAW_BASE + 3, now));
+
+  // saturated, not wrapped
+  float big[] = { 100000, -5000 };
+  history.sample(big, 41000);
+  TEST_ASSERT_EQUAL(32767, reg(history, HISTORY_RAW_BASE + 1, now));
+  TEST_ASSERT_EQUAL((word) -32767, reg(history, HISTORY_RAW_BASE + 2, now));
+}
+
+void test_paged_read() {
+  ramp(history, 0, 250);
+  ulong now = 250000;
+  uint8_t page[125 * 2];
+  TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, history.read(HISTORY_BASE, HISTORY_HEADER, page, now));
+  TEST_ASSERT_EQUAL(2, page[1]);                          // channels
+  TEST_ASSERT_EQUAL(HISTORY_LEVELS, page[7]);
+  TEST_ASSERT_EQUAL(10, page[9]);                         // period of level 0, s
+  TEST_ASSERT_EQUAL(0x20, page[0x18 * 2]);                // the register of channel 0
+  TEST_ASSERT_EQUAL(0x12, page[0x18 * 2 + 1]);
+  TEST_ASSERT_EQUAL(10, page[0x21 * 2 + 1]);              // the scale of channel 1
+  uint32_t samples = (page[0x20] << 24) | (page[0x21] << 16) | (page[0x22] << 8) | page[0x23];
+  TEST_ASSERT_EQUAL(250, samples);
+
+  // level 0 in pages, the buckets line up with the registers
+  word start = HISTORY_LEVEL_BASE(0), end = start + 24 * HISTORY_BUCKET_REGS;
+  for (word a = start; a < end; a += 125) {
+    word n = min((word) 125, (word) (end - a));
+    TEST_ASSERT_EQUAL(Modbus::EX_SUCCESS, history.read(a, n, page, now));
+    for (word r = 0; r < n; r++) {
+      if ((a + r - start) % HISTORY_BUCKET_REGS == 0) TEST_ASSERT_EQUAL(10, (page[r * 2] << 8) | page[r * 2 + 1]);
+    }
+  }
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_VALUE, history.read(HISTORY_BASE, 126, page, now));
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_ADDRESS, history.read(HISTORY_END - 2, 4, page, now));
+}
+
+void test_dump() {
+  ramp(history, 0, 25);
+  uint8_t buf[1500];
+  size_t n = history.dump(0, buf, sizeof(buf), 25000);
+  TEST_ASSERT_EQUAL(4 + HISTORY_HEADER * 2, n);
+  TEST_ASSERT_EQUAL(0, buf[0]);
+  TEST_ASSERT_EQUAL(HISTORY_BASE >> 8, buf[2]);
+  // only the records that hold data
+  TEST_ASSERT_EQUAL(4 + 25 * HISTORY_RAW_REGS * 2, history.dump(1, buf, sizeof(buf), 25000));
+  TEST_ASSERT_EQUAL(HISTORY_RAW_BASE & 0xff, buf[3]);
+  TEST_ASSERT_EQUAL(4 + 2 * HISTORY_BUCKET_REGS * 2, history.dump(2, buf, sizeof(buf), 25000));
+  TEST_ASSERT_EQUAL(10, buf[5]);
+  TEST_ASSERT_EQUAL(4, history.dump(3, buf, sizeof(buf), 25000));
+  TEST_ASSERT_EQUAL(0, history.dump(History::numParts(), buf, sizeof(buf), 25000));
+  TEST_ASSERT_EQUAL(0, history.dump(1, buf, 100, 25000));
+}
+
+SimBus          bus;
+SoftwareSerial  slaveLine(bus);
+SoftwareSerial  masterLine(bus);
+SoftwareRtu     slaveRtu(slaveLine);
+DTSU666         meter(1);
+History         meterHistory(DTSU666History, ARRAY_SIZE(DTSU666History));
+
+// the meter records on commit, when a channel changed. Pt is derived from the phases
+void test_meter_commit() {
+  meter.begin(&slaveRtu, -1, 1);
+  meter.history(&meterHistory);
+  meter.beginUpdate();
+  meter.setValue(0x2014, 1000);
+  meter.setValue(0x2016, 1100);
+  meter.setValue(0x2018, 1200);
+  meter.setValue(0x2006, 231.2);
+  meter.commit();
+  TEST_ASSERT_EQUAL(1, meterHistory.samples());
+
+  // the energy totals are not in the history
+  meter.setValue(REG_IMPEP, 12.5);
+  TEST_ASSERT_EQUAL(1, meterHistory.samples());
+  meter.setValue(0x2016, 900);
+  TEST_ASSERT_EQUAL(2, meterHistory.samples());
+
+  // read by the master like any register
+  uint8_t frame[8] = { 1, Modbus::FC_READ_REGS, HISTORY_RAW_BASE >> 8, HISTORY_RAW_BASE & 0xff, 0, HISTORY_RAW_REGS };
+  masterLine.write(frame, appendCrc(frame, 6));
+  masterLine.flush();
+  meter.task();
+  uint8_t response[5 + 2 * HISTORY_RAW_REGS];
+  size_t len = 0;
+  while (masterLine.available() && len < sizeof(response)) response[len++] = masterLine.read();
+  TEST_ASSERT_EQUAL(sizeof(response), len);
+  TEST_ASSERT_EQUAL(0, crc16(response, len));
+  TEST_ASSERT_EQUAL(3100, (response[5] << 8) | response[6]);    // Pt
+  TEST_ASSERT_EQUAL(900, (response[9] << 8) | response[10]);    // Pb
+  TEST_ASSERT_EQUAL(2312, (response[13] << 8) | response[14]);  // Ua
+  TEST_ASSERT_EQUAL(4999, (response[19] << 8) | response[20]);  // Freq, the default
+  meter.history(nullptr);
+}
+
+// the dump as in loop(): a part per pass, only when the bus is idle, between the polls
+void test_dump_between_polls() {
+  meter.begin(&slaveRtu, -1, 1);
+  masterLine.begin(9600);
+  uint8_t poll[8] = { 1, Modbus::FC_READ_REGS, 0x20, 0x12, 0, 2 };
+  size_t pollLen = appendCrc(poll, 6);
+  static uint8_t buf[History::maxDump()];
+  uint8_t part = 0;
+  size_t dumped = 0;
+  uint32_t polls = 0, responses = meter.stats().responses;
+  ulong start = millis(), lastPoll = 0;
+  for (ulong now = start; now - start < 200; now = millis()) {
+    if (now - lastPoll >= 10) {
+      masterLine.write(poll, pollLen);
+      masterLine.flush();
+      lastPoll = now;
+      polls++;
+    }
+    meter.task();
+    while (masterLine.available()) masterLine.read();
+    if (meter.isIdle() && part < History::numParts()) dumped += meterHistory.dump(part++, buf, sizeof(buf), now);
+  }
+  TEST_ASSERT_EQUAL(History::numParts(), part);
+  TEST_ASSERT_TRUE(dumped > 0);
+  TEST_ASSERT_EQUAL(responses + polls, meter.stats().responses);
+}
+
+int main() {
+  Serial.mute(true);
+  UNITY_BEGIN();
+  RUN_TEST(test_rollups);
+  RUN_TEST(test_gaps);
+  RUN_TEST(test_raw);
+  RUN_TEST(test_paged_read);
+  RUN_TEST(test_dump);
+  RUN_TEST(test_meter_commit);
+  RUN_TEST(test_dump_between_polls);
+  return UNITY_END();
+}
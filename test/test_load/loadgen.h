@@ -0,0 +1,182 @@
+/**
+ * @file    loadgen.h
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   A Modbus master for load tests: sends a schedule of frames, synthetic or replayed
+ *          from a capture, on a simulated line and measures what comes back.
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#pragma once
+#include <Arduino.h>
+#include <unity.h>
+#include <SoftwareSerial.h>
+#include <ModbusCrc.h>
+#include <Metrics.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define LOAD_TIMEOUT_US   50000UL   // no response by then: dropped
+#define LOAD_GRACE_TASKS  4         // task() calls after the last frame, to catch late or unexpected responses
+
+typedef std::vector<uint8_t> loadBytes;
+
+typedef struct loadFrame {
+  ulong     atUs;         // since the start of the run, not before the previous exchange is done
+  bool      backToBack;   // sent right after the previous frame, before the meter had its turn
+  loadBytes bytes;        // crc included
+} loadFrame;
+
+typedef struct loadReport {
+  uint32_t  frames;       // sent
+  uint32_t  expected;     // for one of our slave ids, with a good crc
+  uint32_t  responses;
+  uint32_t  dropped;      // expected, but no response
+  uint32_t  unexpected;   // a response nobody asked for
+  uint32_t  corrupt;      // bad crc, or not from the slave asked
+  double    seconds;
+  histogram latency;      // end of the request to the response, us
+
+  double    fps() const   { return seconds > 0 ? frames / seconds : 0; }
+} loadReport;
+
+// a read request, crc included
+static inline loadBytes readFrame(uint8_t slaveId, word start, word count, uint8_t fc = 0x03) {
+  uint8_t frame[8] = { slaveId, fc, (uint8_t) (start >> 8), (uint8_t) start, (uint8_t) (count >> 8), (uint8_t) count };
+  return loadBytes(frame, frame + appendCrc(frame, 6));
+}
+
+// time on the line for a request and its response, silent intervals included
+static inline ulong exchangeUs(uint32_t baud, size_t requestLen, size_t responseLen) {
+  ulong charUs = 10 * 1000000UL / baud;
+  return (requestLen + responseLen + 2 * 4) * charUs;
+}
+
+/**
+ * @brief The master end of the line. serve() gives the meter its turn, one task() of the bus.
+ *  A frame waits for the response to the one before it, or for its time-out, like a master
+ *  does, unless it is sent back to back. The simulated line keeps the frame boundaries of
+ *  a back to back burst; on a real line those frames would only be apart if the master
+ *  keeps the 3.5 character silence between them.
+ */
+class LoadGenerator {
+public:
+  LoadGenerator(SoftwareSerial & line, std::function<void()> serve, std::vector<uint8_t> slaveIds)
+    : _line(line), _serve(serve), _ids(slaveIds) {}
+
+  loadReport run(const std::vector<loadFrame> & frames, std::vector<loadBytes> * responses = nullptr) {
+    loadReport r = {};
+    std::deque<pending> waiting;
+    ulong start = micros();
+    ulong progress = start;
+    size_t next = 0;
+    size_t grace = 0;
+
+    while (true) {
+      ulong now = micros();
+      if (next < frames.size() && (frames[next].backToBack || (waiting.empty() && now - start >= frames[next].atUs))) {
+        const loadFrame & f = frames[next++];
+        _line.write(f.bytes.data(), f.bytes.size());
+        _line.flush();
+        r.frames++;
+        if (expects(f.bytes)) {
+          waiting.push_back({ micros(), f.bytes[0] });
+          r.expected++;
+        }
+        progress = micros();
+        continue;
+      }
+      _serve();
+      while (_line.frameAvailable()) {
+        loadBytes response(_line.frameAvailable());
+        for (auto & c : response) c = _line.read();
+        now = micros();
+        progress = now;
+        if (waiting.empty()) {
+          r.unexpected++;
+          continue;
+        }
+        r.responses++;
+        r.latency.record(now - waiting.front().sentAt);
+        if (crc16(response.data(), response.size()) != 0 || response[0] != waiting.front().slaveId) r.corrupt++;
+        waiting.pop_front();
+        if (responses != nullptr) responses->push_back(response);
+      }
+      if (!waiting.empty() && micros() - progress > LOAD_TIMEOUT_US) {
+        r.dropped += waiting.size();
+        waiting.clear();
+      }
+      if (next == frames.size() && waiting.empty() && ++grace > LOAD_GRACE_TASKS) break;
+    }
+    r.seconds = (micros() - start) / 1e6;
+    return r;
+  }
+
+  static void print(const char * name, const loadReport & r) {
+    char msg[160];
+    snprintf(msg, sizeof(msg), "%-12s %6u frames %8.0f fps  latency p50 %5u p99 %5u max %5u us  dropped %u unexpected %u",
+             name, (unsigned) r.frames, r.fps(), (unsigned) r.latency.percentile(50), (unsigned) r.latency.percentile(99),
+             (unsigned) r.latency.max, (unsigned) r.dropped, (unsigned) r.unexpected);
+    TEST_MESSAGE(msg);
+  }
+
+private:
+  typedef struct pending {
+    ulong   sentAt;
+    uint8_t slaveId;
+  } pending;
+
+  // a good crc and one of our ids: the meter must answer
+  bool expects(const loadBytes & f) {
+    if (f.size() < 4 || crc16(f.data(), f.size()) != 0) return false;
+    for (uint8_t id : _ids) if (id == f[0]) return true;
+    return false;
+  }
+
+  SoftwareSerial &          _line;
+  std::function<void()>     _serve;
+  std::vector<uint8_t>      _ids;
+};
+
+/**
+ * @brief A capture as FrameCapture::drain() writes it: "<micros> R|T <hex>" per line. The
+ *  received frames become the schedule, at their recorded pace times speed (0: as fast as the
+ *  meter goes), the sent ones the responses to compare with. Other lines, e.g. the log on the
+ *  same serial port, are skipped. False if there is nothing to replay
+ */
+static inline bool parseCapture(const std::string & text, std::vector<loadFrame> & requests,
+                                std::vector<loadBytes> & responses, double speed = 1.0) {
+  size_t pos = 0;
+  bool first = true;
+  uint32_t firstUs = 0;
+  while (pos < text.size()) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string::npos) end = text.size();
+    std::string line = text.substr(pos, end - pos);
+    pos = end + 1;
+    if (line.empty() || line[0] == '#') continue;
+
+    unsigned long us;
+    char dir;
+    char hex[2 * 256 + 1];
+    if (sscanf(line.c_str(), "%lu %c %512s", &us, &dir, hex) != 3 || strlen(hex) % 2 != 0) continue;
+    if (strspn(hex, "0123456789ABCDEFabcdef") != strlen(hex)) continue;
+    loadBytes bytes;
+    for (size_t i = 0; hex[i] != 0; i += 2) {
+      unsigned b;
+      sscanf(hex + i, "%2x", &b);
+      bytes.push_back(b);
+    }
+    if (dir == 'T') {
+      responses.push_back(bytes);
+    } else if (dir == 'R') {
+      if (first) firstUs = us;
+      first = false;
+      // micros() wraps, the difference does not
+      requests.push_back({ (ulong) (((uint32_t) us - firstUs) * speed), false, bytes });
+    }
+  }
+  return !requests.empty();
+}
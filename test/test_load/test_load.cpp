@@ -0,0 +1,250 @@
+/**
+ * @file    test_load.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Load tests of the RTU slave: polls at the pace of the line, back to back bursts,
+ *          bad crcs and other slave ids, and the replay of a capture. Each scenario reports
+ *          frames/s, the latency distribution and the dropped frames.
+ *          Run with: pio test -e native -f test_load
+ *          A capture of a real line (the serial or MQTT dump of FrameCapture) is replayed
+ *          with REPLAY_CAPTURE=<file>, at REPLAY_SPEED times its recorded pace (default 1, 0 is flat out).
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <DTSU666.h>
+#include <SoftwareSerial.h>
+#include <Capture.h>
+#include "loadgen.h"
+
+SimBus          bus;
+SoftwareSerial  slaveLine(bus);
+SoftwareSerial  masterLine(bus);
+SoftwareRtu     slaveRtu(slaveLine);
+SoftwareRtu     masterRtu(masterLine);
+DTSU666         meter(1);
+FrameCapture    capture;
+
+LoadGenerator   master(masterLine, [] { meter.task(); }, { 1 });
+
+// the battery's favourite windows
+static const word windows[][2] = {
+  { 0x2000, 0x46 }, { 0x2012, 8 }, { 0x2044, 2 }, { 0x101E, 12 }
+};
+#define NUM_WINDOWS (sizeof(windows) / sizeof(windows[0]))
+
+// polls of the windows in turn, each as soon as the line would allow it at baud
+static std::vector<loadFrame> polls(size_t n, uint32_t baud, uint8_t slaveId = 1) {
+  std::vector<loadFrame> frames;
+  ulong at = 0;
+  for (size_t i = 0; i < n; i++) {
+    const word * w = windows[i % NUM_WINDOWS];
+    frames.push_back({ at, false, readFrame(slaveId, w[0], w[1]) });
+    at += exchangeUs(baud, 8, 5 + 2 * w[1]);
+  }
+  return frames;
+}
+
+// bursts of depth frames, as fast as it goes: the first waits for the responses to the previous
+// burst, the rest follow it back to back
+static std::vector<loadFrame> bursts(size_t n, size_t depth) {
+  std::vector<loadFrame> frames = polls(n, 9600);
+  for (size_t i = 0; i < frames.size(); i++) {
+    frames[i].atUs = 0;
+    frames[i].backToBack = i % depth != 0;
+  }
+  return frames;
+}
+
+static void noDrops(const loadReport & r) {
+  TEST_ASSERT_EQUAL(0, r.dropped);
+  TEST_ASSERT_EQUAL(0, r.unexpected);
+  TEST_ASSERT_EQUAL(0, r.corrupt);
+  TEST_ASSERT_EQUAL(r.expected, r.responses);
+}
+
+void setUp() {
+  meter.begin(&slaveRtu, -1, 1);
+  masterRtu.begin(9600, RTU_8N1);
+  meter.setValue(REG_PT, 2345.6);
+  meter.setValue(0x2006, 231.4);
+  meter.bus()->capture(nullptr);
+  capture.clear();
+}
+
+void tearDown() {}
+
+void test_line_pace() {
+  loadReport r = master.run(polls(60, 38400));
+  LoadGenerator::print("38400 baud", r);
+  noDrops(r);
+  TEST_ASSERT_EQUAL(60, r.responses);
+}
+
+void test_back_to_back() {
+  loadReport r = master.run(bursts(4000, 8));
+  LoadGenerator::print("bursts of 8", r);
+  noDrops(r);
+  TEST_ASSERT_EQUAL(4000, r.responses);
+}
+
+void test_bad_crc() {
+  std::vector<loadFrame> frames = bursts(2000, 4);
+  for (size_t i = 0; i < frames.size(); i += 5) frames[i].bytes.back() ^= 0x5a;
+  loadReport r = master.run(frames);
+  LoadGenerator::print("20% bad crc", r);
+  noDrops(r);
+  TEST_ASSERT_EQUAL(1600, r.expected);
+}
+
+void test_other_slaves() {
+  std::vector<loadFrame> frames = bursts(2000, 4);
+  for (size_t i = 0; i < frames.size(); i += 3) frames[i].bytes = readFrame(2 + i % 200, 0x2000, 0x46);
+  loadReport r = master.run(frames);
+  LoadGenerator::print("other ids", r);
+  noDrops(r);
+  TEST_ASSERT_EQUAL(2000 - 667, r.expected);
+}
+
+void test_capture_format() {
+  meter.bus()->capture(&capture);
+  std::vector<loadFrame> frames = polls(3, 9600);
+  frames.push_back({ 0, false, readFrame(9, 0x2000, 2) });
+  frames[1].bytes.back() ^= 0xff;   // never reaches the callback
+  master.run(frames);
+  // 0 and 2 and their responses, and the one for slave 9
+  TEST_ASSERT_EQUAL(5, capture.captured());
+
+  // whole lines only, what does not fit stays for the next drain
+  char buf[64];
+  size_t n = capture.drain(buf, sizeof(buf));
+  TEST_ASSERT_TRUE(n > 0 && buf[n-1] == '\n');
+  TEST_ASSERT_EQUAL(1, std::count(buf, buf + n, '\n'));
+  unsigned long us;
+  char dir, hex[64];
+  TEST_ASSERT_EQUAL(3, sscanf(buf, "%lu %c %63s", &us, &dir, hex));
+  TEST_ASSERT_EQUAL('R', dir);
+  TEST_ASSERT_EQUAL_STRING("010320000046CFF8", hex);
+  // the response (145 bytes) does not fit: it goes out in parts
+  std::string line;
+  while (line.empty() || line.back() != '\n') {
+    n = capture.drain(buf, sizeof(buf));
+    TEST_ASSERT_TRUE(n > 0 && n < sizeof(buf));
+    line.append(buf, n);
+  }
+  TEST_ASSERT_EQUAL(1, std::count(line.begin(), line.end(), '\n'));
+  TEST_ASSERT_EQUAL(3, sscanf(line.c_str(), "%lu %c %63s", &us, &dir, hex));
+  TEST_ASSERT_EQUAL('T', dir);
+  TEST_ASSERT_EQUAL(2 * (3 + 2 * 0x46 + 2), line.size() - line.find(' ', line.find(' ') + 1) - 2);
+  TEST_ASSERT_EQUAL(0, capture.drain(buf, CAPTURE_DRAIN_MIN - 1));
+  while (capture.drain(buf, sizeof(buf)) > 0) {}
+  TEST_ASSERT_EQUAL(0, capture.used());
+}
+
+void test_capture_overflow() {
+  meter.bus()->capture(&capture);
+  loadReport r = master.run(bursts(100, 8));
+  noDrops(r);
+  // the ring is full long before, the meter does not notice
+  TEST_ASSERT_TRUE(capture.dropped() > 0);
+  TEST_ASSERT_EQUAL(200, capture.captured() + capture.dropped());
+}
+
+// drained as in loop(): only when the bus is idle, which it is between the polls
+void test_capture_drain_idle() {
+  meter.bus()->capture(&capture);
+  std::vector<uint8_t> poll = readFrame(1, 0x2012, 8);
+  std::string text;
+  char buf[64];
+  uint32_t polls = 0;
+  ulong start = millis(), lastPoll = 0;
+  for (ulong now = start; now - start < 300; now = millis()) {
+    if (now - lastPoll >= 10) {
+      masterLine.write(poll.data(), poll.size());
+      masterLine.flush();
+      lastPoll = now;
+      polls++;
+    }
+    meter.task();
+    while (masterLine.available()) masterLine.read();
+    if (meter.isIdle()) {
+      size_t n = capture.drain(buf, sizeof(buf));
+      text.append(buf, n);
+    }
+  }
+  TEST_ASSERT_GREATER_OR_EQUAL(20, polls);
+  TEST_ASSERT_EQUAL(0, capture.dropped());
+  TEST_ASSERT_EQUAL(2 * polls, capture.captured());
+  // all but the last exchange, that one waits for the silence after it
+  TEST_ASSERT_GREATER_OR_EQUAL(2 * (polls - 1), (size_t) std::count(text.begin(), text.end(), '\n'));
+}
+
+// capture a run, replay the capture and get the same responses
+void test_capture_replay() {
+  meter.bus()->capture(&capture);
+  std::vector<loadFrame> frames = polls(8, 115200);
+  frames.push_back({ 0, false, readFrame(3, 0x2000, 2) });
+  frames.push_back({ 0, false, readFrame(1, 0x3000, 2) });   // an exception
+  master.run(frames);
+  meter.bus()->capture(nullptr);
+  TEST_ASSERT_EQUAL(0, capture.dropped());
+
+  std::string text;
+  char buf[512];
+  while (size_t n = capture.drain(buf, sizeof(buf))) text.append(buf, n);
+
+  std::vector<loadFrame> replay;
+  std::vector<loadBytes> recorded, responses;
+  TEST_ASSERT_TRUE(parseCapture(text, replay, recorded));
+  TEST_ASSERT_EQUAL(10, replay.size());
+  TEST_ASSERT_EQUAL(9, recorded.size());
+  loadReport r = master.run(replay, &responses);
+  LoadGenerator::print("replay", r);
+  noDrops(r);
+  TEST_ASSERT_EQUAL(recorded.size(), responses.size());
+  for (size_t i = 0; i < responses.size(); i++) {
+    TEST_ASSERT_EQUAL(recorded[i].size(), responses[i].size());
+    TEST_ASSERT_EQUAL_MEMORY(recorded[i].data(), responses[i].data(), responses[i].size());
+  }
+}
+
+// a capture of a real line, if there is one
+void test_replay_file() {
+  const char * path = getenv("REPLAY_CAPTURE");
+  if (path == nullptr) {
+    TEST_MESSAGE("no REPLAY_CAPTURE, skipped");
+    return;
+  }
+  std::ifstream in(path);
+  TEST_ASSERT_TRUE(in.good());
+  std::stringstream text;
+  text << in.rdbuf();
+  double speed = getenv("REPLAY_SPEED") ? atof(getenv("REPLAY_SPEED")) : 1.0;
+
+  std::vector<loadFrame> replay;
+  std::vector<loadBytes> recorded;
+  TEST_ASSERT_TRUE(parseCapture(text.str(), replay, recorded, speed));
+  loadReport r = master.run(replay);
+  LoadGenerator::print(path, r);
+  TEST_ASSERT_EQUAL(0, r.dropped);
+}
+
+int main() {
+  Serial.mute(true);
+  UNITY_BEGIN();
+  RUN_TEST(test_line_pace);
+  RUN_TEST(test_back_to_back);
+  RUN_TEST(test_bad_crc);
+  RUN_TEST(test_other_slaves);
+  RUN_TEST(test_capture_format);
+  RUN_TEST(test_capture_overflow);
+  RUN_TEST(test_capture_drain_idle);
+  RUN_TEST(test_capture_replay);
+  RUN_TEST(test_replay_file);
+  return UNITY_END();
+}
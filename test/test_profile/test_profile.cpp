@@ -0,0 +1,158 @@
+/**
+ * @file    test_profile.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the poll profile: a master polls our meter and another slave on the
+ *          line, the profile learns the windows, their interval and jitter and the replies,
+ *          listening only as well, and prepares the responses before the polls come in, on
+ *          a line we serve as a slave.
+ *          Run with: pio test -e native -f test_profile
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <DTSU666.h>
+#include <SoftwareSerial.h>
+#include <PollProfile.h>
+#include <array>
+#include "../test_load/loadgen.h"
+
+SimBus          bus;
+SoftwareSerial  slaveLine(bus);
+SoftwareSerial  otherLine(bus);
+SoftwareSerial  masterLine(bus);
+SoftwareRtu     slaveRtu(slaveLine);
+SoftwareRtu     otherRtu(otherLine);
+SoftwareRtu     masterRtu(masterLine);
+DTSU666         meter(1);
+DTSU666         other(2);     // a real meter next to us, on a line of its own
+PollProfile     profile;
+
+LoadGenerator   master(masterLine, [] { meter.task(); other.task(); }, { 1, 2 });
+
+// the windows a battery polls, for ids in turn, every periodUs with some jitter
+static std::vector<loadFrame> polls(const std::vector<std::array<word, 3>> & windows, size_t rounds, ulong periodUs) {
+  std::vector<loadFrame> frames;
+  uint32_t seed = 3;
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t w = 0; w < windows.size(); w++) {
+      seed = seed * 1103515245 + 12345;
+      ulong at = r * periodUs + w * (periodUs / windows.size()) + (seed >> 16) % 1000;
+      frames.push_back({ at, false, readFrame(windows[w][0], windows[w][1], windows[w][2]) });
+    }
+  }
+  return frames;
+}
+
+static const profileWindow * findWindow(uint8_t id, word start, word count) {
+  for (size_t i = 0; i < profile.numWindows(); i++) {
+    const profileWindow & w = profile.window(i);
+    if (w.slaveId == id && w.start == start && w.count == count) return &w;
+  }
+  return nullptr;
+}
+
+void setUp() {
+  masterRtu.begin(9600, RTU_8N1);
+  profile.clear();
+  meter.bus()->profile(&profile);
+  meter.bus()->listen(false);
+}
+
+void tearDown() {}
+
+void test_learn() {
+  ulong period = 40000;
+  loadReport r = master.run(polls({ { 1, 0x2000, 0x46 }, { 2, 0x2012, 8 }, { 1, 0x101E, 12 }, { 9, 0x2000, 2 } }, 20, period));
+  LoadGenerator::print("learn", r);
+  TEST_ASSERT_EQUAL(0, r.dropped);
+
+  TEST_ASSERT_EQUAL(4, profile.numWindows());
+  const profileWindow * ours = findWindow(1, 0x2000, 0x46);
+  const profileWindow * theirs = findWindow(2, 0x2012, 8);
+  const profileWindow * nobody = findWindow(9, 0x2000, 2);
+  TEST_ASSERT_NOT_NULL(ours);
+  TEST_ASSERT_NOT_NULL(theirs);
+  TEST_ASSERT_NOT_NULL(nobody);
+  TEST_ASSERT_EQUAL(20, ours->polls);
+  TEST_ASSERT_EQUAL(20, ours->replies);
+  TEST_ASSERT_EQUAL(20, theirs->replies);      // the replies of the other slave
+  TEST_ASSERT_EQUAL(0, nobody->replies);
+  TEST_ASSERT_EQUAL(19, nobody->unanswered);   // the last one had no request after it
+  TEST_ASSERT_UINT32_WITHIN(period / 10, period, ours->intervalUs);
+  TEST_ASSERT_UINT32_WITHIN(period / 10, period, theirs->intervalUs);
+  TEST_ASSERT_TRUE(ours->jitterUs < period / 10);
+  // the simulated line takes no time, a reply is a task() of the other meter away
+  TEST_ASSERT_TRUE(theirs->replyUs > 0 && theirs->replyUs < LOAD_TIMEOUT_US);
+  TEST_ASSERT_EQUAL(0, profile.unmatched());
+
+  char json[1024];
+  size_t n = profile.json(json, sizeof(json));
+  TEST_ASSERT_EQUAL('[', json[0]);
+  TEST_ASSERT_EQUAL(']', json[n - 1]);
+  TEST_ASSERT_NOT_NULL(strstr(json, "{\"id\":2,\"fc\":3,\"start\":8210,\"count\":8,\"polls\":20,"));
+  // too small for a window: an empty array, never half of one
+  TEST_ASSERT_EQUAL(2, profile.json(json, 21));
+  TEST_ASSERT_EQUAL_STRING("[]", json);
+  size_t one = profile.json(json, sizeof(json), 0, 1);
+  TEST_ASSERT_EQUAL(one, profile.json(json, one + 1 + 100, 0, 2));   // the second does not fit
+  TEST_ASSERT_EQUAL(']', json[one - 1]);
+  n = profile.json(json, sizeof(json), 3, 4);   // the last one only
+  TEST_ASSERT_EQUAL(0, strncmp(json, "[{\"id\":9,", 9));
+  TEST_ASSERT_EQUAL(']', json[n - 1]);
+}
+
+// listening, our meter keeps quiet and the profile still learns from the other one
+void test_listen_only() {
+  meter.bus()->listen(true);
+  uint32_t responses = meter.stats().responses;
+  loadReport r = master.run(polls({ { 1, 0x2000, 0x46 }, { 2, 0x2000, 0x46 } }, 4, 20000));
+  LoadGenerator::print("listening", r);
+  TEST_ASSERT_EQUAL(4, r.dropped);
+  TEST_ASSERT_EQUAL(responses, meter.stats().responses);
+  TEST_ASSERT_EQUAL(4, findWindow(1, 0x2000, 0x46)->polls);
+  TEST_ASSERT_EQUAL(0, findWindow(1, 0x2000, 0x46)->replies);
+  TEST_ASSERT_EQUAL(4, findWindow(2, 0x2000, 0x46)->replies);
+}
+
+// more windows than the frame cache holds: without a profile every poll misses. Our meter is
+// a slave, as on the device: the responses are prepared when the bus is idle between the polls
+void test_prefetch() {
+  TEST_ASSERT_EQUAL(1, meter.bus()->modbus().slave());
+  std::vector<std::array<word, 3>> windows = {
+    { 1, 0x2000, 6 }, { 1, 0x2006, 6 }, { 1, 0x200C, 6 }, { 1, 0x2012, 8 }, { 1, 0x201A, 8 }, { 1, 0x202A, 8 }
+  };
+  meter.bus()->profile(nullptr);
+  uint32_t hits = meter.stats().hits, misses = meter.stats().misses;
+  master.run(polls(windows, 10, 60000));
+  TEST_ASSERT_EQUAL(0, meter.stats().hits - hits);
+  TEST_ASSERT_EQUAL(60, meter.stats().misses - misses);
+
+  meter.bus()->profile(&profile);
+  hits = meter.stats().hits;
+  misses = meter.stats().misses;
+  loadReport r = master.run(polls(windows, 20, 60000));
+  LoadGenerator::print("prefetch", r);
+  uint32_t ready = 0;
+  for (size_t i = 0; i < profile.numWindows(); i++) ready += profile.window(i).ready;
+  char msg[96];
+  snprintf(msg, sizeof(msg), "%u of 120 polls found their response prepared, %u cache hits",
+           (unsigned) ready, (unsigned) (meter.stats().hits - hits));
+  TEST_MESSAGE(msg);
+  // once the intervals are known, after PROFILE_MIN_POLLS rounds
+  TEST_ASSERT_TRUE(ready >= 6 * (20 - PROFILE_MIN_POLLS) * 3 / 4);
+  TEST_ASSERT_TRUE(meter.stats().hits - hits >= ready * 3 / 4);
+}
+
+int main() {
+  Serial.mute(true);
+  meter.begin(&slaveRtu, -1, 1);
+  other.begin(&otherRtu, -1, 2);
+  UNITY_BEGIN();
+  RUN_TEST(test_learn);
+  RUN_TEST(test_listen_only);
+  RUN_TEST(test_prefetch);
+  return UNITY_END();
+}
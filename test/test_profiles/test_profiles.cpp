@@ -0,0 +1,197 @@
+/**
+ * @file    test_profiles.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the meter profiles: the bytes on the wire for known values, for
+ *          each model and encoding. All meters share one simulated line.
+ *          Run with: pio test -e native -f test_profiles
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <DTSU666.h>
+#include <DDSU666.h>
+#include <SDM630.h>
+#include <SoftwareSerial.h>
+
+// fixed point, low word first, to cover the other encoding
+inline constexpr registerDef TestRegs[] PROGMEM = {
+{ 0x0,REG_WORD,"Addr", "Communication address",1 } ,
+{ 0x100,REG_FLOAT,"U", "Voltage",0, 100 } ,
+{ 0x102,REG_FLOAT,"P", "Active power",0 }
+};
+inline constexpr auto TestMap = REGISTER_MAP(TestRegs);
+
+struct TestProfile {
+  static constexpr auto &     map = TestMap;
+  typedef longLowFirst        encoding;
+  static constexpr uint8_t    readFc = Modbus::FC_READ_REGS;
+  static constexpr word       configEnd = 0x100;
+  static constexpr word       regProt = NO_REG, regBaud = NO_REG, regAddr = 0x0;
+  static constexpr const uint32_t * bauds = nullptr;
+  static constexpr size_t     numBauds = 0;
+  static constexpr const derivedDef * derived = nullptr;
+  static constexpr size_t     numDerived = 0;
+};
+
+SimBus          line;
+SoftwareSerial  slaveLine(line);
+SoftwareSerial  masterLine(line);
+SoftwareRtu     slaveRtu(slaveLine);
+MeterBus        bus;
+DTSU666         dtsu(1);
+DDSU666         ddsu(2);
+SDM630          sdm(3);
+Meter<TestProfile> fixed(4);
+
+static uint8_t  response[MODBUS_MAX_FRAME];
+static size_t   responseLen;
+
+static void request(uint8_t slaveId, uint8_t fc, word address, word count) {
+  uint8_t frame[8] = { slaveId, fc, (uint8_t) (address >> 8), (uint8_t) address, (uint8_t) (count >> 8), (uint8_t) count };
+  masterLine.write(frame, appendCrc(frame, 6));
+  masterLine.flush();
+  bus.task();
+  responseLen = 0;
+  while (masterLine.available() && responseLen < sizeof(response)) response[responseLen++] = masterLine.read();
+}
+
+// the data bytes of a read response
+static void assertData(const uint8_t * expected, size_t len) {
+  TEST_ASSERT_EQUAL(3 + len + 2, responseLen);
+  TEST_ASSERT_EQUAL(0, crc16(response, responseLen));
+  TEST_ASSERT_EQUAL(len, response[2]);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, response + 3, len);
+}
+
+static void assertException(uint8_t code) {
+  TEST_ASSERT_EQUAL(5, responseLen);
+  TEST_ASSERT_EQUAL(0x80, response[1] & 0x80);
+  TEST_ASSERT_EQUAL(code, response[2]);
+}
+
+void setUp() {}
+void tearDown() {}
+
+// 0.1 V, 0.01 Hz, 0.1 W units, IEEE floats high word first
+void test_dtsu666() {
+  dtsu.setValue(0x2006, 230.0f);      // 2300.0
+  dtsu.setValue(0x2008, 231.5f);      // 2315.0
+  request(1, Modbus::FC_READ_REGS, 0x2006, 4);
+  const uint8_t volts[] = { 0x45, 0x0F, 0xC0, 0x00, 0x45, 0x10, 0xB0, 0x00 };
+  assertData(volts, sizeof(volts));
+
+  dtsu.setValue(0x2012, -1500.0f);    // -15000.0
+  dtsu.setValue(0x2044, 50.0f);       // 5000.0
+  request(1, Modbus::FC_READ_REGS, 0x2012, 2);
+  const uint8_t power[] = { 0xC6, 0x6A, 0x60, 0x00 };
+  assertData(power, sizeof(power));
+  request(1, Modbus::FC_READ_REGS, 0x2044, 2);
+  const uint8_t freq[] = { 0x45, 0x9C, 0x40, 0x00 };
+  assertData(freq, sizeof(freq));
+
+  // the configuration words, raw
+  request(1, Modbus::FC_READ_REGS, 0x2c, 3);
+  const uint8_t config[] = { 0x00, 0x03, 0x00, 0x03, 0x00, 0x01 };
+  assertData(config, sizeof(config));
+
+  request(1, Modbus::FC_READ_INPUT_REGS, 0x2000, 2);
+  assertException(Modbus::EX_ILLEGAL_FUNCTION);
+}
+
+// V, A, kW, floats high word first
+void test_ddsu666() {
+  ddsu.setValue(0x2000, 230.0f);
+  ddsu.setValue(0x2004, 1500.0f);     // 1.5 kW
+  request(2, Modbus::FC_READ_REGS, 0x2000, 6);
+  TEST_ASSERT_EQUAL(3 + 12 + 2, responseLen);
+  const uint8_t volts[] = { 0x43, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(volts, response + 3, sizeof(volts));
+  // 1500 * 0.001 is 1.5 give or take the last bit
+  TEST_ASSERT_EQUAL_FLOAT(1.5f, ddsu.getReg(0x2004));
+
+  // the default frequency, in Hz
+  request(2, Modbus::FC_READ_REGS, 0x200E, 2);
+  const uint8_t freq[] = { 0x42, 0x48, 0x00, 0x00 };
+  assertData(freq, sizeof(freq));
+}
+
+// input registers, V and W, floats high word first
+void test_sdm630() {
+  sdm.setValue(0x0000, 230.0f);
+  sdm.setValue(0x0034, -1500.0f);
+  request(3, Modbus::FC_READ_INPUT_REGS, 0x0000, 2);
+  const uint8_t volts[] = { 0x43, 0x66, 0x00, 0x00 };
+  assertData(volts, sizeof(volts));
+  request(3, Modbus::FC_READ_INPUT_REGS, 0x0034, 2);
+  const uint8_t power[] = { 0xC4, 0xBB, 0x80, 0x00 };
+  assertData(power, sizeof(power));
+
+  request(3, Modbus::FC_READ_REGS, 0x0000, 2);
+  assertException(Modbus::EX_ILLEGAL_FUNCTION);
+  // nothing is writable
+  uint8_t frame[8] = { 3, Modbus::FC_WRITE_REG, 0x00, 0x00, 0x00, 0x01 };
+  masterLine.write(frame, appendCrc(frame, 6));
+  masterLine.flush();
+  bus.task();
+  responseLen = 0;
+  while (masterLine.available()) response[responseLen++] = masterLine.read();
+  assertException(Modbus::EX_ILLEGAL_ADDRESS);
+}
+
+// scaled to 0.01 V and rounded, signed 32 bit, low word first
+void test_fixed_point() {
+  fixed.setValue(0x100, 12.345f);      // 1234.5 -> 1235 = 0x04D3
+  fixed.setReg(0x102, -2);             // 0xFFFFFFFE
+  request(4, Modbus::FC_READ_REGS, 0x100, 4);
+  const uint8_t data[] = { 0x04, 0xD3, 0x00, 0x00, 0xFF, 0xFE, 0xFF, 0xFF };
+  assertData(data, sizeof(data));
+  TEST_ASSERT_EQUAL_FLOAT(1235.0f, fixed.getReg(0x100));
+  TEST_ASSERT_EQUAL_FLOAT(-2.0f, fixed.getReg(0x102));
+
+  fixed.setReg(0x102, 3e9f);           // clamped
+  request(4, Modbus::FC_READ_REGS, 0x102, 2);
+  const uint8_t clamped[] = { 0xFF, 0xFF, 0x7F, 0xFF };
+  assertData(clamped, sizeof(clamped));
+}
+
+// the planner of a master works on the registers of its profile
+void test_scan() {
+  static SimBus scanLine;
+  static SoftwareSerial slaveSide(scanLine), masterSide(scanLine);
+  static SoftwareRtu slaveSideRtu(slaveSide), masterSideRtu(masterSide);
+  static SDM630 remote(9), master;
+  remote.begin(&slaveSideRtu, -1, 9);
+  master.begin(&masterSideRtu, -1);
+  remote.setValue(0x0156, 1234.5f);
+  hostOnYield([] { remote.task(); });
+  size_t regsRead = master.readMeterData(9, false);
+  hostClearYield();
+  // the wide holes of the map are not worth reading
+  TEST_ASSERT_EQUAL(84, regsRead);
+  TEST_ASSERT_EQUAL(3, master.plannedRequests());
+  TEST_ASSERT_EQUAL(11, master.legacyRequests());
+  TEST_ASSERT_EQUAL_FLOAT(1234.5f, master.getReg(0x0156));
+  TEST_ASSERT_EQUAL_FLOAT(50.0f, master.getReg(0x0046));
+}
+
+int main() {
+  Serial.mute(true);
+  slaveLine.begin(9600);
+  masterLine.begin(9600);
+  bus.begin(&slaveRtu, -1);
+  dtsu.begin(bus);
+  ddsu.begin(bus);
+  sdm.begin(bus);
+  fixed.begin(bus);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_dtsu666);
+  RUN_TEST(test_ddsu666);
+  RUN_TEST(test_sdm630);
+  RUN_TEST(test_fixed_point);
+  RUN_TEST(test_scan);
+  return UNITY_END();
+}
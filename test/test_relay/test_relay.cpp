@@ -0,0 +1,148 @@
+/**
+ * @file    test_relay.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the relay: the changed words only in a copy, and a real meter on one
+ *          line mirrored to a battery on another, with the configuration read less often and
+ *          the bytes on the upstream line per minute against reading everything every time.
+ *          Run with: pio test -e native -f test_relay
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <DTSU666.h>
+#include <Relay.h>
+#include <SoftwareSerial.h>
+
+// the real meter and the master that reads it
+SimBus          upLine;
+SoftwareSerial  remoteSide(upLine);
+SoftwareSerial  masterSide(upLine);
+SoftwareRtu     remoteRtu(remoteSide);
+SoftwareRtu     masterRtu(masterSide);
+DTSU666         remote(5);
+DTSU666         upstream;
+
+// the emulated meter and the battery that polls it
+SimBus          downLine;
+SoftwareSerial  slaveSide(downLine);
+SoftwareSerial  batterySide(downLine);
+SoftwareRtu     slaveRtu(slaveSide);
+DTSU666         downstream(1);
+
+Relay<DTSU666Profile> relay(upstream, downstream);
+
+static void assertMirrored(word address) {
+  TEST_ASSERT_EQUAL_HEX16(upstream.Hreg(address), downstream.Hreg(address));
+  TEST_ASSERT_EQUAL_HEX16(upstream.Hreg(address + 1), downstream.Hreg(address + 1));
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_copy_delta() {
+  DTSU666 a, b(1);
+  static MeterBus busA, busB;
+  a.begin(busA);
+  b.begin(busB, 1);
+  a.setValue(0x2014, 1000);
+  TEST_ASSERT_EQUAL(DTSU666::SPAN, a.copyTo(b));     // the first copy: all of it
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 1000, b.getValue(0x2014));
+  TEST_ASSERT_EQUAL(0, a.copyTo(b));                 // nothing changed
+
+  a.beginUpdate();
+  a.setValue(0x2014, 1200);
+  a.setValue(0x2016, 300);
+  a.setValue(0x2044, 50.01f);
+  a.commit();
+  // Pt, computed before the copy, Pa and Pb: a run of 6 words. Then Freq
+  TEST_ASSERT_EQUAL(8, a.copyTo(b));
+  TEST_ASSERT_FLOAT_WITHIN(0.1f, 1500, b.getValue(0x2012));
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 50.01f, b.getValue(0x2044));
+
+  // the line settings stay those of the destination
+  a.setReg(REG_ADDR, 7);
+  TEST_ASSERT_EQUAL(1, a.copyTo(b));
+  TEST_ASSERT_EQUAL(1, b.Hreg(REG_ADDR));
+
+  // b changed by itself: the next copy makes it equal again
+  b.setReg(0x0006, 40);
+  TEST_ASSERT_EQUAL(DTSU666::SPAN, a.copyTo(b));
+  TEST_ASSERT_EQUAL(1, b.Hreg(0x0006));
+  // and so does a copy after one to another meter
+  DTSU666 c;
+  static MeterBus busC;
+  c.begin(busC);
+  a.copyTo(c);
+  TEST_ASSERT_EQUAL(DTSU666::SPAN, a.copyTo(b));
+}
+
+// 10 minutes, a second per scan, the remote meter changes its powers every 3 s
+void test_relay() {
+  remote.begin(&remoteRtu, -1, 5);
+  upstream.begin(&masterRtu, -1);
+  downstream.begin(&slaveRtu, -1, 1);
+  relay.begin(5, 1000, 300000, 0);
+
+  ulong end = 600000;
+  for (ulong now = 0; now < end; now += 100) {
+    if (now % 3000 == 0) {
+      remote.beginUpdate();
+      remote.setValue(0x2014, 1000 + (now / 3000) % 50);
+      remote.setValue(0x2016, 500 - (now / 3000) % 20);
+      remote.commit();
+    }
+    if (now == 200000) remote.setReg(0x0006, 25);    // a new current transformer rate
+    relay.task(now);
+    for (int i = 0; i < 8 && upstream.isScanning(); i++) {
+      remote.task();
+      upstream.task();
+    }
+    if (now == 250000) TEST_ASSERT_EQUAL(1, downstream.Hreg(0x0006));     // not read yet
+  }
+  while (upstream.isScanning()) {
+    remote.task();
+    upstream.task();
+  }
+
+  const relayStats & s = relay.stats();
+  char msg[160];
+  snprintf(msg, sizeof(msg), "%u scans, %u with config, %u failed, %u words copied, %u B/min on the line, %u B/min reading all",
+           (unsigned) s.scans, (unsigned) s.configScans, (unsigned) s.failed, (unsigned) s.wordsCopied,
+           (unsigned) relay.wirePerMinute(end), (unsigned) relay.fullPerMinute(end));
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_EQUAL(0, s.failed);
+  TEST_ASSERT_EQUAL(600, s.scans);
+  TEST_ASSERT_EQUAL(2, s.configScans);
+  TEST_ASSERT_TRUE(relay.wirePerMinute(end) < relay.fullPerMinute(end));
+  // the first copy is the whole image, after that about 2 floats and Pt, every 3 s
+  TEST_ASSERT_TRUE(s.wordsCopied < DTSU666::SPAN + 200 * 12);
+
+  TEST_ASSERT_EQUAL(25, downstream.Hreg(0x0006));
+  TEST_ASSERT_EQUAL(1, downstream.Hreg(REG_ADDR));
+  assertMirrored(0x2012);
+  assertMirrored(0x2014);
+  assertMirrored(0x2016);
+  TEST_ASSERT_FLOAT_WITHIN(0.5f, remote.getValue(0x2014), downstream.getValue(0x2014));
+
+  // and the battery reads it
+  uint8_t frame[8] = { 1, Modbus::FC_READ_REGS, 0x20, 0x14, 0, 2 };
+  batterySide.write(frame, appendCrc(frame, 6));
+  batterySide.flush();
+  downstream.task();
+  uint8_t response[9];
+  size_t len = 0;
+  while (batterySide.available() && len < sizeof(response)) response[len++] = batterySide.read();
+  TEST_ASSERT_EQUAL(9, len);
+  TEST_ASSERT_EQUAL_HEX8(upstream.Hreg(0x2014) >> 8, response[3]);
+}
+
+int main() {
+  Serial.mute(true);
+  UNITY_BEGIN();
+  RUN_TEST(test_copy_delta);
+  RUN_TEST(test_relay);
+  return UNITY_END();
+}
@@ -0,0 +1,201 @@
+/**
+ * @file    test_rtu.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the RTU transport: line settings written by the master with FC06 and
+ *          FC16 take effect after the response, on a simulated line that garbles frames sent
+ *          with another speed or format.
+ *          Run with: pio test -e native -f test_rtu
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <DTSU666.h>
+#include <SoftwareSerial.h>
+
+SimBus          bus;
+SoftwareSerial  slaveLine(bus);
+SoftwareSerial  masterLine(bus);
+SoftwareRtu     slaveRtu(slaveLine);
+SoftwareRtu     masterRtu(masterLine);
+DTSU666         meter(1);
+
+static uint8_t  response[MODBUS_MAX_FRAME];
+static size_t   responseLen;
+
+// one request from the master, the response of the meter in response[]
+static void request(const uint8_t * pdu, size_t len, uint8_t slaveId = 1) {
+  uint8_t frame[MODBUS_MAX_FRAME] = { slaveId };
+  memcpy(frame + 1, pdu, len);
+  len = appendCrc(frame, len + 1);
+  masterLine.write(frame, len);
+  masterLine.flush();
+  meter.task();
+  responseLen = 0;
+  while (masterLine.available() && responseLen < sizeof(response)) response[responseLen++] = masterLine.read();
+}
+
+static bool responseOk() {
+  return responseLen >= 5 && crc16(response, responseLen) == 0 && (response[1] & 0x80) == 0;
+}
+
+static uint8_t exceptionCode() {
+  return responseLen == 5 && crc16(response, responseLen) == 0 && (response[1] & 0x80) ? response[2] : 0;
+}
+
+static void writeReg(word address, word value, uint8_t slaveId = 1) {
+  uint8_t pdu[] = { Modbus::FC_WRITE_REG, (uint8_t) (address >> 8), (uint8_t) address, (uint8_t) (value >> 8), (uint8_t) value };
+  request(pdu, sizeof(pdu), slaveId);
+}
+
+static void readRegs(word address, word count, uint8_t slaveId = 1) {
+  uint8_t pdu[] = { Modbus::FC_READ_REGS, (uint8_t) (address >> 8), (uint8_t) address, (uint8_t) (count >> 8), (uint8_t) count };
+  request(pdu, sizeof(pdu), slaveId);
+}
+
+void setUp() {
+  meter.begin(&slaveRtu, -1, 1);
+  masterRtu.begin(9600, RTU_8N1);
+}
+
+void tearDown() {}
+
+void test_frame_gap() {
+  masterRtu.begin(9600);
+  TEST_ASSERT_EQUAL(4010, masterRtu.frameGapUs());
+  masterRtu.begin(1200);
+  TEST_ASSERT_EQUAL(32083, masterRtu.frameGapUs());
+  masterRtu.begin(38400);
+  TEST_ASSERT_EQUAL(1750, masterRtu.frameGapUs());
+
+  // two frames of the meter in a row: the second one waits for the gap, a response does not
+  const uint8_t frame[] = { 1, Modbus::FC_READ_REGS, 0, 0 };
+  ulong at = micros();
+  meter.bus()->send(frame, sizeof(frame));
+  meter.bus()->send(frame, sizeof(frame));
+  ulong elapsed = micros() - at;
+  while (masterLine.available()) masterLine.read();
+  TEST_ASSERT_GREATER_OR_EQUAL(slaveRtu.frameGapUs(), elapsed);
+  masterRtu.begin(9600);
+  at = micros();
+  readRegs(0x2000, 2);
+  TEST_ASSERT_TRUE(responseOk());
+  TEST_ASSERT_LESS_THAN(slaveRtu.frameGapUs(), micros() - at);
+}
+
+// a line we serve: the Modbus layer keeps our id, the bus is idle once a frame gap has passed
+// since the last byte came in
+void test_idle() {
+  TEST_ASSERT_EQUAL(1, meter.bus()->modbus().slave());
+  ulong at = micros();
+  while (micros() - at < slaveRtu.frameGapUs()) meter.task();
+  TEST_ASSERT_TRUE(meter.isIdle());
+  TEST_ASSERT_FALSE(meter.isBusy());
+
+  uint8_t frame[8] = { 1, Modbus::FC_READ_REGS, 0x20, 0x00, 0, 2 };
+  masterLine.write(frame, appendCrc(frame, 6));
+  masterLine.flush();
+  TEST_ASSERT_FALSE(meter.isIdle());        // a request coming in
+  meter.task();
+  TEST_ASSERT_FALSE(meter.isIdle());        // answered, the line not silent long enough yet
+  while (masterLine.available()) masterLine.read();
+  at = micros();
+  while (micros() - at < slaveRtu.frameGapUs()) meter.task();
+  TEST_ASSERT_TRUE(meter.isIdle());
+}
+
+void test_write_baud() {
+  writeReg(REG_BAUD, 2);
+  // the echo still comes at the old speed
+  TEST_ASSERT_TRUE(responseOk());
+  TEST_ASSERT_EQUAL(6 + 2, responseLen);
+  TEST_ASSERT_EQUAL(4800, slaveRtu.baud());
+  TEST_ASSERT_EQUAL(2, meter.Hreg(REG_BAUD));
+
+  // the master at the old speed gets nothing sensible
+  readRegs(0x2000, 2);
+  TEST_ASSERT_FALSE(responseOk());
+
+  masterRtu.begin(4800);
+  readRegs(0x2000, 2);
+  TEST_ASSERT_TRUE(responseOk());
+}
+
+void test_write_format_and_baud() {
+  uint8_t pdu[] = { Modbus::FC_WRITE_REGS, 0x00, REG_PROT, 0x00, 0x02, 0x04, 0x00, RTU_8E1, 0x00, 0x01 };
+  request(pdu, sizeof(pdu));
+  TEST_ASSERT_TRUE(responseOk());
+  TEST_ASSERT_EQUAL(Modbus::FC_WRITE_REGS, response[1]);
+  TEST_ASSERT_EQUAL(2, response[5]);
+  TEST_ASSERT_EQUAL(RTU_8E1, slaveRtu.format());
+  TEST_ASSERT_EQUAL(2400, slaveRtu.baud());
+
+  masterRtu.begin(2400, RTU_8N1);
+  readRegs(0x0, 4);
+  TEST_ASSERT_FALSE(responseOk());
+  masterRtu.begin(2400, RTU_8E1);
+  readRegs(0x0, 4);
+  TEST_ASSERT_TRUE(responseOk());
+}
+
+void test_write_rejected() {
+  writeReg(REG_BAUD, 7);
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_VALUE, exceptionCode());
+  TEST_ASSERT_EQUAL(9600, slaveRtu.baud());
+
+  writeReg(0x2000, 1);
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_ADDRESS, exceptionCode());
+  writeReg(0x0004, 1);      // a hole
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_ADDRESS, exceptionCode());
+
+  // byte count does not match
+  uint8_t pdu[] = { Modbus::FC_WRITE_REGS, 0x00, REG_BAUD, 0x00, 0x01, 0x04, 0x00, 0x01 };
+  request(pdu, sizeof(pdu));
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_VALUE, exceptionCode());
+  TEST_ASSERT_EQUAL(3, meter.Hreg(REG_BAUD));
+}
+
+// a read of the wrong length is a bad value, not an unknown function
+void test_read_bad_length() {
+  uint32_t badFrames = meter.stats().badFrames;
+  uint8_t pdu[] = { Modbus::FC_READ_REGS, 0x20, 0x00, 0x00, 0x02, 0x00 };
+  request(pdu, sizeof(pdu));
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_VALUE, exceptionCode());
+  TEST_ASSERT_EQUAL(badFrames + 1, meter.stats().badFrames);
+  uint8_t unknown[] = { Modbus::FC_READ_INPUT_REGS, 0x20, 0x00, 0x00, 0x02 };
+  request(unknown, sizeof(unknown));
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_FUNCTION, exceptionCode());
+  TEST_ASSERT_EQUAL(badFrames + 1, meter.stats().badFrames);
+}
+
+void test_write_address() {
+  word saved = 0;
+  meter.onConfigWrite([&](word address, word value) { if (address == REG_ADDR) saved = value; });
+  readRegs(0x2000, 0x46);
+  writeReg(REG_ADDR, 7);
+  TEST_ASSERT_TRUE(responseOk());
+  TEST_ASSERT_EQUAL(1, response[0]);
+  TEST_ASSERT_EQUAL(7, saved);
+
+  readRegs(0x2000, 0x46, 1);
+  TEST_ASSERT_EQUAL(0, responseLen);
+  readRegs(0x2000, 0x46, 7);
+  TEST_ASSERT_TRUE(responseOk());
+  TEST_ASSERT_EQUAL(7, response[0]);
+  meter.onConfigWrite(nullptr);
+}
+
+int main() {
+  Serial.mute(true);
+  UNITY_BEGIN();
+  RUN_TEST(test_frame_gap);
+  RUN_TEST(test_idle);
+  RUN_TEST(test_write_baud);
+  RUN_TEST(test_write_format_and_baud);
+  RUN_TEST(test_write_rejected);
+  RUN_TEST(test_read_bad_length);
+  RUN_TEST(test_write_address);
+  return UNITY_END();
+}
@@ -0,0 +1,233 @@
+/**
+ * @file    test_tcp.cpp
+ * @author  Michiel Steltman (git: michielfromNL, msteltman@disway.nl
+ * @brief   Host tests of the Modbus TCP server, against a client on the loopback: the same
+ *          registers as on the RS485 line, one request per task(), a bounded number of clients.
+ *          Run with: pio test -e native -f test_tcp
+ * @version 1.0
+ * @date    2024-06-30
+ *
+ * @copyright Copyright (c) 2024, MIT license
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <DTSU666.h>
+#include <ModbusTcp.h>
+#include <SoftwareSerial.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+SimBus          line;
+SoftwareSerial  slaveLine(line);
+SoftwareSerial  masterLine(line);
+SoftwareRtu     slaveRtu(slaveLine);
+MeterBus        bus;
+DTSU666         meter(1);
+DTSU666         meter2(7);
+ModbusTcpServer tcp(0);   // any free port
+
+static uint8_t  response[TCP_MAX_ADU];
+static size_t   responseLen;
+
+// a plain blocking client, with a short receive timeout
+static int connectClient() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(tcp.server().port());
+  TEST_ASSERT_EQUAL(0, connect(fd, (sockaddr *) &addr, sizeof(addr)));
+  timeval tv = { 0, 20000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  for (int i = 0; i < 10 && tcp.numClients() == 0; i++) tcp.task();
+  return fd;
+}
+
+static size_t readRequest(uint8_t * adu, word transaction, uint8_t unit, uint8_t fc, word address, word count) {
+  uint8_t request[] = { (uint8_t) (transaction >> 8), (uint8_t) transaction, 0, 0, 0, 6, unit, fc,
+                        (uint8_t) (address >> 8), (uint8_t) address, (uint8_t) (count >> 8), (uint8_t) count };
+  memcpy(adu, request, sizeof(request));
+  return sizeof(request);
+}
+
+// run the server until a complete response is in
+static void receive(int fd) {
+  responseLen = 0;
+  for (int i = 0; i < 100; i++) {
+    tcp.task();
+    ssize_t n = recv(fd, response + responseLen, sizeof(response) - responseLen, 0);
+    if (n > 0) responseLen += n;
+    if (responseLen >= MBAP_SIZE && responseLen >= MBAP_SIZE - 1 + (size_t) ((response[4] << 8) | response[5])) return;
+  }
+  TEST_FAIL_MESSAGE("no response");
+}
+
+static void transact(int fd, word transaction, uint8_t unit, uint8_t fc, word address, word count) {
+  uint8_t adu[12];
+  send(fd, adu, readRequest(adu, transaction, unit, fc, address, count), 0);
+  receive(fd);
+}
+
+// the same read on the RS485 line, the data of the response
+static size_t rtuRead(uint8_t slaveId, word address, word count, uint8_t * data) {
+  uint8_t frame[8] = { slaveId, Modbus::FC_READ_REGS, (uint8_t) (address >> 8), (uint8_t) address, (uint8_t) (count >> 8), (uint8_t) count };
+  masterLine.write(frame, appendCrc(frame, 6));
+  masterLine.flush();
+  bus.task();
+  uint8_t rtu[MODBUS_MAX_FRAME];
+  size_t len = 0;
+  while (masterLine.available()) rtu[len++] = masterLine.read();
+  memcpy(data, rtu + 3, rtu[2]);
+  return rtu[2];
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_same_as_rtu() {
+  meter.setValue(0x2006, 231.5f);
+  meter.setValue(0x2012, -1234.5f);
+  int fd = connectClient();
+  transact(fd, 0x1234, 1, Modbus::FC_READ_REGS, 0x2000, 0x46);
+  TEST_ASSERT_EQUAL(MBAP_SIZE + 2 + 0x8c, responseLen);
+  const uint8_t header[] = { 0x12, 0x34, 0, 0, 0, 3 + 0x8c, 1, 3, 0x8c };
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(header, response, sizeof(header));
+  uint8_t data[MODBUS_MAX_FRAME];
+  TEST_ASSERT_EQUAL(0x8c, rtuRead(1, 0x2000, 0x46, data));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, response + 9, 0x8c);
+
+  // across a hole and a section, copied
+  transact(fd, 2, 1, Modbus::FC_READ_REGS, 0x0000, 0x30);
+  TEST_ASSERT_EQUAL(0x60, response[8]);
+  rtuRead(1, 0x0000, 0x30, data);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, response + 9, 0x60);
+  close(fd);
+}
+
+// the unit id picks the meter, 0xff is the first one
+void test_units() {
+  meter2.setValue(0x2044, 49.5f);
+  int fd = connectClient();
+  transact(fd, 1, 7, Modbus::FC_READ_REGS, 0x2044, 2);
+  const uint8_t freq[] = { 0x45, 0x9A, 0xB0, 0x00 };
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(freq, response + 9, 4);
+  transact(fd, 2, 0xff, Modbus::FC_READ_REGS, 0x2e, 1);
+  TEST_ASSERT_EQUAL(1, response[10]);
+  close(fd);
+}
+
+void test_exceptions() {
+  int fd = connectClient();
+  uint32_t exceptions = tcp.stats().exceptions;
+  transact(fd, 1, 9, Modbus::FC_READ_REGS, 0x2000, 2);
+  TEST_ASSERT_EQUAL(0x83, response[7]);
+  TEST_ASSERT_EQUAL(0x0B, response[8]);
+  transact(fd, 2, 1, Modbus::FC_WRITE_REG, 0x2e, 5);    // read only
+  TEST_ASSERT_EQUAL(0x86, response[7]);
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_FUNCTION, response[8]);
+  transact(fd, 3, 1, Modbus::FC_READ_REGS, 0x3000, 2);
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_ADDRESS, response[8]);
+  // a read too short for its fields: rejected, not read from what the buffer had before
+  const uint8_t shortRead[] = { 0, 4, 0, 0, 0, 3, 1, Modbus::FC_READ_REGS, 0x20 };
+  send(fd, shortRead, sizeof(shortRead), 0);
+  receive(fd);
+  TEST_ASSERT_EQUAL(MBAP_SIZE + 2, responseLen);
+  TEST_ASSERT_EQUAL(0x83, response[7]);
+  TEST_ASSERT_EQUAL(Modbus::EX_ILLEGAL_FUNCTION, response[8]);
+  TEST_ASSERT_EQUAL(exceptions + 4, tcp.stats().exceptions);
+  TEST_ASSERT_EQUAL(1, meter.slaveId());
+  close(fd);
+}
+
+// served as in loop(): only when the RS485 line is idle, which it is between the polls
+void test_idle_gated() {
+  int fd = connectClient();
+  uint8_t adu[12], data[MODBUS_MAX_FRAME];
+  send(fd, adu, readRequest(adu, 5, 1, Modbus::FC_READ_REGS, 0x2044, 2), 0);
+  TEST_ASSERT_EQUAL(4, rtuRead(1, 0x2044, 2, data));
+  uint32_t requests = tcp.stats().requests;
+  TEST_ASSERT_FALSE(bus.isIdle());
+  ulong start = millis();
+  while (tcp.stats().requests == requests && millis() - start < 100) {
+    bus.task();
+    if (bus.isIdle()) tcp.task();
+  }
+  TEST_ASSERT_EQUAL(requests + 1, tcp.stats().requests);
+  TEST_ASSERT_TRUE(bus.isIdle());
+  receive(fd);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, response + 9, 4);
+  close(fd);
+}
+
+// two requests in one segment: one per task(), in order
+void test_pipelined() {
+  int fd = connectClient();
+  uint8_t adu[24];
+  size_t len = readRequest(adu, 1, 1, Modbus::FC_READ_REGS, 0x2044, 2);
+  len += readRequest(adu + len, 2, 1, Modbus::FC_READ_REGS, 0x2e, 1);
+  send(fd, adu, len, 0);
+  uint32_t requests = tcp.stats().requests;
+  while (tcp.stats().requests == requests) tcp.task();
+  TEST_ASSERT_EQUAL(requests + 1, tcp.stats().requests);
+  tcp.task();
+  TEST_ASSERT_EQUAL(requests + 2, tcp.stats().requests);
+  responseLen = 0;
+  while (responseLen < 13 + 11) {
+    ssize_t n = recv(fd, response + responseLen, sizeof(response) - responseLen, 0);
+    TEST_ASSERT_GREATER_THAN(0, n);
+    responseLen += n;
+  }
+  TEST_ASSERT_EQUAL(1, response[1]);
+  TEST_ASSERT_EQUAL(2, response[13 + 1]);
+  close(fd);
+}
+
+// no more clients than slots, a closed client frees its slot
+void test_max_clients() {
+  for (int i = 0; i < 5; i++) tcp.task();
+  TEST_ASSERT_EQUAL(0, tcp.numClients());
+  int fds[TCP_MAX_CLIENTS + 1];
+  for (auto & fd : fds) fd = connectClient();
+  for (int i = 0; i < 5; i++) tcp.task();
+  TEST_ASSERT_EQUAL(TCP_MAX_CLIENTS, tcp.numClients());
+  TEST_ASSERT_GREATER_THAN(0, tcp.stats().refused);
+  uint8_t b;
+  TEST_ASSERT_EQUAL(0, recv(fds[TCP_MAX_CLIENTS], &b, 1, 0));   // closed on it
+  transact(fds[0], 1, 1, Modbus::FC_READ_REGS, 0x2044, 2);
+  for (auto fd : fds) close(fd);
+  for (int i = 0; i < 5; i++) tcp.task();
+  TEST_ASSERT_EQUAL(0, tcp.numClients());
+}
+
+// a header that is not Modbus closes the connection
+void test_bad_header() {
+  int fd = connectClient();
+  const uint8_t junk[] = "GET / HTTP/1.0\r\n\r\n";
+  send(fd, junk, sizeof(junk), 0);
+  for (int i = 0; i < 5; i++) tcp.task();
+  TEST_ASSERT_EQUAL(0, tcp.numClients());
+  close(fd);
+}
+
+int main() {
+  Serial.mute(true);
+  slaveLine.begin(9600);
+  masterLine.begin(9600);
+  bus.begin(&slaveRtu, -1);
+  meter.begin(bus);
+  meter2.begin(bus);
+  tcp.begin(bus);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_same_as_rtu);
+  RUN_TEST(test_units);
+  RUN_TEST(test_exceptions);
+  RUN_TEST(test_pipelined);
+  RUN_TEST(test_idle_gated);
+  RUN_TEST(test_max_clients);
+  RUN_TEST(test_bad_header);
+  return UNITY_END();
+}